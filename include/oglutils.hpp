@@ -4,6 +4,7 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <iostream> // For debug logs in deleters
 
@@ -104,6 +105,12 @@ struct GlProgramDeleter {
   }
 };
 
+struct GlSyncDeleter {
+  void operator()(GLsync sync) const {
+    if (sync) glDeleteSync(sync);
+  }
+};
+
 // --- RAII Type Aliases ---
 
 // Use unique_ptr for clear, exclusive ownership of resources.
@@ -113,6 +120,7 @@ using UniqueGlBuffer = std::unique_ptr<GLuint, GlBufferDeleter>;
 using UniqueGlVertexArray = std::unique_ptr<GLuint, GlVertexArrayDeleter>;
 using UniqueGlTexture = std::unique_ptr<GLuint, GlTextureDeleter>;
 using UniqueGlProgram = std::unique_ptr<GLuint, GlProgramDeleter>;
+using UniqueGlSync = std::unique_ptr<std::remove_pointer_t<GLsync>, GlSyncDeleter>;
 
 // --- RAII Helper Functions ---
 
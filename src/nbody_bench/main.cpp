@@ -0,0 +1,424 @@
+// Benchmark sweep of the N-body solver.
+//
+// Runs nbody::Simulation headlessly over every combination of the given particle counts, grid sizes,
+// work-group sizes, initial distributions and solvers and reports the steady-state throughput, e.g.:
+//   nbody_bench --device cpu --particles 1000,10000 --solver grid,barnes-hut --json bench.json
+// Every case is warmed up first (first launches, caches, clocks), then timed over several repetitions.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Simulation.h>
+
+namespace {
+
+struct Options {
+  std::string platform;                  // substring of the platform name, empty = any
+  cl_device_type deviceType = CL_DEVICE_TYPE_ALL;
+  std::vector<int> particleCounts{ 1000, 10000, 50000 };
+  std::vector<std::pair<int, int>> grids{ { 64, 64 } };
+  std::vector<size_t> localSizes{ 64, 128, 256 };
+  std::vector<nbody::Distribution> distributions; // empty = all
+  std::vector<nbody::SolverType> solvers;         // empty = all
+  nbody::Integrator integrator = nbody::Integrator::Euler;
+  int reorderInterval = 0;               // Morton reordering of the particle arrays every n steps, 0 = off
+  int warmupSteps = 5;
+  int steps = 20;                        // per repetition
+  int repetitions = 5;
+  float gravityConstant = 0.0001f;
+  float deltaTime = 0.001f;
+  std::uint64_t seed = 1;                // fixed, so runs are comparable
+  std::string kernelDirectory;
+  std::string programCacheDirectory;
+  bool specializeKernels = true;
+  std::string jsonFile;
+  std::string csvFile;
+};
+
+struct Result {
+  nbody::SolverType solver;
+  nbody::Distribution distribution;
+  int particles = 0;
+  int gridNx = 0;
+  int gridNy = 0;
+  size_t localSize = 0;
+  double medianStepMs = 0.0;
+  double minStepMs = 0.0;
+  double stepsPerSecond = 0.0;
+  double interactionsPerSecond = 0.0;    // N^2 pairs per force evaluation, the work of the direct sum
+};
+
+void printUsage(const char* exe) {
+  std::cout
+    << "Usage: " << exe << " [options]\n"
+    << "Lists are comma separated; every combination is run.\n"
+    << "  --platform <name>       OpenCL platform name substring (default: any)\n"
+    << "  --device <cpu|gpu|all>  OpenCL device type (default: all)\n"
+    << "  --particles <list>      Particle counts (default: 1000,10000,50000)\n"
+    << "  --grid <list>           Grid resolutions as NXxNY (default: 64x64; only for grid, fmm and p3m)\n"
+    << "  --local-size <list>     Work-group sizes (default: 64,128,256)\n"
+    << "  --dist <list>           uniform | ring | triangle | gaussian | spiral (default: all)\n"
+    << "  --solver <list>         grid | barnes-hut | fmm | pm | p3m | exact (default: all)\n"
+    << "  --integrator <name>     euler | leapfrog | yoshida4 (default: euler)\n"
+    << "  --reorder <n>           Sort the particle arrays by Morton code every n steps, 0 = off (default: 0)\n"
+    << "  --warmup <n>            Untimed steps before every case (default: 5)\n"
+    << "  --steps <n>             Steps per timed repetition (default: 20)\n"
+    << "  --repeat <n>            Timed repetitions, the median is reported (default: 5)\n"
+    << "  --seed <n>              Random seed of the initial conditions (default: 1)\n"
+    << "  --G <value>             Gravitational constant (default: 0.0001)\n"
+    << "  --dt <value>            Time step (default: 0.001)\n"
+    << "  --kernels <dir>         Directory of the .cl sources\n"
+    << "  --program-cache <dir>   Cache compiled program binaries in <dir> (default: off)\n"
+    << "  --generic-kernels       Benchmark the generic kernels instead of the specialised variants\n"
+    << "  --json <file>           Write the results as JSON\n"
+    << "  --csv <file>            Write the results as CSV\n";
+}
+
+std::vector<std::string> splitList(const std::string& text) {
+  std::vector<std::string> items;
+  std::stringstream stream(text);
+  for (std::string item; std::getline(stream, item, ','); ) {
+    if (!item.empty())
+      items.push_back(item);
+  }
+  if (items.empty())
+    throw std::invalid_argument("Empty list: " + text);
+  return items;
+}
+
+template <typename Enum>
+Enum parseName(const std::string& name, int count, const char* (*toName)(Enum), const char* what) {
+  for (int i = 0; i < count; ++i) {
+    const auto value = static_cast<Enum>(i);
+    if (name == toName(value))
+      return value;
+  }
+  throw std::invalid_argument(std::string("Unknown ") + what + ": " + name);
+}
+
+std::pair<int, int> parseGrid(const std::string& text) {
+  const size_t separator = text.find('x');
+  if (separator == std::string::npos)
+    throw std::invalid_argument("Grid must be given as NXxNY: " + text);
+  return { std::stoi(text.substr(0, separator)), std::stoi(text.substr(separator + 1)) };
+}
+
+cl_device_type parseDeviceType(const std::string& name) {
+  if (name == "cpu") return CL_DEVICE_TYPE_CPU;
+  if (name == "gpu") return CL_DEVICE_TYPE_GPU;
+  if (name == "all") return CL_DEVICE_TYPE_ALL;
+  throw std::invalid_argument("Unknown device type: " + name);
+}
+
+Options parseOptions(int argc, char* argv[]) {
+  Options options;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::invalid_argument("Missing value for " + arg);
+      return argv[++i];
+    };
+
+    if (arg == "--help" || arg == "-h") {
+      printUsage(argv[0]);
+      std::exit(EXIT_SUCCESS);
+    }
+    else if (arg == "--platform")   options.platform = next();
+    else if (arg == "--device")     options.deviceType = parseDeviceType(next());
+    else if (arg == "--particles") {
+      options.particleCounts.clear();
+      for (const auto& item : splitList(next()))
+        options.particleCounts.push_back(std::stoi(item));
+    }
+    else if (arg == "--grid") {
+      options.grids.clear();
+      for (const auto& item : splitList(next()))
+        options.grids.push_back(parseGrid(item));
+    }
+    else if (arg == "--local-size") {
+      options.localSizes.clear();
+      for (const auto& item : splitList(next()))
+        options.localSizes.push_back(std::stoul(item));
+    }
+    else if (arg == "--dist") {
+      options.distributions.clear();
+      for (const auto& item : splitList(next()))
+        options.distributions.push_back(parseName(item, nbody::DistributionCount, nbody::DistributionName, "distribution"));
+    }
+    else if (arg == "--solver") {
+      options.solvers.clear();
+      for (const auto& item : splitList(next()))
+        options.solvers.push_back(parseName(item, nbody::SolverCount, nbody::SolverName, "solver"));
+    }
+    else if (arg == "--reorder")    options.reorderInterval = std::stoi(next());
+    else if (arg == "--integrator") options.integrator = parseName(next(), nbody::IntegratorCount, nbody::IntegratorName, "integrator");
+    else if (arg == "--warmup")     options.warmupSteps = std::stoi(next());
+    else if (arg == "--steps")      options.steps = std::stoi(next());
+    else if (arg == "--repeat")     options.repetitions = std::stoi(next());
+    else if (arg == "--seed")       options.seed = std::stoull(next());
+    else if (arg == "--G")          options.gravityConstant = std::stof(next());
+    else if (arg == "--dt")         options.deltaTime = std::stof(next());
+    else if (arg == "--kernels")    options.kernelDirectory = next();
+    else if (arg == "--program-cache") options.programCacheDirectory = next();
+    else if (arg == "--generic-kernels") options.specializeKernels = false;
+    else if (arg == "--json")       options.jsonFile = next();
+    else if (arg == "--csv")        options.csvFile = next();
+    else
+      throw std::invalid_argument("Unknown option: " + arg);
+  }
+
+  if (options.distributions.empty()) {
+    for (int i = 0; i < nbody::DistributionCount; ++i)
+      options.distributions.push_back(static_cast<nbody::Distribution>(i));
+  }
+  if (options.solvers.empty()) {
+    for (int i = 0; i < nbody::SolverCount; ++i)
+      options.solvers.push_back(static_cast<nbody::SolverType>(i));
+  }
+  for (const int count : options.particleCounts) {
+    if (count <= 0)
+      throw std::invalid_argument("--particles must be positive");
+  }
+  if (options.warmupSteps < 0 || options.steps <= 0 || options.repetitions <= 0)
+    throw std::invalid_argument("--warmup must be >= 0, --steps and --repeat positive");
+  return options;
+}
+
+// Solvers whose work depends on SimulationConfig::gridNx/gridNy; the others run at the first grid only
+bool usesGrid(nbody::SolverType solver) {
+  return solver == nbody::SolverType::Grid || solver == nbody::SolverType::FMM || solver == nbody::SolverType::P3M;
+}
+
+// Force evaluations per step of the integrator
+int forceEvaluations(nbody::Integrator integrator) {
+  nbody::IntegrationStage stages[nbody::MaxIntegrationStages];
+  float lastDrift = 0.0f;
+  return nbody::IntegrationStages(integrator, 1.0f, lastDrift, stages);
+}
+
+Result measure(nbody::Simulation& simulation, const Options& options, const nbody::InitialConditionParams& initial) {
+  simulation.Init(nbody::GenerateInitialConditions(initial));
+
+  simulation.Step(options.warmupSteps);
+  simulation.Finish();
+
+  using Clock = std::chrono::steady_clock;
+  std::vector<double> stepMs;
+  for (int repetition = 0; repetition < options.repetitions; ++repetition) {
+    const auto start = Clock::now();
+    simulation.Step(options.steps);
+    simulation.Finish();
+    stepMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count() / options.steps);
+  }
+  std::sort(stepMs.begin(), stepMs.end());
+
+  const auto& config = simulation.GetConfig();
+  Result result;
+  result.solver = simulation.GetSolver();
+  result.distribution = initial.distribution;
+  result.particles = initial.numParticles;
+  result.gridNx = config.gridNx;
+  result.gridNy = config.gridNy;
+  result.localSize = config.localSize;
+  result.medianStepMs = stepMs[stepMs.size() / 2];
+  result.minStepMs = stepMs.front();
+  result.stepsPerSecond = result.medianStepMs > 0.0 ? 1000.0 / result.medianStepMs : 0.0;
+  result.interactionsPerSecond = result.stepsPerSecond * forceEvaluations(options.integrator)
+                               * static_cast<double>(result.particles) * result.particles;
+  return result;
+}
+
+void printResult(const Result& result) {
+  std::cout << std::left << std::setw(12) << nbody::SolverName(result.solver)
+            << std::setw(10) << nbody::DistributionName(result.distribution) << std::right
+            << std::setw(9) << result.particles
+            << std::setw(10) << (std::to_string(result.gridNx) + "x" + std::to_string(result.gridNy))
+            << std::setw(7) << result.localSize << std::fixed << std::setprecision(4)
+            << std::setw(12) << result.medianStepMs << std::setw(12) << result.minStepMs << std::setprecision(1)
+            << std::setw(12) << result.stepsPerSecond << std::scientific << std::setprecision(3)
+            << std::setw(14) << result.interactionsPerSecond << std::defaultfloat << '\n';
+}
+
+void writeJsonString(std::ostream& out, const std::string& text) {
+  out << '"';
+  for (const char c : text) {
+    if (c == '"' || c == '\\')
+      out << '\\';
+    out << (static_cast<unsigned char>(c) < 0x20 ? ' ' : c);
+  }
+  out << '"';
+}
+
+void writeJson(const std::string& fileName, const Options& options, const cl::Device& device, const std::vector<Result>& results) {
+  std::ofstream out(fileName);
+  if (!out)
+    throw std::runtime_error("Failed to open output file: " + fileName);
+
+  const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+  out << "{\n  \"platform\": ";
+  writeJsonString(out, platform.getInfo<CL_PLATFORM_NAME>());
+  out << ",\n  \"device\": ";
+  writeJsonString(out, device.getInfo<CL_DEVICE_NAME>());
+  out << ",\n  \"driver\": ";
+  writeJsonString(out, device.getInfo<CL_DRIVER_VERSION>());
+  out << ",\n  \"integrator\": \"" << nbody::IntegratorName(options.integrator) << "\""
+      << ",\n  \"reorderInterval\": " << options.reorderInterval
+      << ",\n  \"warmupSteps\": " << options.warmupSteps
+      << ",\n  \"steps\": " << options.steps
+      << ",\n  \"repetitions\": " << options.repetitions
+      << ",\n  \"results\": [";
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    out << (i == 0 ? "\n" : ",\n")
+        << "    {\"solver\": \"" << nbody::SolverName(result.solver) << "\""
+        << ", \"distribution\": \"" << nbody::DistributionName(result.distribution) << "\""
+        << ", \"particles\": " << result.particles
+        << ", \"gridNx\": " << result.gridNx
+        << ", \"gridNy\": " << result.gridNy
+        << ", \"localSize\": " << result.localSize
+        << std::setprecision(9)
+        << ", \"medianStepMs\": " << result.medianStepMs
+        << ", \"minStepMs\": " << result.minStepMs
+        << ", \"stepsPerSecond\": " << result.stepsPerSecond
+        << ", \"interactionsPerSecond\": " << result.interactionsPerSecond << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+void writeCsv(const std::string& fileName, const std::vector<Result>& results) {
+  std::ofstream out(fileName);
+  if (!out)
+    throw std::runtime_error("Failed to open output file: " + fileName);
+
+  out << "solver,distribution,particles,gridNx,gridNy,localSize,medianStepMs,minStepMs,stepsPerSecond,interactionsPerSecond\n"
+      << std::setprecision(9);
+  for (const Result& result : results) {
+    out << nbody::SolverName(result.solver) << ',' << nbody::DistributionName(result.distribution) << ','
+        << result.particles << ',' << result.gridNx << ',' << result.gridNy << ',' << result.localSize << ','
+        << result.medianStepMs << ',' << result.minStepMs << ','
+        << result.stepsPerSecond << ',' << result.interactionsPerSecond << '\n';
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    const Options options = parseOptions(argc, argv);
+
+    cl::Context context;
+    if (!oclCreateContextBy(context, options.platform, options.deviceType))
+      throw cl::Error(CL_DEVICE_NOT_FOUND, "Failed to create an OpenCL context for the requested platform/device");
+
+    const auto device = context.getInfo<CL_CONTEXT_DEVICES>().front();
+    std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << '\n'
+              << "Integrator: " << nbody::IntegratorName(options.integrator) << ", reorder every " << options.reorderInterval
+              << " steps, warm-up " << options.warmupSteps
+              << " steps, " << options.repetitions << " x " << options.steps << " timed steps per case\n\n";
+
+    std::cout << std::left << std::setw(12) << "solver" << std::setw(10) << "dist" << std::right
+              << std::setw(9) << "N" << std::setw(10) << "grid" << std::setw(7) << "local"
+              << std::setw(12) << "median ms" << std::setw(12) << "min ms"
+              << std::setw(12) << "steps/s" << std::setw(14) << "pairs/s" << '\n';
+
+    const int maxParticles = *std::max_element(options.particleCounts.begin(), options.particleCounts.end());
+    const size_t maxLocalSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
+    std::vector<Result> results;
+    for (size_t gridIndex = 0; gridIndex < options.grids.size(); ++gridIndex) {
+      for (const size_t localSize : options.localSizes) {
+        if (localSize > maxLocalSize) {
+          std::cout << "skipping work-group size " << localSize << " (device maximum " << maxLocalSize << ")\n";
+          continue;
+        }
+
+        // One simulation (and program build) per grid and work-group size, sized for the largest particle count
+        nbody::SimulationConfig config;
+        config.maxParticles = maxParticles;
+        config.gridNx = options.grids[gridIndex].first;
+        config.gridNy = options.grids[gridIndex].second;
+        config.localSize = localSize;
+        config.kernelDirectory = options.kernelDirectory;
+        config.programCacheDirectory = options.programCacheDirectory;
+        config.specializeKernels = options.specializeKernels;
+
+        std::unique_ptr<nbody::Simulation> simulation;
+        try {
+          simulation = std::make_unique<nbody::Simulation>(context, device, config);
+        }
+        catch (const std::exception& e) {
+          std::cout << "skipping grid " << config.gridNx << "x" << config.gridNy << ", work-group size " << localSize
+                    << ": " << e.what() << '\n';
+          continue;
+        }
+        simulation->SetGravityConstant(options.gravityConstant);
+        simulation->SetTimeStep(options.deltaTime);
+        simulation->SetIntegrator(options.integrator);
+        simulation->SetReorderInterval(options.reorderInterval);
+
+        for (const auto solver : options.solvers) {
+          if (gridIndex > 0 && !usesGrid(solver))
+            continue;
+          if (solver == nbody::SolverType::P3M && !nbody::SupportsP3M(config)) {
+            std::cout << "skipping p3m on grid " << config.gridNx << "x" << config.gridNy << ": finer than its PM mesh allows\n";
+            continue;
+          }
+          simulation->SetSolver(solver);
+
+          for (const auto distribution : options.distributions) {
+            for (const int particles : options.particleCounts) {
+              nbody::InitialConditionParams initial;
+              initial.numParticles = particles;
+              initial.distribution = distribution;
+              initial.seed = options.seed;
+
+              try {
+                results.push_back(measure(*simulation, options, initial));
+                printResult(results.back());
+              }
+              catch (const cl::Error& e) {
+                // e.g. out of resources for this work-group size; the remaining cases still run
+                std::cout << "failed: " << nbody::SolverName(solver) << ", " << nbody::DistributionName(distribution)
+                          << ", N = " << particles << ": " << e.what() << " (" << oclErrorString(e.err()) << ")\n";
+                simulation->GetQueue().finish();
+              }
+            }
+          }
+        }
+      }
+    }
+
+    if (!options.jsonFile.empty()) {
+      writeJson(options.jsonFile, options, device, results);
+      std::cout << "Results written to " << options.jsonFile << '\n';
+    }
+    if (!options.csvFile.empty()) {
+      writeCsv(options.csvFile, results);
+      std::cout << "Results written to " << options.csvFile << '\n';
+    }
+  }
+  catch (const cl::Error& e) {
+    std::cerr << "OpenCL Error (" << e.err() << " - " << oclErrorString(e.err()) << "): " << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+  catch (const std::exception& e) {
+    std::cerr << "A fatal error occurred: " << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
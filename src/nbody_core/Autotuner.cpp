@@ -0,0 +1,202 @@
+#include "Autotuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "ProgramCache.h"
+
+namespace nbody {
+
+namespace {
+	constexpr int WarmupSteps = 3;
+	constexpr int TimedSteps = 5;
+	constexpr int Repetitions = 3;
+
+	// Square grids tried by the solvers that bin into the cell grid
+	constexpr int GridCandidates[] = { 32, 64, 128, 256 };
+
+	bool UsesGrid(SolverType solver) {
+		return solver == SolverType::Grid || solver == SolverType::FMM || solver == SolverType::P3M;
+	}
+
+	int ParticleBucket(int numParticles) {
+		int bucket = 1;
+		while (bucket < numParticles)
+			bucket <<= 1;
+		return bucket;
+	}
+
+	// Keys are one field of a tab separated line
+	std::string Sanitize(std::string text) {
+		std::replace_if(text.begin(), text.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+		return text;
+	}
+}
+
+Autotuner::Autotuner(const cl::Context& context_, const cl::Device& device_, std::string cacheFile_)
+	: context(context_), device(device_), cacheFile(std::move(cacheFile_))
+{
+	Load();
+}
+
+bool Autotuner::Lookup(const SimulationConfig& base, SolverType solver, int numParticles, Result& result) const {
+	const auto found = cache.find(MakeKey(base, solver, numParticles));
+	if (found == cache.end())
+		return false;
+	result = found->second;
+	return true;
+}
+
+Autotuner::Result Autotuner::Tune(const SimulationConfig& base, SolverType solver, const InitialConditionParams& initial) {
+	const ParticleState state = GenerateInitialConditions(initial);
+
+	SimulationConfig config = base;
+	config.maxParticles = static_cast<int>(state.size());
+	config.profiling = false;
+
+	Result best;
+	best.stepMs = -1.0;
+	auto tryCandidate = [&](size_t localSize, int gridNx, int gridNy) {
+		config.localSize = localSize;
+		config.gridNx = gridNx;
+		config.gridNy = gridNy;
+		const double stepMs = TimeCandidate(config, solver, state);
+		if (stepMs >= 0.0 && (best.stepMs < 0.0 || stepMs < best.stepMs))
+			best = { localSize, gridNx, gridNy, stepMs };
+	};
+
+	// P3M only runs on grids coarse enough for its mesh (see SupportsP3M): a finer grid shrinks its near field
+	// and would time as the fastest
+	auto gridAllowed = [&](int gridNx, int gridNy) {
+		SimulationConfig candidate = base;
+		candidate.gridNx = gridNx;
+		candidate.gridNy = gridNy;
+		return solver != SolverType::P3M || SupportsP3M(candidate);
+	};
+	int startNx = base.gridNx;
+	int startNy = base.gridNy;
+	if (!gridAllowed(startNx, startNy)) {
+		startNx = startNy = 0;
+		for (const int grid : GridCandidates) {
+			if (gridAllowed(grid, grid))
+				startNx = startNy = grid; // the finest one allowed
+		}
+		if (startNx == 0)
+			throw std::invalid_argument("Autotuner: the PM mesh is too coarse for P3M on every candidate grid");
+	}
+
+	// Work-group sizes at the given grid, then the grid at the best work-group size
+	const size_t maxLocalSize = std::min<size_t>(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(), 1024);
+	for (size_t localSize = 32; localSize <= maxLocalSize; localSize <<= 1)
+		tryCandidate(localSize, startNx, startNy);
+
+	if (best.stepMs < 0.0)
+		throw cl::Error(CL_INVALID_WORK_GROUP_SIZE, "Autotuner: no work-group size runs on this device");
+
+	if (UsesGrid(solver)) {
+		const size_t localSize = best.localSize;
+		for (const int grid : GridCandidates) {
+			if ((grid != startNx || grid != startNy) && gridAllowed(grid, grid))
+				tryCandidate(localSize, grid, grid);
+		}
+	}
+
+	// Merged with the results other processes saved since this one loaded the cache, so parallel tuning runs
+	// sharing the file keep each other's results
+	Load();
+	cache[MakeKey(base, solver, initial.numParticles)] = best;
+	Save();
+	return best;
+}
+
+Autotuner::Result Autotuner::LookupOrTune(const SimulationConfig& base, SolverType solver, const InitialConditionParams& initial) {
+	Result result;
+	if (Lookup(base, solver, initial.numParticles, result))
+		return result;
+	return Tune(base, solver, initial);
+}
+
+void Autotuner::Apply(const Result& result, SimulationConfig& config) {
+	config.localSize = result.localSize;
+	config.gridNx = result.gridNx;
+	config.gridNy = result.gridNy;
+}
+
+std::string Autotuner::MakeKey(const SimulationConfig& base, SolverType solver, int numParticles) const {
+	std::ostringstream key;
+	key << Sanitize(device.getInfo<CL_DEVICE_NAME>()) << '|' << Sanitize(device.getInfo<CL_DRIVER_VERSION>())
+	    << '|' << std::hex << KernelSourceHash(base) << std::dec
+	    << '|' << SolverName(solver) << '|' << ParticleBucket(numParticles);
+	if (solver == SolverType::PM || solver == SolverType::P3M)
+		key << '|' << base.pmMeshNx << 'x' << base.pmMeshNy;
+	return key.str();
+}
+
+double Autotuner::TimeCandidate(const SimulationConfig& config, SolverType solver, const ParticleState& state) const {
+	using Clock = std::chrono::steady_clock;
+
+	try {
+		Simulation simulation(context, device, config);
+		simulation.SetSolver(solver);
+		simulation.Init(state);
+
+		simulation.Step(WarmupSteps);
+		simulation.Finish();
+
+		std::vector<double> stepMs;
+		for (int repetition = 0; repetition < Repetitions; ++repetition) {
+			const auto start = Clock::now();
+			simulation.Step(TimedSteps);
+			simulation.Finish();
+			stepMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count() / TimedSteps);
+		}
+		std::sort(stepMs.begin(), stepMs.end());
+		return stepMs[stepMs.size() / 2];
+	}
+	catch (const cl::Error&) {
+		// e.g. out of resources (local memory, registers) at this work-group size
+		return -1.0;
+	}
+}
+
+void Autotuner::Load() {
+	std::ifstream in(cacheFile);
+	for (std::string line; std::getline(in, line); ) {
+		std::istringstream fields(line);
+		std::string key;
+		Result result;
+		if (std::getline(fields, key, '\t') && fields >> result.localSize >> result.gridNx >> result.gridNy >> result.stepMs)
+			cache[key] = result;
+	}
+}
+
+void Autotuner::Save() const {
+	// Written next to the cache and renamed, so a concurrent reader never sees a partial file. A failed write
+	// only costs a later run the tuning again.
+	const std::string temporary = UniqueTemporaryPath(cacheFile);
+	std::error_code error;
+	{
+		std::ofstream out(temporary);
+		for (const auto& [key, result] : cache)
+			out << key << '\t' << result.localSize << '\t' << result.gridNx << '\t' << result.gridNy << '\t' << result.stepMs << '\n';
+		if (!out.flush())
+			error = std::make_error_code(std::errc::io_error);
+	}
+	if (!error)
+		std::filesystem::rename(temporary, cacheFile, error);
+	if (error) {
+		std::error_code ignored;
+		std::filesystem::remove(temporary, ignored);
+		std::cerr << "Warning: failed to write the autotuning cache " << cacheFile << ": " << error.message() << '\n';
+	}
+}
+
+} // namespace nbody
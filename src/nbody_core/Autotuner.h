@@ -0,0 +1,71 @@
+#pragma once
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <map>
+#include <string>
+
+#include "InitialConditions.h"
+#include "Simulation.h"
+
+namespace nbody {
+
+/**
+ * Picks the work-group size and the grid resolution of a Simulation for the active device by timing
+ * candidate configurations, and keeps the winners in a cache file.
+ *
+ * Every kernel of a Simulation shares SimulationConfig::localSize, so the candidates are timed as whole
+ * steps of the chosen solver: first the work-group sizes (powers of two up to the device limit) at the
+ * given grid, then - for the solvers binning particles into the cell grid - the grid resolutions with the
+ * best work-group size (for P3M only the grids its PM mesh allows, see SupportsP3M). A result is keyed by device
+ * name, driver version, KernelSourceHash, solver, the particle count rounded up to a power of two and, for PM and
+ * P3M, the mesh size, so a driver or kernel update retunes automatically.
+ *
+ * Cache file: one "key<TAB>localSize<TAB>gridNx<TAB>gridNy<TAB>stepMs" line per result.
+ */
+class Autotuner {
+public:
+	struct Result {
+		size_t localSize = 0;
+		int    gridNx = 0;
+		int    gridNy = 0;
+		double stepMs = 0.0; // measured time of one step
+	};
+
+	static constexpr const char* DefaultCacheFile = "nbody_autotune.txt";
+
+	// Loads the cache file if it exists.
+	Autotuner(const cl::Context& context, const cl::Device& device, std::string cacheFile = DefaultCacheFile);
+
+	// Cached result for the solver and particle count; false if that case has not been tuned on this device.
+	bool Lookup(const SimulationConfig& base, SolverType solver, int numParticles, Result& result) const;
+
+	// Times the candidates on 'initial' (the other fields of 'base' are kept), caches and returns the best one.
+	// Throws cl::Error if no candidate runs on the device (std::invalid_argument if no grid suits P3M); a cache file
+	// that cannot be written only prints a warning.
+	Result Tune(const SimulationConfig& base, SolverType solver, const InitialConditionParams& initial);
+
+	// Cached result, or Tune on a miss.
+	Result LookupOrTune(const SimulationConfig& base, SolverType solver, const InitialConditionParams& initial);
+
+	static void Apply(const Result& result, SimulationConfig& config);
+
+	const std::string& GetCacheFile() const { return cacheFile; }
+
+private:
+	std::string MakeKey(const SimulationConfig& base, SolverType solver, int numParticles) const;
+
+	// Milliseconds per step, or a negative value if the configuration fails on the device
+	double TimeCandidate(const SimulationConfig& config, SolverType solver, const ParticleState& state) const;
+
+	void Load();
+	void Save() const;
+
+	cl::Context context;
+	cl::Device  device;
+	std::string cacheFile;
+	std::map<std::string, Result> cache;
+};
+
+} // namespace nbody
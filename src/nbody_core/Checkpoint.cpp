@@ -0,0 +1,286 @@
+#include "Checkpoint.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include "ProgramCache.h"
+
+namespace nbody {
+
+namespace {
+	constexpr char Magic[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P' };
+	constexpr std::uint32_t ByteOrderMark = 0x01020304u; // reads back differently on a machine of the other byte order
+
+	// Arrays of ParticleArrays in file order
+	constexpr int ArrayCount = 6;
+	constexpr std::size_t ElementSizes[ArrayCount] = {
+		sizeof(glm::vec2), sizeof(glm::vec2), sizeof(float), sizeof(int), sizeof(float), sizeof(int)
+	};
+
+	// On-disk header (version 2), followed by the arrays at 'offsets'
+	struct Header {
+		char          magic[8];
+		std::uint32_t version;
+		std::uint32_t byteOrder;
+		std::uint64_t numParticles;
+		std::uint64_t step;
+		double        time;
+		std::uint64_t seed;
+		std::int32_t  gridNx, gridNy;
+		float         worldMinX, worldMaxX, worldMinY, worldMaxY;
+		std::int32_t  solver, integrator;
+		float         deltaTime, gravityConstant, softening, theta;
+		std::int32_t  farFieldRadius, maxRung;
+		float         timestepAccuracy;
+		std::int32_t  boundsInterval, reorderInterval;
+		float         lastDrift;
+		std::int32_t  boundsCountdown, stepsSinceReorder, gridGeometryFitted, reserved;
+		float         gridGeometry[8]; // clGridGeometry: world of the grid (see bounds.cl)
+		std::uint64_t offsets[ArrayCount];
+	};
+	static_assert(sizeof(Header) == 216, "The checkpoint header layout must not depend on the compiler");
+
+	std::uint64_t AlignUp(std::uint64_t value) {
+		const std::uint64_t alignment = CheckpointFile::PayloadAlignment;
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	Header MakeHeader(const CheckpointInfo& info) {
+		Header header{};
+		std::memcpy(header.magic, Magic, sizeof(Magic));
+		header.version = CheckpointVersion;
+		header.byteOrder = ByteOrderMark;
+		header.numParticles = info.numParticles;
+		header.step = info.step;
+		header.time = info.time;
+		header.seed = info.seed;
+		header.gridNx = info.gridNx;
+		header.gridNy = info.gridNy;
+		header.worldMinX = info.worldMinX;
+		header.worldMaxX = info.worldMaxX;
+		header.worldMinY = info.worldMinY;
+		header.worldMaxY = info.worldMaxY;
+		header.solver = static_cast<std::int32_t>(info.solver);
+		header.integrator = static_cast<std::int32_t>(info.integrator);
+		header.deltaTime = info.deltaTime;
+		header.gravityConstant = info.gravityConstant;
+		header.softening = info.softening;
+		header.theta = info.theta;
+		header.farFieldRadius = info.farFieldRadius;
+		header.maxRung = info.maxRung;
+		header.timestepAccuracy = info.timestepAccuracy;
+		header.boundsInterval = info.boundsInterval;
+		header.reorderInterval = info.reorderInterval;
+		header.lastDrift = info.lastDrift;
+		header.boundsCountdown = info.boundsCountdown;
+		header.stepsSinceReorder = info.stepsSinceReorder;
+		header.gridGeometryFitted = info.gridGeometryFitted ? 1 : 0;
+
+		std::uint64_t offset = AlignUp(sizeof(Header));
+		for (int i = 0; i < ArrayCount; ++i) {
+			header.offsets[i] = offset;
+			offset = AlignUp(offset + info.numParticles * ElementSizes[i]);
+		}
+		return header;
+	}
+
+	CheckpointInfo ReadHeader(const Header& header) {
+		if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0)
+			throw std::runtime_error("Not a checkpoint file");
+		if (header.byteOrder != ByteOrderMark)
+			throw std::runtime_error("Checkpoint written on a machine of the other byte order");
+		if (header.version != CheckpointVersion)
+			throw std::runtime_error("Unsupported checkpoint version " + std::to_string(header.version));
+		if (header.solver < 0 || header.solver >= SolverCount || header.integrator < 0 || header.integrator >= IntegratorCount)
+			throw std::runtime_error("Corrupt checkpoint header");
+
+		CheckpointInfo info;
+		info.numParticles = header.numParticles;
+		info.step = header.step;
+		info.time = header.time;
+		info.seed = header.seed;
+		info.gridNx = header.gridNx;
+		info.gridNy = header.gridNy;
+		info.worldMinX = header.worldMinX;
+		info.worldMaxX = header.worldMaxX;
+		info.worldMinY = header.worldMinY;
+		info.worldMaxY = header.worldMaxY;
+		info.solver = static_cast<SolverType>(header.solver);
+		info.integrator = static_cast<Integrator>(header.integrator);
+		info.deltaTime = header.deltaTime;
+		info.gravityConstant = header.gravityConstant;
+		info.softening = header.softening;
+		info.theta = header.theta;
+		info.farFieldRadius = header.farFieldRadius;
+		info.maxRung = header.maxRung;
+		info.timestepAccuracy = header.timestepAccuracy;
+		info.boundsInterval = header.boundsInterval;
+		info.reorderInterval = header.reorderInterval;
+		info.lastDrift = header.lastDrift;
+		info.boundsCountdown = header.boundsCountdown;
+		info.stepsSinceReorder = header.stepsSinceReorder;
+		info.gridGeometryFitted = header.gridGeometryFitted != 0;
+		return info;
+	}
+
+	void WriteCheckpoint(const std::string& fileName, const CheckpointInfo& info, const ParticleArrays& arrays) {
+		Header header = MakeHeader(info);
+		std::memcpy(header.gridGeometry, arrays.gridGeometry, sizeof(header.gridGeometry));
+		const void* payloads[ArrayCount] = {
+			arrays.positions.data(), arrays.velocities.data(), arrays.masses.data(),
+			arrays.rungs.data(), arrays.stepTimes.data(), arrays.particleIds.data()
+		};
+
+		// Unique temporary name: concurrent runs writing the same checkpoint never share it
+		const std::string temporary = UniqueTemporaryPath(fileName);
+		bool written;
+		{
+			std::ofstream out(temporary, std::ios::binary);
+			static const char zeros[CheckpointFile::PayloadAlignment] = {};
+			std::uint64_t position = sizeof(Header);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			for (int i = 0; i < ArrayCount; ++i) {
+				out.write(zeros, static_cast<std::streamsize>(header.offsets[i] - position));
+				const std::uint64_t bytes = info.numParticles * ElementSizes[i];
+				out.write(static_cast<const char*>(payloads[i]), static_cast<std::streamsize>(bytes));
+				position = header.offsets[i] + bytes;
+			}
+			written = static_cast<bool>(out.flush());
+		}
+		std::error_code error;
+		if (written)
+			std::filesystem::rename(temporary, fileName, error);
+		if (!written || error) {
+			std::error_code ignored;
+			std::filesystem::remove(temporary, ignored);
+			throw std::runtime_error("Failed to write checkpoint: " + fileName + (error ? ": " + error.message() : std::string()));
+		}
+	}
+}
+
+CheckpointInfo DescribeCheckpoint(const Simulation& simulation, std::uint64_t seed) {
+	const SimulationConfig& config = simulation.GetConfig();
+
+	CheckpointInfo info;
+	info.numParticles = static_cast<std::uint64_t>(simulation.GetNumParticles());
+	info.step = simulation.GetStepCount();
+	info.time = simulation.GetSimulatedTime();
+	info.seed = seed;
+	info.gridNx = config.gridNx;
+	info.gridNy = config.gridNy;
+	info.worldMinX = config.worldMinX;
+	info.worldMaxX = config.worldMaxX;
+	info.worldMinY = config.worldMinY;
+	info.worldMaxY = config.worldMaxY;
+	info.solver = simulation.GetSolver();
+	info.integrator = simulation.GetIntegrator();
+	info.deltaTime = simulation.GetTimeStep();
+	info.gravityConstant = simulation.GetGravityConstant();
+	info.softening = simulation.GetSoftening();
+	info.theta = simulation.GetTheta();
+	info.farFieldRadius = simulation.GetFarFieldRadius();
+	info.maxRung = simulation.GetMaxRung();
+	info.timestepAccuracy = simulation.GetTimestepAccuracy();
+	info.boundsInterval = simulation.GetBoundsInterval();
+	info.reorderInterval = simulation.GetReorderInterval();
+	info.lastDrift = simulation.GetLastDrift();
+	info.boundsCountdown = simulation.GetBoundsCountdown();
+	info.stepsSinceReorder = simulation.GetStepsSinceReorder();
+	info.gridGeometryFitted = simulation.IsGridGeometryFitted();
+	return info;
+}
+
+void ApplyCheckpointConfig(const CheckpointInfo& info, SimulationConfig& config) {
+	config.maxParticles = std::max(config.maxParticles, static_cast<int>(info.numParticles));
+	config.gridNx = info.gridNx;
+	config.gridNy = info.gridNy;
+	config.worldMinX = info.worldMinX;
+	config.worldMaxX = info.worldMaxX;
+	config.worldMinY = info.worldMinY;
+	config.worldMaxY = info.worldMaxY;
+}
+
+CheckpointFile::CheckpointFile(const std::string& fileName)
+	: file(fileName, "checkpoint", true) { // read ahead: the whole payload is uploaded at once
+	const unsigned char* data = file.GetData();
+	const std::size_t size = file.GetSize();
+	try {
+		if (size < sizeof(Header))
+			throw std::runtime_error("Truncated checkpoint");
+		Header header;
+		std::memcpy(&header, data, sizeof(Header));
+		info = ReadHeader(header);
+
+		if (info.numParticles > static_cast<std::uint64_t>(std::numeric_limits<int>::max()))
+			throw std::runtime_error("Corrupt checkpoint header");
+		for (int i = 0; i < ArrayCount; ++i) {
+			if (header.offsets[i] % PayloadAlignment != 0 || header.offsets[i] > size
+			    || (size - header.offsets[i]) / ElementSizes[i] < info.numParticles)
+				throw std::runtime_error("Truncated checkpoint");
+		}
+
+		arrays.count = static_cast<int>(info.numParticles);
+		arrays.positions = reinterpret_cast<const glm::vec2*>(data + header.offsets[0]);
+		arrays.velocities = reinterpret_cast<const glm::vec2*>(data + header.offsets[1]);
+		arrays.masses = reinterpret_cast<const float*>(data + header.offsets[2]);
+		arrays.rungs = reinterpret_cast<const int*>(data + header.offsets[3]);
+		arrays.stepTimes = reinterpret_cast<const float*>(data + header.offsets[4]);
+		arrays.particleIds = reinterpret_cast<const int*>(data + header.offsets[5]);
+		std::memcpy(gridGeometry, header.gridGeometry, sizeof(gridGeometry));
+		arrays.gridGeometry = info.gridGeometryFitted ? gridGeometry : nullptr;
+	}
+	catch (const std::runtime_error& e) {
+		throw std::runtime_error(fileName + ": " + e.what());
+	}
+}
+
+void CheckpointFile::Restore(Simulation& simulation) const {
+	simulation.SetSolver(info.solver);
+	simulation.SetIntegrator(info.integrator);
+	simulation.SetTimeStep(info.deltaTime);
+	simulation.SetGravityConstant(info.gravityConstant);
+	simulation.SetSoftening(info.softening); // built by Restore
+	simulation.SetTheta(info.theta);
+	simulation.SetFarFieldRadius(info.farFieldRadius);
+	simulation.SetMaxRung(info.maxRung);
+	simulation.SetTimestepAccuracy(info.timestepAccuracy);
+	simulation.SetBoundsInterval(info.boundsInterval);
+	simulation.SetReorderInterval(info.reorderInterval);
+	simulation.Restore(arrays, info.lastDrift, info.step, info.time, info.boundsCountdown, info.stepsSinceReorder);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+	if (pending.valid())
+		pending.wait();
+}
+
+void CheckpointWriter::Save(Simulation& simulation, const std::string& fileName, std::uint64_t seed) {
+	Wait();
+
+	// The arrays outlive this call: they are filled by the queue and written by the background thread
+	auto arrays = std::make_shared<ParticleArrays>();
+	const CheckpointInfo info = DescribeCheckpoint(simulation, seed);
+	const cl::Event done = simulation.EnqueueReadParticleArrays(*arrays);
+	pending = std::async(std::launch::async, [arrays, info, fileName, done]() {
+		done.wait();
+		WriteCheckpoint(fileName, info, *arrays);
+	});
+}
+
+bool CheckpointWriter::IsWriting() const {
+	return pending.valid() && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+void CheckpointWriter::Wait() {
+	if (pending.valid())
+		pending.get();
+}
+
+} // namespace nbody
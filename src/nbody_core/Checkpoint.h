@@ -0,0 +1,114 @@
+#pragma once
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <string>
+
+#include "MappedFile.h"
+#include "Simulation.h"
+
+namespace nbody {
+
+// Version of the checkpoint format written by CheckpointWriter; CheckpointFile reads exactly this version
+constexpr std::uint32_t CheckpointVersion = 2;
+
+// Run parameters stored in the header of a checkpoint
+struct CheckpointInfo {
+	std::uint64_t numParticles = 0;
+	std::uint64_t step = 0;   // Simulation::GetStepCount
+	double        time = 0.0; // Simulation::GetSimulatedTime
+	std::uint64_t seed = 0;   // seed of the initial conditions (informational)
+
+	// Allocation-time parameters (see ApplyCheckpointConfig)
+	int   gridNx = 0;
+	int   gridNy = 0;
+	float worldMinX = 0.0f;
+	float worldMaxX = 0.0f;
+	float worldMinY = 0.0f;
+	float worldMaxY = 0.0f;
+
+	// Step parameters and integrator state
+	SolverType solver = SolverType::Grid;
+	Integrator integrator = Integrator::Euler;
+	float deltaTime = 0.0f;
+	float gravityConstant = 0.0f;
+	float softening = 0.0f;
+	float theta = 0.0f;
+	int   farFieldRadius = 0;
+	int   maxRung = 0;
+	float timestepAccuracy = 0.0f;
+	int   boundsInterval = 0;
+	int   reorderInterval = 0;
+	float lastDrift = 0.0f;
+
+	// Refit and reordering cycles, so a restart fits and reorders at the same steps as the uninterrupted run
+	// (the fitted world itself is stored with the arrays, see ParticleArrays::gridGeometry)
+	int  boundsCountdown = 0;
+	int  stepsSinceReorder = 0;
+	bool gridGeometryFitted = false;
+};
+
+// Header of the current state of 'simulation'
+CheckpointInfo DescribeCheckpoint(const Simulation& simulation, std::uint64_t seed = 0);
+
+// Grid and world of the checkpoint, and at least room for its particles
+void ApplyCheckpointConfig(const CheckpointInfo& info, SimulationConfig& config);
+
+/**
+ * Memory-mapped checkpoint file (read only).
+ *
+ * Layout (little endian): a fixed header with the CheckpointInfo fields, the world of the grid and the byte
+ * offset of every particle array, followed by the arrays of ParticleArrays (positions, velocities, masses,
+ * rungs, step times, particle ids) in slot order, each starting at a multiple of PayloadAlignment. The arrays
+ * are never copied on the host: Restore uploads them straight from the mapping.
+ *
+ * Throws std::runtime_error if the file cannot be mapped or is not a checkpoint of this version.
+ */
+class CheckpointFile {
+public:
+	static constexpr std::size_t PayloadAlignment = 4096;
+
+	explicit CheckpointFile(const std::string& fileName);
+
+	const CheckpointInfo& GetInfo() const { return info; }
+
+	// Pointers into the mapping, valid while this object lives
+	ParticleArraysView GetArrays() const { return arrays; }
+
+	// Uploads the particles and applies the step parameters. The simulation must have room for the particles
+	// and should be created with ApplyCheckpointConfig for the same grid and world.
+	void Restore(Simulation& simulation) const;
+
+private:
+	MappedFile         file;
+	CheckpointInfo     info;
+	glm::vec4          gridGeometry[2];
+	ParticleArraysView arrays;
+};
+
+/**
+ * Writes checkpoints without stalling the simulation: Save only enqueues the reads of the particle
+ * arrays, and a background thread waits for them and writes the file (to a temporary name, renamed
+ * when complete, so an interrupted write never replaces the last good checkpoint).
+ */
+class CheckpointWriter {
+public:
+	~CheckpointWriter();
+
+	// Starts a checkpoint of the current state. Waits for the previous one first.
+	void Save(Simulation& simulation, const std::string& fileName, std::uint64_t seed = 0);
+
+	bool IsWriting() const;
+
+	// Waits for the pending checkpoint and rethrows its error, if any.
+	void Wait();
+
+private:
+	std::future<void> pending;
+};
+
+} // namespace nbody
@@ -0,0 +1,138 @@
+#include "CpuForces.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#if defined(NBODY_CPU_X86_SIMD)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace nbody {
+
+namespace {
+#if defined(NBODY_CPU_X86_SIMD)
+	struct CpuFeatures {
+		bool avx2 = false;
+		bool avx512 = false;
+	};
+
+	void Cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+		for (int i = 0; i < 4; ++i)
+			regs[i] = static_cast<unsigned int>(info[i]);
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	unsigned long long Xgetbv() {
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+	}
+
+	// The instruction set has to be supported by the CPU and its register state saved by the OS
+	CpuFeatures DetectCpuFeatures() {
+		CpuFeatures features;
+
+		unsigned int regs[4];
+		Cpuid(0, 0, regs);
+		if (regs[0] < 7)
+			return features;
+
+		Cpuid(1, 0, regs);
+		const bool osxsave = (regs[2] >> 27) & 1;
+		const bool avx = (regs[2] >> 28) & 1;
+		const bool fma = (regs[2] >> 12) & 1;
+		if (!osxsave || !avx)
+			return features;
+
+		const unsigned long long xcr0 = Xgetbv();
+		const bool ymmState = (xcr0 & 0x6) == 0x6;
+		const bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+		Cpuid(7, 0, regs);
+		features.avx2 = ymmState && fma && ((regs[1] >> 5) & 1);
+		features.avx512 = zmmState && ((regs[1] >> 16) & 1);
+		return features;
+	}
+
+	const CpuFeatures& GetCpuFeatures() {
+		static const CpuFeatures features = DetectCpuFeatures();
+		return features;
+	}
+#endif
+}
+
+const char* SimdLevelName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::Auto:   return "auto";
+	case SimdLevel::Scalar: return "scalar";
+	case SimdLevel::AVX2:   return "avx2";
+	case SimdLevel::AVX512: return "avx512";
+	}
+	return "unknown";
+}
+
+SimdLevel ResolveSimdLevel(SimdLevel requested) {
+#if defined(NBODY_CPU_X86_SIMD)
+	const CpuFeatures& features = GetCpuFeatures();
+	switch (requested) {
+	case SimdLevel::Auto:
+		return features.avx512 ? SimdLevel::AVX512 : features.avx2 ? SimdLevel::AVX2 : SimdLevel::Scalar;
+	case SimdLevel::AVX2:
+		if (!features.avx2)
+			throw std::invalid_argument("AVX2/FMA is not supported by this CPU");
+		return requested;
+	case SimdLevel::AVX512:
+		if (!features.avx512)
+			throw std::invalid_argument("AVX-512F is not supported by this CPU");
+		return requested;
+	case SimdLevel::Scalar:
+		return requested;
+	}
+#else
+	if (requested == SimdLevel::Auto || requested == SimdLevel::Scalar)
+		return SimdLevel::Scalar;
+#endif
+	throw std::invalid_argument(std::string("SIMD level not available in this build: ") + SimdLevelName(requested));
+}
+
+ForceFunction GetForceFunction(SimdLevel level) {
+	switch (ResolveSimdLevel(level)) {
+#if defined(NBODY_CPU_X86_SIMD)
+	case SimdLevel::AVX2:   return AccumulateForcesAVX2;
+	case SimdLevel::AVX512: return AccumulateForcesAVX512;
+#endif
+	default:                return AccumulateForcesScalar;
+	}
+}
+
+void AccumulateForcesScalar(const float* x, const float* y, const float* m, int count,
+                            float px, float py, float softening, float& ax, float& ay) {
+	float sumX = 0.0f;
+	float sumY = 0.0f;
+	for (int i = 0; i < count; ++i) {
+		const float dx = x[i] - px;
+		const float dy = y[i] - py;
+		const float invDist = 1.0f / std::sqrt(dx * dx + dy * dy + softening);
+		const float weight = m[i] * invDist * invDist * invDist;
+		sumX += dx * weight;
+		sumY += dy * weight;
+	}
+	ax += sumX;
+	ay += sumY;
+}
+
+} // namespace nbody
@@ -0,0 +1,38 @@
+#pragma once
+
+namespace nbody {
+
+// Instruction set of the CPU force loops
+enum class SimdLevel : int {
+	Auto = 0,   // Widest level supported by the CPU and the build
+	Scalar = 1,
+	AVX2 = 2,   // 8 floats per iteration (AVX2 + FMA)
+	AVX512 = 3, // 16 floats per iteration (AVX-512F)
+};
+
+constexpr int SimdLevelCount = 4;
+
+const char* SimdLevelName(SimdLevel level);
+
+/**
+ * Adds the acceleration (without G) on a particle at (px, py) from 'count' sources given as
+ * structure-of-arrays x[], y[], m[]:
+ *   sum_i m[i] * (p_i - p) / (|p_i - p|^2 + softening)^(3/2)
+ */
+using ForceFunction = void (*)(const float* x, const float* y, const float* m, int count,
+                               float px, float py, float softening, float& ax, float& ay);
+
+// Resolves Auto to the widest supported level; throws std::invalid_argument for unsupported levels.
+SimdLevel ResolveSimdLevel(SimdLevel requested);
+
+ForceFunction GetForceFunction(SimdLevel level);
+
+// Implementations, one translation unit each (compiled with the matching instruction set)
+void AccumulateForcesScalar(const float* x, const float* y, const float* m, int count,
+                            float px, float py, float softening, float& ax, float& ay);
+void AccumulateForcesAVX2(const float* x, const float* y, const float* m, int count,
+                          float px, float py, float softening, float& ax, float& ay);
+void AccumulateForcesAVX512(const float* x, const float* y, const float* m, int count,
+                            float px, float py, float softening, float& ax, float& ay);
+
+} // namespace nbody
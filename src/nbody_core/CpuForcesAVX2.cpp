@@ -0,0 +1,49 @@
+// Compiled with AVX2 + FMA enabled (see CMakeLists.txt); only called after ResolveSimdLevel checked the CPU.
+#include "CpuForces.h"
+
+#include <immintrin.h>
+
+namespace nbody {
+
+namespace {
+	float HorizontalSum(__m256 v) {
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+}
+
+void AccumulateForcesAVX2(const float* x, const float* y, const float* m, int count,
+                          float px, float py, float softening, float& ax, float& ay) {
+	const __m256 posX = _mm256_set1_ps(px);
+	const __m256 posY = _mm256_set1_ps(py);
+	const __m256 eps = _mm256_set1_ps(softening);
+	const __m256 one = _mm256_set1_ps(1.0f);
+
+	__m256 sumX = _mm256_setzero_ps();
+	__m256 sumY = _mm256_setzero_ps();
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), posX);
+		const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), posY);
+		const __m256 distSq = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, eps));
+
+		// Full-precision 1/sqrt to stay comparable with the OpenCL kernels
+		const __m256 invDist = _mm256_div_ps(one, _mm256_sqrt_ps(distSq));
+		const __m256 invDistCube = _mm256_mul_ps(invDist, _mm256_mul_ps(invDist, invDist));
+		const __m256 weight = _mm256_mul_ps(_mm256_loadu_ps(m + i), invDistCube);
+
+		sumX = _mm256_fmadd_ps(dx, weight, sumX);
+		sumY = _mm256_fmadd_ps(dy, weight, sumY);
+	}
+
+	ax += HorizontalSum(sumX);
+	ay += HorizontalSum(sumY);
+
+	if (i < count)
+		AccumulateForcesScalar(x + i, y + i, m + i, count - i, px, py, softening, ax, ay);
+}
+
+} // namespace nbody
@@ -0,0 +1,40 @@
+// Compiled with AVX-512F enabled (see CMakeLists.txt); only called after ResolveSimdLevel checked the CPU.
+#include "CpuForces.h"
+
+#include <immintrin.h>
+
+namespace nbody {
+
+void AccumulateForcesAVX512(const float* x, const float* y, const float* m, int count,
+                            float px, float py, float softening, float& ax, float& ay) {
+	const __m512 posX = _mm512_set1_ps(px);
+	const __m512 posY = _mm512_set1_ps(py);
+	const __m512 eps = _mm512_set1_ps(softening);
+	const __m512 one = _mm512_set1_ps(1.0f);
+
+	__m512 sumX = _mm512_setzero_ps();
+	__m512 sumY = _mm512_setzero_ps();
+
+	// The tail is handled by a masked iteration: masked-off lanes load zero mass and add nothing
+	for (int i = 0; i < count; i += 16) {
+		const int remaining = count - i;
+		const __mmask16 mask = remaining >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << remaining) - 1);
+
+		const __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), posX);
+		const __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y + i), posY);
+		const __m512 distSq = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, eps));
+
+		// Full-precision 1/sqrt to stay comparable with the OpenCL kernels
+		const __m512 invDist = _mm512_div_ps(one, _mm512_sqrt_ps(distSq));
+		const __m512 invDistCube = _mm512_mul_ps(invDist, _mm512_mul_ps(invDist, invDist));
+		const __m512 weight = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, m + i), invDistCube);
+
+		sumX = _mm512_fmadd_ps(dx, weight, sumX);
+		sumY = _mm512_fmadd_ps(dy, weight, sumY);
+	}
+
+	ax += _mm512_reduce_add_ps(sumX);
+	ay += _mm512_reduce_add_ps(sumY);
+}
+
+} // namespace nbody
@@ -0,0 +1,246 @@
+#include "CpuSimulation.h"
+
+#include <cstdlib>
+#include <stdexcept>
+
+namespace nbody {
+
+namespace {
+	// Default softening of the OpenCL kernels
+	constexpr float Softening = DefaultSoftening;
+
+	// Work items per ParallelFor chunk
+	constexpr size_t ParticleGrain = 4096;
+	constexpr size_t CellGrain = 8;
+}
+
+CpuSimulation::CpuSimulation(const SimulationConfig& config_, int numThreads, SimdLevel simd)
+	: config(config_), pool(numThreads), simdLevel(ResolveSimdLevel(simd)), accumulateForces(GetForceFunction(simdLevel))
+{
+	if (config.maxParticles <= 0 || config.gridNx <= 0 || config.gridNy <= 0)
+		throw std::invalid_argument("Invalid simulation configuration");
+
+	totalCells = config.gridNx * config.gridNy;
+	cellSizeInvX = config.gridNx / (config.worldMaxX - config.worldMinX);
+	cellSizeInvY = config.gridNy / (config.worldMaxY - config.worldMinY);
+
+	// Cell pyramid, laid out as in Simulation
+	int pyramidCells = 0;
+	for (int offset = 0, nx = config.gridNx, ny = config.gridNy; ; nx = (nx + 1) / 2, ny = (ny + 1) / 2) {
+		pyramidLevels.emplace_back(offset, nx, ny, 0);
+		offset += nx * ny;
+		pyramidCells = offset;
+		if (nx == 1 && ny == 1)
+			break;
+	}
+
+	cellStart.resize(totalCells);
+	cellEnd.resize(totalCells);
+	cellMass.resize(pyramidCells);
+	cellCOMX.resize(pyramidCells);
+	cellCOMY.resize(pyramidCells);
+}
+
+void CpuSimulation::Init(const ParticleState& state) {
+	if (state.size() > static_cast<size_t>(config.maxParticles))
+		throw std::invalid_argument("Particle count exceeds the simulation capacity");
+	if (state.velocities.size() != state.size() || state.masses.size() != state.size())
+		throw std::invalid_argument("Particle arrays have mismatching sizes");
+
+	numParticles = static_cast<int>(state.size());
+	lastDrift = 0.0f;
+
+	for (auto* array : { &posX, &posY, &velX, &velY, &masses, &sortedX, &sortedY, &sortedMass })
+		array->resize(numParticles);
+	particleCellIndex.resize(numParticles);
+	sortedIndex.resize(numParticles);
+
+	for (int i = 0; i < numParticles; ++i) {
+		posX[i] = state.positions[i].x;
+		posY[i] = state.positions[i].y;
+		velX[i] = state.velocities[i].x;
+		velY[i] = state.velocities[i].y;
+	}
+	std::copy(state.masses.begin(), state.masses.end(), masses.begin());
+}
+
+void CpuSimulation::ReadState(ParticleState& state) const {
+	state.resize(numParticles);
+	for (int i = 0; i < numParticles; ++i) {
+		state.positions[i] = glm::vec2(posX[i], posY[i]);
+		state.velocities[i] = glm::vec2(velX[i], velY[i]);
+	}
+	std::copy(masses.begin(), masses.end(), state.masses.begin());
+}
+
+void CpuSimulation::Step(int steps) {
+	if (numParticles == 0)
+		return;
+
+	IntegrationStage stages[MaxIntegrationStages];
+	for (int i = 0; i < steps; ++i) {
+		const int numStages = IntegrationStages(integrator, deltaTime, lastDrift, stages);
+		for (int stage = 0; stage < numStages; ++stage) {
+			BinParticles();
+			ComputeCellCOM();
+			Update(stages[stage]);
+		}
+	}
+}
+
+void CpuSimulation::BinParticles() {
+	// Cell index of every particle (clamped to the grid, as computeParticleCellIndex)
+	pool.ParallelFor(numParticles, ParticleGrain, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const int cellX = std::clamp(static_cast<int>((posX[i] - config.worldMinX) * cellSizeInvX), 0, config.gridNx - 1);
+			const int cellY = std::clamp(static_cast<int>((posY[i] - config.worldMinY) * cellSizeInvY), 0, config.gridNy - 1);
+			particleCellIndex[i] = cellX + cellY * config.gridNx;
+		}
+	});
+
+	// Counting sort: histogram -> exclusive scan -> scatter (serial, O(N) and memory bound)
+	std::fill(cellEnd.begin(), cellEnd.end(), 0);
+	for (int i = 0; i < numParticles; ++i)
+		++cellEnd[particleCellIndex[i]];
+
+	for (int cell = 0, running = 0; cell < totalCells; ++cell) {
+		cellStart[cell] = running;
+		running += cellEnd[cell];
+		cellEnd[cell] = cellStart[cell]; // insertion cursor, ends up one past the last slot
+	}
+
+	for (int i = 0; i < numParticles; ++i) {
+		const int slot = cellEnd[particleCellIndex[i]]++;
+		sortedIndex[slot] = i;
+		sortedX[slot] = posX[i];
+		sortedY[slot] = posY[i];
+		sortedMass[slot] = masses[i];
+	}
+}
+
+void CpuSimulation::ComputeCellCOM() {
+	// Level 0 from the binned particle ranges: no atomics needed
+	pool.ParallelFor(totalCells, 64 * CellGrain, [&](size_t begin, size_t end) {
+		for (size_t cell = begin; cell < end; ++cell) {
+			float mass = 0.0f, comX = 0.0f, comY = 0.0f;
+			for (int slot = cellStart[cell]; slot < cellEnd[cell]; ++slot) {
+				mass += sortedMass[slot];
+				comX += sortedX[slot] * sortedMass[slot];
+				comY += sortedY[slot] * sortedMass[slot];
+			}
+			cellMass[cell] = mass;
+			cellCOMX[cell] = comX;
+			cellCOMY[cell] = comY;
+		}
+	});
+
+	// Coarser levels (see buildPyramidLevel)
+	for (size_t level = 1; level < pyramidLevels.size(); ++level) {
+		const glm::ivec4& src = pyramidLevels[level - 1];
+		const glm::ivec4& dst = pyramidLevels[level];
+		for (int y = 0; y < dst.z; ++y) {
+			for (int x = 0; x < dst.y; ++x) {
+				float mass = 0.0f, comX = 0.0f, comY = 0.0f;
+				for (int childY = 2 * y; childY <= std::min(2 * y + 1, src.z - 1); ++childY) {
+					for (int childX = 2 * x; childX <= std::min(2 * x + 1, src.y - 1); ++childX) {
+						const int child = src.x + childX + childY * src.y;
+						mass += cellMass[child];
+						comX += cellCOMX[child];
+						comY += cellCOMY[child];
+					}
+				}
+				const int cell = dst.x + x + y * dst.y;
+				cellMass[cell] = mass;
+				cellCOMX[cell] = comX;
+				cellCOMY[cell] = comY;
+			}
+		}
+	}
+}
+
+void CpuSimulation::CollectFarField(int cellX, int cellY, std::vector<float>& x, std::vector<float>& y, std::vector<float>& m) const {
+	x.clear();
+	y.clear();
+	m.clear();
+
+	// Same level selection as the far field loop of the update kernel
+	const int numLevels = static_cast<int>(pyramidLevels.size());
+	for (int level = numLevels - 1; level >= 0; --level) {
+		const glm::ivec4& info = pyramidLevels[level];
+		const int myX = cellX >> level;
+		const int myY = cellY >> level;
+		const int exclusion = (level == 0) ? 1 : farFieldRadius;
+
+		int minX = 0, maxX = info.y - 1;
+		int minY = 0, maxY = info.z - 1;
+		if (level < numLevels - 1) {
+			const int parentX = cellX >> (level + 1);
+			const int parentY = cellY >> (level + 1);
+			minX = std::max(parentX - farFieldRadius, 0) * 2;
+			minY = std::max(parentY - farFieldRadius, 0) * 2;
+			maxX = std::min((parentX + farFieldRadius) * 2 + 1, info.y - 1);
+			maxY = std::min((parentY + farFieldRadius) * 2 + 1, info.z - 1);
+		}
+
+		for (int sourceY = minY; sourceY <= maxY; ++sourceY) {
+			for (int sourceX = minX; sourceX <= maxX; ++sourceX) {
+				if (std::abs(sourceX - myX) <= exclusion && std::abs(sourceY - myY) <= exclusion)
+					continue;
+
+				const int cell = info.x + sourceX + sourceY * info.y;
+				const float mass = cellMass[cell];
+				if (mass <= 0.0f)
+					continue;
+
+				x.push_back(cellCOMX[cell] / mass);
+				y.push_back(cellCOMY[cell] / mass);
+				m.push_back(mass);
+			}
+		}
+	}
+}
+
+void CpuSimulation::Update(const IntegrationStage& stage) {
+	// Parallel over the grid cells: all particles of a cell share the near field ranges and the far field list.
+	// Reads come from the sorted copies only, so writing the particle state in place is race free.
+	pool.ParallelFor(totalCells, CellGrain, [&](size_t begin, size_t end) {
+		std::vector<float> farX, farY, farMass;
+
+		for (size_t cell = begin; cell < end; ++cell) {
+			if (cellStart[cell] == cellEnd[cell])
+				continue;
+
+			const int cellX = static_cast<int>(cell) % config.gridNx;
+			const int cellY = static_cast<int>(cell) / config.gridNx;
+			CollectFarField(cellX, cellY, farX, farY, farMass);
+
+			// The 3x3 block is three contiguous slot ranges, one per row
+			const int firstX = std::max(cellX - 1, 0);
+			const int lastX = std::min(cellX + 1, config.gridNx - 1);
+
+			for (int slot = cellStart[cell]; slot < cellEnd[cell]; ++slot) {
+				const float px = sortedX[slot];
+				const float py = sortedY[slot];
+
+				float ax = 0.0f, ay = 0.0f;
+				for (int rowY = std::max(cellY - 1, 0); rowY <= std::min(cellY + 1, config.gridNy - 1); ++rowY) {
+					const int rangeStart = cellStart[firstX + rowY * config.gridNx];
+					const int rangeEnd = cellEnd[lastX + rowY * config.gridNx];
+					accumulateForces(sortedX.data() + rangeStart, sortedY.data() + rangeStart, sortedMass.data() + rangeStart,
+					                 rangeEnd - rangeStart, px, py, Softening, ax, ay);
+				}
+				accumulateForces(farX.data(), farY.data(), farMass.data(), static_cast<int>(farMass.size()),
+				                 px, py, Softening, ax, ay);
+
+				// Integrate motion: kick the velocity, then drift the position.
+				const int id = sortedIndex[slot];
+				velX[id] += gravityConstant * ax * stage.kick;
+				velY[id] += gravityConstant * ay * stage.kick;
+				posX[id] = px + velX[id] * stage.drift;
+				posY[id] = py + velY[id] * stage.drift;
+			}
+		}
+	});
+}
+
+} // namespace nbody
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "CpuForces.h"
+#include "InitialConditions.h"
+#include "Simulation.h"
+#include "ThreadPool.h"
+
+namespace nbody {
+
+/**
+ * Native CPU implementation of the grid solver (SolverType::Grid of Simulation).
+ *
+ * Runs the same stages as the OpenCL path - cell index + binning, cell COM + pyramid,
+ * update with the exact 3x3 near field and the pyramid far field - on a thread pool, with
+ * the force sums in explicit AVX2/AVX-512 loops over structure-of-arrays particle data.
+ * Uses the grid and world parameters of SimulationConfig; the OpenCL-only fields are ignored.
+ */
+class CpuSimulation {
+public:
+	// numThreads = 0: one thread per hardware thread
+	explicit CpuSimulation(const SimulationConfig& config = {}, int numThreads = 0, SimdLevel simd = SimdLevel::Auto);
+
+	// Copies the host arrays. The number of particles must not exceed config.maxParticles.
+	void Init(const ParticleState& state);
+
+	// Runs 'steps' simulation steps (synchronously).
+	void Step(int steps = 1);
+
+	// Steps are synchronous; present for symmetry with Simulation.
+	void Finish() {}
+
+	void ReadState(ParticleState& state) const;
+
+	void SetGravityConstant(float G) { gravityConstant = G; }
+	void SetTimeStep(float dt) { deltaTime = dt; }
+	void SetFarFieldRadius(int cells) { farFieldRadius = std::max(cells, 1); }
+	void SetIntegrator(Integrator value) { integrator = value; }
+
+	float GetGravityConstant() const { return gravityConstant; }
+	float GetTimeStep() const { return deltaTime; }
+	int   GetFarFieldRadius() const { return farFieldRadius; }
+	Integrator GetIntegrator() const { return integrator; }
+	int   GetNumParticles() const { return numParticles; }
+	int   GetNumThreads() const { return pool.GetNumThreads(); }
+	SimdLevel GetSimdLevel() const { return simdLevel; }
+	const SimulationConfig& GetConfig() const { return config; }
+
+private:
+	void BinParticles();
+	void ComputeCellCOM();
+	void Update(const IntegrationStage& stage);
+
+	// Far-field sources (COM position and mass) of every pyramid cell seen from level-0 cell (cellX, cellY)
+	void CollectFarField(int cellX, int cellY, std::vector<float>& x, std::vector<float>& y, std::vector<float>& m) const;
+
+	SimulationConfig config;
+	ThreadPool       pool;
+	SimdLevel        simdLevel;
+	ForceFunction    accumulateForces;
+
+	// Derived grid parameters
+	int   totalCells = 0;
+	std::vector<glm::ivec4> pyramidLevels; // x = offset, y = width, z = height
+	float cellSizeInvX = 0.0f;
+	float cellSizeInvY = 0.0f;
+
+	// Particle state (structure of arrays)
+	std::vector<float> posX, posY;
+	std::vector<float> velX, velY;
+	std::vector<float> masses;
+
+	// Cell binning: cell of every particle, per-cell [start, end) ranges and the cell-sorted particles
+	std::vector<int>   particleCellIndex;
+	std::vector<int>   cellStart;
+	std::vector<int>   cellEnd;
+	std::vector<int>   sortedIndex;
+	std::vector<float> sortedX, sortedY, sortedMass;
+
+	// Cell pyramid (all levels back to back, level 0 first): mass and sum of mass * position
+	std::vector<float> cellMass;
+	std::vector<float> cellCOMX, cellCOMY;
+
+	// Step parameters
+	int   numParticles = 0;
+	float gravityConstant = 0.0001f;
+	float deltaTime = 0.001f;
+	int   farFieldRadius = 1;
+	Integrator integrator = Integrator::Euler;
+	float lastDrift = 0.0f; // see IntegrationStages
+};
+
+} // namespace nbody
@@ -0,0 +1,70 @@
+#include "DeviceProfiler.h"
+
+#include <algorithm>
+#include <numeric>
+
+#include <oclutils.hpp>
+
+namespace nbody {
+
+DeviceProfiler::DeviceProfiler(size_t historySize_)
+	: historySize(std::max<size_t>(historySize_, 1))
+{
+}
+
+void DeviceProfiler::Record(const std::string& name, const cl::Event& event) {
+	pending.push_back({ name, event, TraceRecorder::Clock::now() });
+}
+
+double DeviceProfiler::Collect() {
+	double collectedMs = 0.0;
+
+	// One in-order queue: the events complete in the order they were recorded
+	while (!pending.empty() && pending.front().event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE) {
+		const Pending& front = pending.front();
+		const double ms = oclGetTiming(front.event); // complete, so this does not wait
+
+		Samples& samples = history[front.name];
+		if (samples.recent.size() >= historySize)
+			samples.recent.pop_front();
+		samples.recent.push_back(ms);
+		++samples.calls;
+		samples.totalMs += ms;
+
+		if (tracer)
+			tracer->AddDeviceEvent(front.name, front.event, front.recorded);
+
+		collectedMs += ms;
+		pending.pop_front();
+	}
+
+	return collectedMs;
+}
+
+std::vector<DeviceProfiler::Stats> DeviceProfiler::GetStats() const {
+	std::vector<Stats> result;
+	for (const auto& [name, samples] : history) {
+		if (samples.recent.empty())
+			continue;
+
+		std::vector<double> sorted(samples.recent.begin(), samples.recent.end());
+		std::sort(sorted.begin(), sorted.end());
+
+		Stats stats;
+		stats.name = name;
+		stats.calls = samples.calls;
+		stats.totalMs = samples.totalMs;
+		stats.minMs = sorted.front();
+		stats.avgMs = std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+		stats.p95Ms = sorted[std::min(sorted.size() - 1, (sorted.size() * 95) / 100)];
+		result.push_back(stats);
+	}
+	return result;
+}
+
+void DeviceProfiler::Reset() {
+	pending.clear();
+	history.clear();
+}
+
+} // namespace nbody
@@ -0,0 +1,72 @@
+#pragma once
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "TraceRecorder.h"
+
+namespace nbody {
+
+/**
+ * Device time statistics of named commands from a queue created with CL_QUEUE_PROFILING_ENABLE.
+ *
+ * Record only keeps the event. Collect reads the timings of the events that have completed since
+ * (oldest first, stopping at the first one still running), so it never stalls the queue: called once
+ * per frame it reads each event a frame or more after it was enqueued. With a tracer attached the
+ * collected commands are also added to its timeline.
+ */
+class DeviceProfiler {
+public:
+	// min/avg/p95 over the recent samples, calls and total since the last Reset
+	struct Stats {
+		std::string name;
+		size_t      calls = 0;
+		double      totalMs = 0.0;
+		double      minMs = 0.0;
+		double      avgMs = 0.0;
+		double      p95Ms = 0.0;
+	};
+
+	// Keeps the last 'historySize' samples of every name.
+	explicit DeviceProfiler(size_t historySize = 512);
+
+	void Record(const std::string& name, const cl::Event& event);
+
+	// Moves the timings of the completed events into the history. Returns their summed device time (ms).
+	double Collect();
+
+	// Statistics of every name, in name order.
+	std::vector<Stats> GetStats() const;
+
+	void Reset();
+
+	// Receives every collected command (nullptr = none); must outlive the profiler or be detached
+	void SetTracer(TraceRecorder* value) { tracer = value; }
+	TraceRecorder* GetTracer() const { return tracer; }
+
+private:
+	struct Pending {
+		std::string name;
+		cl::Event   event;
+		TraceRecorder::Clock::time_point recorded;
+	};
+
+	struct Samples {
+		std::deque<double> recent;
+		size_t calls = 0;
+		double totalMs = 0.0;
+	};
+
+	size_t historySize;
+	std::deque<Pending> pending;
+	std::map<std::string, Samples> history;
+	TraceRecorder* tracer = nullptr;
+};
+
+} // namespace nbody
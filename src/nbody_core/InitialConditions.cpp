@@ -0,0 +1,115 @@
+#define _USE_MATH_DEFINES
+#include "InitialConditions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace nbody {
+
+const char* DistributionName(Distribution distribution) {
+	switch (distribution) {
+	case Distribution::Uniform:      return "uniform";
+	case Distribution::Ring:         return "ring";
+	case Distribution::Triangle:     return "triangle";
+	case Distribution::GaussianBlob: return "gaussian";
+	case Distribution::SpiralGalaxy: return "spiral";
+	}
+	return "unknown";
+}
+
+std::uint64_t ResolveSeed(std::uint64_t seed) {
+	std::random_device random;
+	while (seed == 0)
+		seed = (static_cast<std::uint64_t>(random()) << 32) | random();
+	return seed;
+}
+
+ParticleState GenerateInitialConditions(const InitialConditionParams& params) {
+	const int numParticles = params.numParticles;
+
+	ParticleState state;
+	state.resize(numParticles);
+
+	// Initialize particle data
+	std::fill(state.masses.begin(), state.masses.end(), params.particleMass);
+
+	auto& velocities = state.velocities;
+	std::fill(velocities.begin(), velocities.end(), glm::vec2{});
+	if (params.useRandomVelocities)
+		for (size_t i = 0; i < velocities.size(); i += 2) {
+			double angle = i / double(velocities.size() / 2) * (2 * M_PI);
+			velocities[i].x = static_cast<float>(-std::cos(angle) * 1.7);
+			velocities[i].y = static_cast<float>(std::sin(angle) * 1.7);
+		}
+
+	// Initialize positions
+	auto& positions = state.positions;
+	// Every bit of the 64-bit seed takes part
+	const std::uint64_t seed = ResolveSeed(params.seed);
+	std::seed_seq seeds{ static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32) };
+	std::mt19937 rng(seeds);
+	switch (params.distribution) {
+	default:
+	case Distribution::Uniform: {
+		std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+		std::generate(positions.begin(), positions.end(), [&] { return glm::vec2{ dist(rng), dist(rng) }; });
+		break;
+	}
+	case Distribution::Ring: {
+		for (int i = 0; i < numParticles; ++i) {
+			float angle = (static_cast<float>(i) / numParticles) * 2.0f * static_cast<float>(M_PI);
+			float r = 0.25f;
+			positions[i] = glm::vec2(r * std::sin(angle), r * std::cos(angle));
+		}
+		break;
+	}
+	case Distribution::Triangle: {
+		glm::vec2 A(-0.6f, -0.5f);
+		glm::vec2 B(0.6f, -0.5f);
+		glm::vec2 C(0.0f, 0.6f);
+
+		std::uniform_real_distribution<float> dist01(0.0f, 1.0f);
+
+		for (int i = 0; i < numParticles; ++i) {
+			float u = dist01(rng);
+			float v = dist01(rng);
+			if (u + v > 1.0f) {
+				u = 1.0f - u;
+				v = 1.0f - v;
+			}
+			glm::vec2 P = A + u * (B - A) + v * (C - A);
+			positions[i] = P;
+		}
+		break;
+	}
+	case Distribution::GaussianBlob: {
+		std::normal_distribution<float> gauss(0.0f, 0.25f);
+		for (int i = 0; i < numParticles; ++i) {
+			float x = gauss(rng);
+			float y = gauss(rng);
+			positions[i] = glm::vec2(x, y);
+		}
+		break;
+	}
+	case Distribution::SpiralGalaxy: {
+		std::normal_distribution<float> noise(0.0f, 0.02f);
+		const float arms = static_cast<float>(params.spiralArms);
+		for (int i = 0; i < numParticles; ++i) {
+			float t = static_cast<float>(i) / numParticles;
+			float angle = t * arms * 6.0f * static_cast<float>(M_PI);
+			float radius = 0.05f + 0.45f * t;
+
+			float x = std::cos(angle) * radius + noise(rng);
+			float y = std::sin(angle) * radius + noise(rng);
+
+			positions[i] = glm::vec2(x, y);
+		}
+		break;
+	}
+	}
+
+	return state;
+}
+
+} // namespace nbody
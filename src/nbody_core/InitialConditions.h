@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace nbody {
+
+// Host-side particle arrays (structure of arrays) used to initialize and read back a simulation.
+struct ParticleState {
+	std::vector<glm::vec2> positions;
+	std::vector<glm::vec2> velocities;
+	std::vector<float>     masses;
+
+	std::size_t size() const { return positions.size(); }
+	void resize(std::size_t count) {
+		positions.resize(count);
+		velocities.resize(count);
+		masses.resize(count);
+	}
+};
+
+// Initial distribution type
+enum class Distribution : int {
+	Uniform = 0,      // Uniform random in [-1,1]^2
+	Ring = 1,         // Particles on a circle
+	Triangle = 2,     // Uniform random inside a triangle
+	GaussianBlob = 3, // Normal distribution around the origin
+	SpiralGalaxy = 4, // Noisy spiral with 'spiralArms' arms
+};
+
+constexpr int DistributionCount = 5;
+
+const char* DistributionName(Distribution distribution);
+
+struct InitialConditionParams {
+	int          numParticles = 20000;
+	Distribution distribution = Distribution::Uniform;
+	int          spiralArms = 2;              // Only used by SpiralGalaxy (1..4)
+	bool         useRandomVelocities = true;  // Give every second particle a tangential velocity
+	float        particleMass = 1.0f;
+	std::uint64_t seed = 0;                   // 0 = seed from std::random_device
+};
+
+// 'seed', or a random nonzero seed from std::random_device for 0. Resolve the seed up front to record the one a
+// run used (e.g. in a checkpoint): GenerateInitialConditions with it regenerates the same initial conditions.
+std::uint64_t ResolveSeed(std::uint64_t seed);
+
+// Generates the positions, velocities and masses of the requested initial distribution.
+ParticleState GenerateInitialConditions(const InitialConditionParams& params);
+
+} // namespace nbody
@@ -0,0 +1,65 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace nbody {
+
+MappedFile::MappedFile(const std::string& fileName, const std::string& kind, bool readAhead) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | (readAhead ? FILE_FLAG_SEQUENTIAL_SCAN : 0), nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Failed to open " + kind + ": " + fileName);
+	LARGE_INTEGER fileSize{};
+	GetFileSizeEx(file, &fileSize);
+	size = static_cast<std::size_t>(fileSize.QuadPart);
+
+	// The view keeps the mapping (and the file) alive after the handles are closed
+	HANDLE mapping = size > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	CloseHandle(file);
+	if (mapping) {
+		data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		CloseHandle(mapping);
+	}
+#else
+	const int file = open(fileName.c_str(), O_RDONLY);
+	if (file < 0)
+		throw std::runtime_error("Failed to open " + kind + ": " + fileName);
+	struct stat status {};
+	fstat(file, &status);
+	size = static_cast<std::size_t>(status.st_size);
+
+	// The mapping stays valid after the descriptor is closed
+	void* mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+	close(file);
+	if (mapped != MAP_FAILED) {
+		if (readAhead)
+			posix_madvise(mapped, size, POSIX_MADV_WILLNEED);
+		data = static_cast<const unsigned char*>(mapped);
+	}
+#endif
+	if (!data)
+		throw std::runtime_error("Failed to map " + kind + ": " + fileName);
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(const_cast<unsigned char*>(data), size);
+#endif
+}
+
+} // namespace nbody
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace nbody {
+
+/**
+ * Read-only memory mapping of a whole file (mmap on POSIX, MapViewOfFile on Windows).
+ *
+ * The mapping does not keep the file open. Throws std::runtime_error if the file cannot be opened
+ * or mapped (an empty file cannot be mapped); 'kind' names the file in the messages.
+ */
+class MappedFile {
+public:
+	// 'readAhead': the whole file is about to be read, sequentially (checkpoints); otherwise pages are read on demand
+	MappedFile(const std::string& fileName, const std::string& kind, bool readAhead);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const unsigned char* GetData() const { return data; }
+	std::size_t          GetSize() const { return size; }
+
+private:
+	const unsigned char* data = nullptr;
+	std::size_t          size = 0;
+};
+
+} // namespace nbody
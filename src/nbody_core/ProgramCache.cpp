@@ -0,0 +1,119 @@
+#include "ProgramCache.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+namespace nbody {
+
+std::uint64_t HashText(const std::string& text, std::uint64_t hash) {
+	for (const char c : text) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::string UniqueTemporaryPath(const std::string& path) {
+	static std::atomic<std::uint64_t> counter{ 0 };
+	std::random_device random;
+	std::uint64_t suffix = (static_cast<std::uint64_t>(random()) << 32) ^ random();
+	// random_device may be deterministic on some platforms: mix in the time and a per-process counter
+	suffix ^= static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+	suffix = HashText(std::to_string(counter++), suffix);
+
+	std::ostringstream name;
+	name << path << '.' << std::hex << suffix << ".tmp";
+	return name.str();
+}
+
+ProgramCache::ProgramCache(std::string directory_)
+	: directory(std::move(directory_))
+{
+}
+
+cl::Program ProgramCache::Build(const cl::Context& context, const cl::Device& device, const cl::Program::Sources& sources,
+                                const std::string& options) {
+	cached = false;
+	const std::vector<cl::Device> devices{ device };
+	const std::string path = directory.empty() ? std::string() : BinaryPath(device, sources, options);
+
+	// Cached binary: still needs a build call, which only links it
+	if (!path.empty()) {
+		std::ifstream in(path, std::ios::binary);
+		const std::vector<unsigned char> binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		if (!binary.empty()) {
+			try {
+				cl::Program program(context, devices, cl::Program::Binaries{ binary });
+				program.build(devices, options.c_str());
+				cached = true;
+				return program;
+			}
+			catch (const cl::Error&) {
+				std::error_code ignored;
+				std::filesystem::remove(path, ignored);
+			}
+		}
+	}
+
+	cl::Program program(context, sources);
+	try {
+		program.build(devices, options.c_str());
+	}
+	catch (const cl::Error&) {
+		for (auto&& [dev, log] : program.getBuildInfo<CL_PROGRAM_BUILD_LOG>())
+			std::cerr << "Build log for " << dev.getInfo<CL_DEVICE_NAME>() << ":\n" << log << "\n";
+		throw;
+	}
+
+	if (!path.empty()) {
+		// The program may list every device of the context; store the binary of the one it was built for
+		const auto programDevices = program.getInfo<CL_PROGRAM_DEVICES>();
+		const auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+		for (size_t i = 0; i < programDevices.size() && i < binaries.size(); ++i) {
+			if (programDevices[i]() != device() || binaries[i].empty())
+				continue;
+
+			// A failed write only costs the next start a build; written aside and renamed so readers never see
+			// a partial binary (concurrent writers of the same key rename complete binaries over each other)
+			std::error_code error;
+			std::filesystem::create_directories(directory, error);
+			const std::string temporary = UniqueTemporaryPath(path);
+			bool written;
+			{
+				std::ofstream out(temporary, std::ios::binary);
+				out.write(reinterpret_cast<const char*>(binaries[i].data()), static_cast<std::streamsize>(binaries[i].size()));
+				written = static_cast<bool>(out.flush());
+			}
+			if (written)
+				std::filesystem::rename(temporary, path, error);
+			if (!written || error)
+				std::filesystem::remove(temporary, error);
+			break;
+		}
+	}
+
+	return program;
+}
+
+std::string ProgramCache::BinaryPath(const cl::Device& device, const cl::Program::Sources& sources, const std::string& options) const {
+	std::uint64_t hash = HashText(device.getInfo<CL_DEVICE_NAME>());
+	hash = HashText(device.getInfo<CL_DEVICE_VERSION>(), hash);
+	hash = HashText(device.getInfo<CL_DRIVER_VERSION>(), hash);
+	hash = HashText(options, hash);
+	for (const auto& source : sources)
+		hash = HashText(source, hash);
+
+	std::ostringstream name;
+	name << std::hex << hash << ".bin";
+	return (std::filesystem::path(directory) / name.str()).string();
+}
+
+} // namespace nbody
@@ -0,0 +1,46 @@
+#pragma once
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace nbody {
+
+// 64-bit FNV-1a of 'text', continuing from 'hash'
+std::uint64_t HashText(const std::string& text, std::uint64_t hash = 14695981039346656037ull);
+
+// Name for writing 'path' aside before renaming it into place, unique to this call so that processes writing the
+// same file at once never share a temporary
+std::string UniqueTemporaryPath(const std::string& path);
+
+/**
+ * Builds OpenCL programs through an on-disk cache of program binaries (CL_PROGRAM_BINARIES).
+ *
+ * A binary is stored as <directory>/<key>.bin, the key hashing the sources, the build options, the device
+ * name and version and the driver version, so any change there builds from source again. A binary the
+ * driver rejects (e.g. after an update that kept the version string) is deleted and rebuilt from source.
+ * With an empty directory every program is built from source.
+ */
+class ProgramCache {
+public:
+	static constexpr const char* DefaultDirectory = "nbody_program_cache";
+
+	explicit ProgramCache(std::string directory = {});
+
+	// Built program for 'device'. Prints the build log and rethrows if the sources fail to build.
+	cl::Program Build(const cl::Context& context, const cl::Device& device, const cl::Program::Sources& sources,
+	                  const std::string& options);
+
+	// Whether the last Build loaded a cached binary
+	bool WasCached() const { return cached; }
+
+private:
+	std::string BinaryPath(const cl::Device& device, const cl::Program::Sources& sources, const std::string& options) const;
+
+	std::string directory;
+	bool cached = false;
+};
+
+} // namespace nbody
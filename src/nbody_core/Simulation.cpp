@@ -0,0 +1,1107 @@
+#include "Simulation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+#include "ProgramCache.h"
+
+namespace nbody {
+
+namespace {
+	std::string KernelPath(const SimulationConfig& config, const std::string& filename) {
+		const std::filesystem::path directory = config.kernelDirectory.empty() ? NBODY_KERNEL_DIR : config.kernelDirectory;
+		const std::filesystem::path result = directory / filename;
+
+		if (!std::filesystem::exists(result))
+			throw std::runtime_error("File not found: " + result.string());
+
+		return result.string();
+	}
+
+	// Concatenated in this order into one program
+	const char* const KernelFiles[] = { "nbody.cl", "barneshut.cl", "fmm.cl", "pm.cl", "exact.cl", "timestep.cl", "bounds.cl", "reorder.cl", "trajectory.cl" };
+
+	// P3M split scale in mesh cells, and the smallest grid cell (in split scales) whose 3x3 block covers the short
+	// range: erfc(2.5) ~ 4e-4
+	constexpr float P3MSplitMeshCells = 1.25f;
+	constexpr float P3MNearFieldSplits = 2.5f;
+
+	// Fitted world bounds: padding relative to the particle box, and the cell size of a degenerate box
+	constexpr float BoundsMargin = 0.01f;
+	constexpr float MinBoundsCellSize = 1e-6f;
+
+	cl::Program::Sources ReadKernelSources(const SimulationConfig& config) {
+		cl::Program::Sources sources;
+		for (const char* file : KernelFiles)
+			sources.push_back(oclReadSourcesFromFile(KernelPath(config, file)));
+		return sources;
+	}
+
+	std::string BuildOptions(const SimulationConfig& config) {
+		return "-D FMM_ORDER=" + std::to_string(config.fmmOrder);
+	}
+
+	size_t RoundUp(size_t value, size_t multiple) {
+		return (value + multiple - 1) / multiple * multiple;
+	}
+
+	size_t NextPowerOfTwo(size_t value) {
+		size_t result = 1;
+		while (result < value)
+			result <<= 1;
+		return result;
+	}
+}
+
+const char* SolverName(SolverType solver) {
+	switch (solver) {
+	case SolverType::Grid:      return "grid";
+	case SolverType::BarnesHut: return "barnes-hut";
+	case SolverType::FMM:       return "fmm";
+	case SolverType::PM:        return "pm";
+	case SolverType::P3M:       return "p3m";
+	case SolverType::Exact:     return "exact";
+	}
+	return "unknown";
+}
+
+const char* IntegratorName(Integrator integrator) {
+	switch (integrator) {
+	case Integrator::Euler:    return "euler";
+	case Integrator::Leapfrog: return "leapfrog";
+	case Integrator::Yoshida4: return "yoshida4";
+	}
+	return "unknown";
+}
+
+std::uint64_t KernelSourceHash(const SimulationConfig& config) {
+	std::uint64_t hash = HashText(BuildOptions(config));
+	for (const auto& source : ReadKernelSources(config))
+		hash = HashText(source, hash);
+	return hash;
+}
+
+bool SupportsP3M(const SimulationConfig& config) {
+	const float width = config.worldMaxX - config.worldMinX;
+	const float height = config.worldMaxY - config.worldMinY;
+	const float split = P3MSplitMeshCells * std::max(width / config.pmMeshNx, height / config.pmMeshNy);
+	return std::min(width / config.gridNx, height / config.gridNy) >= P3MNearFieldSplits * split;
+}
+
+int IntegrationStages(Integrator integrator, float dt, float& lastDrift, IntegrationStage stages[MaxIntegrationStages]) {
+	// Yoshida's 4th order composition of three leapfrog substeps
+	constexpr double cbrt2 = 1.2599210498948732;
+	constexpr float w1 = static_cast<float>(1.0 / (2.0 - cbrt2));
+	constexpr float w0 = static_cast<float>(-cbrt2 / (2.0 - cbrt2));
+
+	switch (integrator) {
+	case Integrator::Leapfrog:
+		stages[0] = { 0.5f * (lastDrift + dt), dt };
+		lastDrift = dt;
+		return 1;
+
+	case Integrator::Yoshida4: {
+		const float substeps[3] = { w1 * dt, w0 * dt, w1 * dt };
+		for (int i = 0; i < 3; ++i) {
+			stages[i] = { 0.5f * (lastDrift + substeps[i]), substeps[i] };
+			lastDrift = substeps[i];
+		}
+		return 3;
+	}
+
+	case Integrator::Euler:
+	default:
+		stages[0] = { dt, dt };
+		lastDrift = 0.0f; // velocities are in sync with the positions
+		return 1;
+	}
+}
+
+Simulation::Simulation(const cl::Context& context_, const cl::Device& device_, const SimulationConfig& config_)
+	: config(config_), context(context_), device(device_)
+{
+	if (config.maxParticles <= 0 || config.gridNx <= 0 || config.gridNy <= 0 || config.localSize == 0)
+		throw std::invalid_argument("Invalid simulation configuration");
+	if ((config.localSize & (config.localSize - 1)) != 0)
+		throw std::invalid_argument("The work-group size must be a power of two");
+	if (config.fmmOrder < 1 || config.fmmOrder > 8)
+		throw std::invalid_argument("The FMM order must be in [1, 8]");
+	if (config.pmMeshNx < 2 || config.pmMeshNy < 2 || (config.pmMeshNx & (config.pmMeshNx - 1)) != 0 || (config.pmMeshNy & (config.pmMeshNy - 1)) != 0)
+		throw std::invalid_argument("The PM mesh size must be a power of two (>= 2)");
+
+	// Grid sizes
+	totalCells = config.gridNx * config.gridNy;
+	cellSizeInvX = config.gridNx / (config.worldMaxX - config.worldMinX);
+	cellSizeInvY = config.gridNy / (config.worldMaxY - config.worldMinY);
+
+	// PM mesh: nodes at the mesh cell centers, FFT on the zero-padded (2x) mesh.
+	// The P3M split scale follows the mesh (see SupportsP3M for the grid it needs).
+	meshPaddedNx = 2 * config.pmMeshNx;
+	meshPaddedNy = 2 * config.pmMeshNy;
+	meshInvX = config.pmMeshNx / (config.worldMaxX - config.worldMinX);
+	meshInvY = config.pmMeshNy / (config.worldMaxY - config.worldMinY);
+	pmInvSplit = 1.0f / (P3MSplitMeshCells * std::max(1.0f / meshInvX, 1.0f / meshInvY));
+
+	globalParticles = RoundUp(static_cast<size_t>(config.maxParticles), config.localSize);
+
+	// Cell pyramid for the far field: level 0 is the grid, every next level halves it (rounding up) down to 1x1.
+	// All levels are stored back to back in the cell mass/COM buffers.
+	for (int offset = 0, nx = config.gridNx, ny = config.gridNy; ; nx = (nx + 1) / 2, ny = (ny + 1) / 2) {
+		pyramidLevels.emplace_back(offset, nx, ny, 0);
+		offset += nx * ny;
+		pyramidCells = offset;
+		if (nx == 1 && ny == 1)
+			break;
+	}
+
+	// The cell mass/COM pass keeps a private copy of the grid per work-group when it fits into local memory.
+	// A few groups per compute unit are enough: each group merges the whole grid once at its end.
+	const size_t cellCOMLocalBytes = 3 * static_cast<size_t>(totalCells) * sizeof(float);
+	useLocalCellCOM = cellCOMLocalBytes <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	const size_t comGroups = std::min<size_t>(globalParticles / config.localSize, 4 * std::max<cl_uint>(1, device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()));
+	globalCOM = comGroups * config.localSize;
+
+	// The bounding box reduction uses as many groups, each reducing a strided share of the particles
+	boundsGroups = comGroups;
+
+	// Configured world in the layout of bounds.cl: minimum, cell size / inverse cell size, inverse world size
+	fixedGridGeometry[0] = glm::vec4(config.worldMinX, config.worldMinY, 1.0f / cellSizeInvX, 1.0f / cellSizeInvY);
+	fixedGridGeometry[1] = glm::vec4(cellSizeInvX, cellSizeInvY,
+		1.0f / (config.worldMaxX - config.worldMinX), 1.0f / (config.worldMaxY - config.worldMinY));
+
+	// Barnes-Hut sort: power of two, at least one local bitonic block (2 * localSize)
+	sortBlockSize = 2 * config.localSize;
+	sortCapacity = NextPowerOfTwo(std::max<size_t>(config.maxParticles, sortBlockSize));
+
+	queue = cl::CommandQueue(context, device, config.profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+	// Particle buffers
+	clPositions = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::vec2));
+	clVelocities = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::vec2));
+	clMasses = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(float));
+
+	// Init Grid + COM buffers
+	clParticleCellIndex = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clCellCOM = cl::Buffer(context, CL_MEM_READ_WRITE, pyramidCells * sizeof(glm::vec2));
+	clCellMass = cl::Buffer(context, CL_MEM_READ_WRITE, pyramidCells * sizeof(float));
+	clPyramidLevels = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		pyramidLevels.size() * sizeof(glm::ivec4), pyramidLevels.data());
+
+	// World of the grid (configured or fitted to the particles) and the partial boxes of its reduction
+	clGridGeometry = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(fixedGridGeometry), fixedGridGeometry);
+	clPartialBounds = cl::Buffer(context, CL_MEM_READ_WRITE, boundsGroups * sizeof(glm::vec4));
+
+	// Cell binning buffers
+	clCellCounter = cl::Buffer(context, CL_MEM_READ_WRITE, totalCells * sizeof(int));
+	clCellStart = cl::Buffer(context, CL_MEM_READ_WRITE, totalCells * sizeof(int));
+	clCellEnd = cl::Buffer(context, CL_MEM_READ_WRITE, totalCells * sizeof(int));
+	clSortedIndex = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clSortedPosMass = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::vec4));
+
+	// Barnes-Hut buffers: sort keys/values and the 2N-1 tree nodes
+	const size_t maxNodes = 2 * static_cast<size_t>(config.maxParticles);
+	clMortonKeys = cl::Buffer(context, CL_MEM_READ_WRITE, sortCapacity * sizeof(cl_uint));
+	clMortonValues = cl::Buffer(context, CL_MEM_READ_WRITE, sortCapacity * sizeof(int));
+	clNodeChildren = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::ivec2));
+	clNodeParent = cl::Buffer(context, CL_MEM_READ_WRITE, maxNodes * sizeof(int));
+	clNodeVisits = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clNodeMassCOM = cl::Buffer(context, CL_MEM_READ_WRITE, maxNodes * sizeof(glm::vec4));
+	clNodeBounds = cl::Buffer(context, CL_MEM_READ_WRITE, maxNodes * sizeof(glm::vec4));
+
+	// FMM buffers: (order + 1)(order + 2) / 2 coefficients per pyramid cell
+	const size_t fmmTerms = static_cast<size_t>(config.fmmOrder + 1) * (config.fmmOrder + 2) / 2;
+	clMultipoles = cl::Buffer(context, CL_MEM_READ_WRITE, pyramidCells * fmmTerms * sizeof(float));
+	clLocals = cl::Buffer(context, CL_MEM_READ_WRITE, pyramidCells * fmmTerms * sizeof(float));
+
+	// PM buffers
+	const size_t paddedNodes = static_cast<size_t>(meshPaddedNx) * meshPaddedNy;
+	const size_t meshNodes = static_cast<size_t>(config.pmMeshNx) * config.pmMeshNy;
+	clMeshDensity = cl::Buffer(context, CL_MEM_READ_WRITE, paddedNodes * sizeof(glm::vec2));
+	clMeshScratch = cl::Buffer(context, CL_MEM_READ_WRITE, paddedNodes * sizeof(glm::vec2));
+	clGreenPM = cl::Buffer(context, CL_MEM_READ_WRITE, paddedNodes * sizeof(glm::vec2));
+	clGreenP3M = cl::Buffer(context, CL_MEM_READ_WRITE, paddedNodes * sizeof(glm::vec2));
+	clMeshAccel = cl::Buffer(context, CL_MEM_READ_WRITE, meshNodes * sizeof(glm::vec2));
+
+	// Block timestep buffers
+	clRungs = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clStepTimes = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(float));
+	clActiveParticles = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clActiveCount = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+	clAccelerations = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::vec2));
+
+	// Space-filling curve reordering: Init index of every slot and the gather targets of reorderParticles
+	clParticleIds = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clReorderPositions = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::vec2));
+	clReorderVelocities = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(glm::vec2));
+	clReorderMasses = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(float));
+	clReorderRungs = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+	clReorderStepTimes = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(float));
+	clReorderIds = cl::Buffer(context, CL_MEM_READ_WRITE, config.maxParticles * sizeof(int));
+
+	// The program (see VariantDefines), the kernels and their fixed arguments are built by Init / Restore, once
+	// the particle masses are known, so a uniform-mass start compiles the kernels only once
+}
+
+void Simulation::CreateKernels() {
+	const size_t paddedNodes = static_cast<size_t>(meshPaddedNx) * meshPaddedNy;
+
+	// Init kernels
+	kernelCellIndex = cl::Kernel(program, "computeParticleCellIndex");
+	kernelComputeCOM = cl::Kernel(program, "computeCellCOM");
+	kernelComputeCOMGlobal = cl::Kernel(program, "computeCellCOMGlobal");
+	kernelScanCells = cl::Kernel(program, "scanCellCounts");
+	kernelScatter = cl::Kernel(program, "scatterParticlesByCell");
+	kernelBuildPyramid = cl::Kernel(program, "buildPyramidLevel");
+	kernelUpdate = cl::Kernel(program, "update");
+	kernelPackRender = cl::Kernel(program, "packRenderVertices");
+
+	// Barnes-Hut kernels
+	kernelMortonCodes = cl::Kernel(program, "computeMortonCodes");
+	kernelBitonicLocal = cl::Kernel(program, "bitonicSortLocal");
+	kernelBitonicGlobal = cl::Kernel(program, "bitonicSortGlobal");
+	kernelGatherSorted = cl::Kernel(program, "gatherSortedParticles");
+	kernelBuildTree = cl::Kernel(program, "buildRadixTree");
+	kernelTreeNodes = cl::Kernel(program, "computeTreeNodes");
+	kernelUpdateBarnesHut = cl::Kernel(program, "updateBarnesHut");
+
+	// FMM kernels
+	kernelFMMP2M = cl::Kernel(program, "fmmP2M");
+	kernelFMMM2M = cl::Kernel(program, "fmmM2M");
+	kernelFMMDownward = cl::Kernel(program, "fmmDownward");
+	kernelFMMUpdate = cl::Kernel(program, "fmmUpdate");
+
+	// PM kernels
+	kernelPMDeposit = cl::Kernel(program, "pmDeposit");
+	kernelFFT = cl::Kernel(program, "fftRadix2");
+	kernelPMConvolve = cl::Kernel(program, "pmConvolve");
+	kernelPMGradient = cl::Kernel(program, "pmGradient");
+	kernelPMUpdate = cl::Kernel(program, "pmUpdate");
+
+	// Exact kernels
+	kernelPackPosMass = cl::Kernel(program, "packPosMass");
+	kernelUpdateExact = cl::Kernel(program, "updateExact");
+
+	// Block timestep kernels
+	kernelCompactActive = cl::Kernel(program, "compactActiveParticles");
+	kernelKickActive = cl::Kernel(program, "kickActiveParticles");
+	kernelDrift = cl::Kernel(program, "driftParticles");
+
+	// World bounds kernels
+	kernelReduceBounds = cl::Kernel(program, "reduceBounds");
+	kernelFinalizeBounds = cl::Kernel(program, "finalizeBounds");
+
+	// Reordering kernel
+	kernelReorder = cl::Kernel(program, "reorderParticles");
+
+	// Trajectory kernel
+	kernelQuantize = cl::Kernel(program, "quantizePositions");
+
+	// Set kernel arguments
+	kernelCellIndex.setArg(0, clPositions);
+	kernelCellIndex.setArg(1, clParticleCellIndex);
+	kernelCellIndex.setArg(2, clCellCounter);
+	kernelCellIndex.setArg(3, config.gridNx);
+	kernelCellIndex.setArg(4, config.gridNy);
+	kernelCellIndex.setArg(5, clGridGeometry);
+
+	kernelScanCells.setArg(0, clCellCounter);
+	kernelScanCells.setArg(1, clCellStart);
+	kernelScanCells.setArg(2, clCellEnd);
+	kernelScanCells.setArg(3, totalCells);
+	kernelScanCells.setArg(4, cl::Local(config.localSize * sizeof(int)));
+
+	kernelScatter.setArg(0, clPositions);
+	kernelScatter.setArg(1, clMasses);
+	kernelScatter.setArg(2, clParticleCellIndex);
+	kernelScatter.setArg(3, clCellCounter);
+	kernelScatter.setArg(4, clSortedIndex);
+	kernelScatter.setArg(5, clSortedPosMass);
+
+	kernelComputeCOM.setArg(0, clPositions);
+	kernelComputeCOM.setArg(1, clMasses);
+	kernelComputeCOM.setArg(2, clParticleCellIndex);
+	kernelComputeCOM.setArg(3, clCellMass);
+	kernelComputeCOM.setArg(4, clCellCOM);
+	kernelComputeCOM.setArg(6, totalCells);
+	kernelComputeCOM.setArg(7, cl::Local(totalCells * sizeof(float)));
+	kernelComputeCOM.setArg(8, cl::Local(totalCells * sizeof(float)));
+	kernelComputeCOM.setArg(9, cl::Local(totalCells * sizeof(float)));
+
+	kernelComputeCOMGlobal.setArg(0, clPositions);
+	kernelComputeCOMGlobal.setArg(1, clMasses);
+	kernelComputeCOMGlobal.setArg(2, clParticleCellIndex);
+	kernelComputeCOMGlobal.setArg(3, clCellMass);
+	kernelComputeCOMGlobal.setArg(4, clCellCOM);
+
+	kernelUpdate.setArg(0, clPositions);
+	kernelUpdate.setArg(1, clVelocities);
+	kernelUpdate.setArg(2, clParticleCellIndex);
+	kernelUpdate.setArg(3, clCellStart);
+	kernelUpdate.setArg(4, clCellEnd);
+	kernelUpdate.setArg(5, clSortedIndex);
+	kernelUpdate.setArg(6, clSortedPosMass);
+	kernelUpdate.setArg(7, clCellMass);
+	kernelUpdate.setArg(8, clCellCOM);
+	kernelUpdate.setArg(9, clPyramidLevels);
+	kernelUpdate.setArg(10, static_cast<int>(pyramidLevels.size()));
+	kernelUpdate.setArg(12, config.gridNx);
+	kernelUpdate.setArg(13, config.gridNy);
+	kernelUpdate.setArg(19, clActiveParticles);
+	kernelUpdate.setArg(20, clActiveCount);
+	kernelUpdate.setArg(21, clAccelerations);
+
+	kernelPackRender.setArg(0, clPositions);
+	kernelPackRender.setArg(1, clVelocities);
+
+	kernelBuildPyramid.setArg(0, clCellMass);
+	kernelBuildPyramid.setArg(1, clCellCOM);
+
+	kernelMortonCodes.setArg(0, clPositions);
+	kernelMortonCodes.setArg(1, clMortonKeys);
+	kernelMortonCodes.setArg(2, clMortonValues);
+	kernelMortonCodes.setArg(5, clGridGeometry);
+
+	kernelBitonicLocal.setArg(0, clMortonKeys);
+	kernelBitonicLocal.setArg(1, clMortonValues);
+	kernelBitonicLocal.setArg(4, cl::Local(sortBlockSize * sizeof(cl_uint)));
+	kernelBitonicLocal.setArg(5, cl::Local(sortBlockSize * sizeof(int)));
+
+	kernelBitonicGlobal.setArg(0, clMortonKeys);
+	kernelBitonicGlobal.setArg(1, clMortonValues);
+
+	kernelGatherSorted.setArg(0, clPositions);
+	kernelGatherSorted.setArg(1, clMasses);
+	kernelGatherSorted.setArg(2, clMortonValues);
+	kernelGatherSorted.setArg(3, clSortedIndex);
+	kernelGatherSorted.setArg(4, clSortedPosMass);
+
+	kernelBuildTree.setArg(0, clMortonKeys);
+	kernelBuildTree.setArg(1, clNodeChildren);
+	kernelBuildTree.setArg(2, clNodeParent);
+
+	kernelTreeNodes.setArg(0, clSortedPosMass);
+	kernelTreeNodes.setArg(1, clNodeChildren);
+	kernelTreeNodes.setArg(2, clNodeParent);
+	kernelTreeNodes.setArg(3, clNodeVisits);
+	kernelTreeNodes.setArg(4, clNodeMassCOM);
+	kernelTreeNodes.setArg(5, clNodeBounds);
+
+	kernelUpdateBarnesHut.setArg(0, clPositions);
+	kernelUpdateBarnesHut.setArg(1, clVelocities);
+	kernelUpdateBarnesHut.setArg(2, clSortedIndex);
+	kernelUpdateBarnesHut.setArg(3, clNodeChildren);
+	kernelUpdateBarnesHut.setArg(4, clNodeMassCOM);
+	kernelUpdateBarnesHut.setArg(5, clNodeBounds);
+	kernelUpdateBarnesHut.setArg(12, clActiveParticles);
+	kernelUpdateBarnesHut.setArg(13, clActiveCount);
+	kernelUpdateBarnesHut.setArg(14, clAccelerations);
+
+	kernelFMMP2M.setArg(0, clSortedPosMass);
+	kernelFMMP2M.setArg(1, clCellStart);
+	kernelFMMP2M.setArg(2, clCellEnd);
+	kernelFMMP2M.setArg(3, clMultipoles);
+	kernelFMMP2M.setArg(4, config.gridNx);
+	kernelFMMP2M.setArg(5, config.gridNy);
+	kernelFMMP2M.setArg(6, clGridGeometry);
+
+	kernelFMMM2M.setArg(0, clMultipoles);
+	kernelFMMM2M.setArg(1, clPyramidLevels);
+	kernelFMMM2M.setArg(3, clGridGeometry);
+
+	kernelFMMDownward.setArg(0, clMultipoles);
+	kernelFMMDownward.setArg(1, clLocals);
+	kernelFMMDownward.setArg(2, clPyramidLevels);
+	kernelFMMDownward.setArg(3, static_cast<int>(pyramidLevels.size()));
+	kernelFMMDownward.setArg(5, clGridGeometry);
+	kernelFMMDownward.setArg(6, programSoftening);
+
+	kernelFMMUpdate.setArg(0, clPositions);
+	kernelFMMUpdate.setArg(1, clVelocities);
+	kernelFMMUpdate.setArg(2, clParticleCellIndex);
+	kernelFMMUpdate.setArg(3, clCellStart);
+	kernelFMMUpdate.setArg(4, clCellEnd);
+	kernelFMMUpdate.setArg(5, clSortedIndex);
+	kernelFMMUpdate.setArg(6, clSortedPosMass);
+	kernelFMMUpdate.setArg(7, clLocals);
+	kernelFMMUpdate.setArg(8, config.gridNx);
+	kernelFMMUpdate.setArg(9, config.gridNy);
+	kernelFMMUpdate.setArg(10, clGridGeometry);
+	kernelFMMUpdate.setArg(16, clActiveParticles);
+	kernelFMMUpdate.setArg(17, clActiveCount);
+	kernelFMMUpdate.setArg(18, clAccelerations);
+
+	kernelPMDeposit.setArg(0, clSortedPosMass);
+	kernelPMDeposit.setArg(1, clMeshDensity);
+	kernelPMDeposit.setArg(2, config.pmMeshNx);
+	kernelPMDeposit.setArg(3, config.pmMeshNy);
+	kernelPMDeposit.setArg(4, meshInvX);
+	kernelPMDeposit.setArg(5, meshInvY);
+	kernelPMDeposit.setArg(6, config.worldMinX);
+	kernelPMDeposit.setArg(7, config.worldMinY);
+
+	kernelPMConvolve.setArg(0, clMeshDensity);
+	kernelPMConvolve.setArg(2, 1.0f / static_cast<float>(paddedNodes));
+	kernelPMConvolve.setArg(3, static_cast<int>(paddedNodes));
+
+	kernelPMGradient.setArg(0, clMeshDensity);
+	kernelPMGradient.setArg(1, clMeshAccel);
+	kernelPMGradient.setArg(2, config.pmMeshNx);
+	kernelPMGradient.setArg(3, config.pmMeshNy);
+	kernelPMGradient.setArg(4, meshInvX);
+	kernelPMGradient.setArg(5, meshInvY);
+
+	kernelPMUpdate.setArg(0, clPositions);
+	kernelPMUpdate.setArg(1, clVelocities);
+	kernelPMUpdate.setArg(2, clParticleCellIndex);
+	kernelPMUpdate.setArg(3, clCellStart);
+	kernelPMUpdate.setArg(4, clCellEnd);
+	kernelPMUpdate.setArg(5, clSortedIndex);
+	kernelPMUpdate.setArg(6, clSortedPosMass);
+	kernelPMUpdate.setArg(7, clMeshAccel);
+	kernelPMUpdate.setArg(8, config.pmMeshNx);
+	kernelPMUpdate.setArg(9, config.pmMeshNy);
+	kernelPMUpdate.setArg(10, meshInvX);
+	kernelPMUpdate.setArg(11, meshInvY);
+	kernelPMUpdate.setArg(12, config.worldMinX);
+	kernelPMUpdate.setArg(13, config.worldMinY);
+	kernelPMUpdate.setArg(14, config.gridNx);
+	kernelPMUpdate.setArg(15, config.gridNy);
+	kernelPMUpdate.setArg(22, clActiveParticles);
+	kernelPMUpdate.setArg(23, clActiveCount);
+	kernelPMUpdate.setArg(24, clAccelerations);
+
+	// Exact: the packed snapshot reuses the cell-sorted buffer (in particle order), tiles of localSize particles
+	kernelPackPosMass.setArg(0, clPositions);
+	kernelPackPosMass.setArg(1, clMasses);
+	kernelPackPosMass.setArg(2, clSortedPosMass);
+
+	kernelUpdateExact.setArg(0, clPositions);
+	kernelUpdateExact.setArg(1, clVelocities);
+	kernelUpdateExact.setArg(2, clSortedPosMass);
+	kernelUpdateExact.setArg(3, cl::Local(config.localSize * sizeof(glm::vec4)));
+	kernelUpdateExact.setArg(9, clActiveParticles);
+	kernelUpdateExact.setArg(10, clActiveCount);
+	kernelUpdateExact.setArg(11, clAccelerations);
+
+	kernelCompactActive.setArg(0, clSortedIndex);
+	kernelCompactActive.setArg(1, clRungs);
+	kernelCompactActive.setArg(2, clActiveParticles);
+	kernelCompactActive.setArg(3, clActiveCount);
+	kernelCompactActive.setArg(4, cl::Local(2 * sizeof(int)));
+
+	kernelKickActive.setArg(0, clVelocities);
+	kernelKickActive.setArg(1, clAccelerations);
+	kernelKickActive.setArg(2, clActiveParticles);
+	kernelKickActive.setArg(3, clActiveCount);
+	kernelKickActive.setArg(4, clRungs);
+	kernelKickActive.setArg(5, clStepTimes);
+
+	kernelDrift.setArg(0, clPositions);
+	kernelDrift.setArg(1, clVelocities);
+
+	kernelReduceBounds.setArg(0, clPositions);
+	kernelReduceBounds.setArg(1, clPartialBounds);
+	kernelReduceBounds.setArg(2, cl::Local(config.localSize * sizeof(glm::vec4)));
+
+	kernelFinalizeBounds.setArg(0, clPartialBounds);
+	kernelFinalizeBounds.setArg(1, static_cast<int>(boundsGroups));
+	kernelFinalizeBounds.setArg(2, clGridGeometry);
+	kernelFinalizeBounds.setArg(3, cl::Local(config.localSize * sizeof(glm::vec4)));
+	kernelFinalizeBounds.setArg(4, config.gridNx);
+	kernelFinalizeBounds.setArg(5, config.gridNy);
+	kernelFinalizeBounds.setArg(6, BoundsMargin);
+	kernelFinalizeBounds.setArg(7, MinBoundsCellSize);
+
+	kernelReorder.setArg(0, clMortonValues);
+	kernelReorder.setArg(1, clPositions);
+	kernelReorder.setArg(2, clVelocities);
+	kernelReorder.setArg(3, clMasses);
+	kernelReorder.setArg(4, clRungs);
+	kernelReorder.setArg(5, clStepTimes);
+	kernelReorder.setArg(6, clParticleIds);
+	kernelReorder.setArg(7, clReorderPositions);
+	kernelReorder.setArg(8, clReorderVelocities);
+	kernelReorder.setArg(9, clReorderMasses);
+	kernelReorder.setArg(10, clReorderRungs);
+	kernelReorder.setArg(11, clReorderStepTimes);
+	kernelReorder.setArg(12, clReorderIds);
+
+	kernelQuantize.setArg(0, clPositions);
+	kernelQuantize.setArg(1, clParticleIds);
+
+	// Transformed Green's functions of the full kernel (PM) and of its long-range part (P3M), computed once
+	cl::Kernel kernelGreen(program, "pmGreenFunction");
+	kernelGreen.setArg(1, meshPaddedNx);
+	kernelGreen.setArg(2, meshPaddedNy);
+	kernelGreen.setArg(3, 1.0f / meshInvX);
+	kernelGreen.setArg(4, 1.0f / meshInvY);
+	kernelGreen.setArg(6, programSoftening);
+	for (cl::Buffer* green : { &clGreenPM, &clGreenP3M }) {
+		kernelGreen.setArg(0, *green);
+		kernelGreen.setArg(5, green == &clGreenP3M ? pmInvSplit : 0.0f);
+		EnqueueKernel(kernelGreen, cl::NDRange(RoundUp(paddedNodes, config.localSize)), cl::NDRange(config.localSize));
+		EnqueueFFT2D(*green, -1.0f);
+	}
+	queue.finish();
+}
+
+std::string Simulation::VariantDefines() const {
+	std::ostringstream defines;
+	defines << std::setprecision(9) << "-D SOFTENING=" << softening << "f";
+	if (config.specializeKernels) {
+		defines << " -D GRID_NX=" << config.gridNx << " -D GRID_NY=" << config.gridNy << " -D LOCAL_SIZE=" << config.localSize;
+		if (uniformMass)
+			defines << " -D UNIFORM_MASS=" << particleMass << "f";
+	}
+	return defines.str();
+}
+
+void Simulation::UpdateProgramVariant(bool wait) {
+	for (;;) {
+		// A finished background build joins the variants
+		if (pendingProgram.valid() && (wait || pendingProgram.wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+			programVariants[pendingDefines] = pendingProgram.get();
+
+		const std::string defines = VariantDefines();
+		if (defines == programDefines)
+			return;
+
+		const auto found = programVariants.find(defines);
+		if (found != programVariants.end()) {
+			program = found->second;
+			programDefines = defines;
+			programSoftening = softening;
+			CreateKernels();
+			SetParticleCountArgs();
+			return;
+		}
+
+		// One build at a time: a variant requested meanwhile starts once the running build has been collected
+		if (!pendingProgram.valid()) {
+			pendingDefines = defines;
+			pendingProgram = std::async(std::launch::async,
+				[context = context, device = device, sources = ReadKernelSources(config),
+				 options = BuildOptions(config) + " " + defines, directory = config.programCacheDirectory]() {
+					return ProgramCache(directory).Build(context, device, sources, options);
+				});
+		}
+		if (!wait)
+			return;
+	}
+}
+
+void Simulation::SetParticleCountArgs() {
+	sortCount = NextPowerOfTwo(std::max<size_t>(numParticles, sortBlockSize));
+
+	kernelCellIndex.setArg(6, numParticles);
+	kernelScatter.setArg(6, numParticles);
+	kernelComputeCOM.setArg(5, numParticles);
+	kernelComputeCOMGlobal.setArg(5, numParticles);
+	kernelUpdate.setArg(14, numParticles);
+
+	kernelMortonCodes.setArg(3, numParticles);
+	kernelMortonCodes.setArg(4, static_cast<int>(sortCount));
+	kernelGatherSorted.setArg(5, numParticles);
+	kernelBuildTree.setArg(3, numParticles);
+	kernelTreeNodes.setArg(6, numParticles);
+	kernelUpdateBarnesHut.setArg(6, numParticles);
+	kernelFMMUpdate.setArg(11, numParticles);
+	kernelPMDeposit.setArg(8, numParticles);
+	kernelPMUpdate.setArg(17, numParticles);
+	kernelPackPosMass.setArg(3, numParticles);
+	kernelUpdateExact.setArg(4, numParticles);
+	kernelCompactActive.setArg(7, numParticles);
+	kernelDrift.setArg(3, numParticles);
+	kernelReduceBounds.setArg(3, numParticles);
+	kernelReorder.setArg(13, numParticles);
+}
+
+void Simulation::Init(const ParticleState& state) {
+	if (state.size() > static_cast<size_t>(config.maxParticles))
+		throw std::invalid_argument("Particle count exceeds the simulation capacity");
+	if (state.velocities.size() != state.size() || state.masses.size() != state.size())
+		throw std::invalid_argument("Particle arrays have mismatching sizes");
+
+	numParticles = static_cast<int>(state.size());
+	lastDrift = 0.0f;
+	stepCount = 0;
+	simulatedTime = 0.0;
+	boundsCountdown = 0; // fitted again on the first step
+	stepsSinceReorder = 0;
+	particlesReordered = false;
+	SetUniformMass(state.masses.data(), numParticles);
+
+	if (numParticles > 0) {
+		queue.enqueueWriteBuffer(clPositions, CL_TRUE, 0, state.positions.size() * sizeof(glm::vec2), state.positions.data());
+		queue.enqueueWriteBuffer(clVelocities, CL_TRUE, 0, state.velocities.size() * sizeof(glm::vec2), state.velocities.data());
+		queue.enqueueWriteBuffer(clMasses, CL_TRUE, 0, state.masses.size() * sizeof(float), state.masses.data());
+
+		// Block timesteps start on rung 0 without a pending half kick
+		queue.enqueueFillBuffer(clRungs, 0, 0, numParticles * sizeof(int));
+		queue.enqueueFillBuffer(clStepTimes, 0.0f, 0, numParticles * sizeof(float));
+
+		std::vector<int> ids(numParticles);
+		std::iota(ids.begin(), ids.end(), 0);
+		queue.enqueueWriteBuffer(clParticleIds, CL_TRUE, 0, ids.size() * sizeof(int), ids.data());
+	}
+
+	SetParticleCountArgs();
+}
+
+void Simulation::Restore(const ParticleArraysView& arrays, float lastDrift_, std::uint64_t steps, double time,
+                         int boundsCountdown_, int stepsSinceReorder_) {
+	if (arrays.count < 0 || arrays.count > config.maxParticles)
+		throw std::invalid_argument("Particle count exceeds the simulation capacity");
+
+	numParticles = arrays.count;
+	lastDrift = lastDrift_;
+	stepCount = steps;
+	simulatedTime = time;
+	boundsCountdown = boundsCountdown_;
+	stepsSinceReorder = stepsSinceReorder_;
+	particlesReordered = true; // the saved slots may follow any order
+	gridGeometryFitted = numParticles > 0 && arrays.gridGeometry != nullptr;
+	SetUniformMass(arrays.masses, numParticles);
+
+	// The grid world the saved run would use for its next force evaluations (refitted when boundsCountdown runs out)
+	queue.enqueueWriteBuffer(clGridGeometry, CL_FALSE, 0, sizeof(fixedGridGeometry),
+		gridGeometryFitted ? arrays.gridGeometry : fixedGridGeometry);
+	if (numParticles > 0) {
+		queue.enqueueWriteBuffer(clPositions, CL_FALSE, 0, numParticles * sizeof(glm::vec2), arrays.positions);
+		queue.enqueueWriteBuffer(clVelocities, CL_FALSE, 0, numParticles * sizeof(glm::vec2), arrays.velocities);
+		queue.enqueueWriteBuffer(clMasses, CL_FALSE, 0, numParticles * sizeof(float), arrays.masses);
+		queue.enqueueWriteBuffer(clRungs, CL_FALSE, 0, numParticles * sizeof(int), arrays.rungs);
+		queue.enqueueWriteBuffer(clStepTimes, CL_FALSE, 0, numParticles * sizeof(float), arrays.stepTimes);
+		queue.enqueueWriteBuffer(clParticleIds, CL_TRUE, 0, numParticles * sizeof(int), arrays.particleIds);
+	}
+
+	SetParticleCountArgs();
+}
+
+void Simulation::SetUniformMass(const float* masses, int count) {
+	// Equal masses are compiled into the specialised kernels (building them on the first call, rebuilding if needed)
+	uniformMass = count > 0 && std::all_of(masses, masses + count, [&](float mass) { return mass == masses[0]; });
+	particleMass = uniformMass ? masses[0] : 0.0f;
+	UpdateProgramVariant(true);
+}
+
+void Simulation::SetSolver(SolverType type) {
+	if (type == SolverType::P3M && !SupportsP3M(config))
+		throw std::invalid_argument("P3M needs grid cells of at least 3.125 PM mesh cells (a coarser grid or a finer mesh)");
+	solver = type;
+}
+
+void Simulation::Step(int steps) {
+	if (numParticles == 0)
+		return;
+
+	stepCount += steps;
+	simulatedTime += static_cast<double>(steps) * deltaTime;
+
+	// Switches to a variant built in the background since the last step
+	UpdateProgramVariant(false);
+
+	kernelUpdate.setArg(11, farFieldRadius);
+	kernelUpdate.setArg(15, gravityConstant);
+
+	kernelUpdateBarnesHut.setArg(7, theta * theta);
+	kernelUpdateBarnesHut.setArg(8, gravityConstant);
+
+	kernelFMMUpdate.setArg(12, gravityConstant);
+
+	kernelPMGradient.setArg(6, gravityConstant);
+	kernelPMConvolve.setArg(1, solver == SolverType::P3M ? clGreenP3M : clGreenPM);
+	kernelPMUpdate.setArg(16, solver == SolverType::P3M ? pmInvSplit : 0.0f);
+	kernelPMUpdate.setArg(18, gravityConstant);
+
+	kernelUpdateExact.setArg(5, gravityConstant);
+
+	const int blockSteps = maxRung > 0 ? 1 : 0;
+	kernelUpdate.setArg(18, blockSteps);
+	kernelUpdateBarnesHut.setArg(11, blockSteps);
+	kernelFMMUpdate.setArg(15, blockSteps);
+	kernelPMUpdate.setArg(21, blockSteps);
+	kernelUpdateExact.setArg(8, blockSteps);
+
+	if (blockSteps) {
+		for (int i = 0; i < steps; ++i) {
+			EnqueueReorder();
+			EnqueueBlockStep();
+		}
+		return;
+	}
+
+	// Every stage of the integrator is a full force evaluation of the solver
+	IntegrationStage stages[MaxIntegrationStages];
+	for (int i = 0; i < steps; ++i) {
+		EnqueueReorder();
+		const int numStages = IntegrationStages(integrator, deltaTime, lastDrift, stages);
+		for (int stage = 0; stage < numStages; ++stage) {
+			SetIntegrationArgs(stages[stage]);
+			EnqueueSolverStep();
+		}
+	}
+}
+
+void Simulation::SetIntegrationArgs(const IntegrationStage& stage) {
+	kernelUpdate.setArg(16, stage.kick);
+	kernelUpdate.setArg(17, stage.drift);
+	kernelUpdateBarnesHut.setArg(9, stage.kick);
+	kernelUpdateBarnesHut.setArg(10, stage.drift);
+	kernelFMMUpdate.setArg(13, stage.kick);
+	kernelFMMUpdate.setArg(14, stage.drift);
+	kernelPMUpdate.setArg(19, stage.kick);
+	kernelPMUpdate.setArg(20, stage.drift);
+	kernelUpdateExact.setArg(6, stage.kick);
+	kernelUpdateExact.setArg(7, stage.drift);
+}
+
+void Simulation::EnqueueSolverStep() {
+	EnqueueBounds();
+
+	switch (solver) {
+	case SolverType::Grid:      EnqueueGridStep(); break;
+	case SolverType::BarnesHut: EnqueueBarnesHutStep(); break;
+	case SolverType::FMM:       EnqueueFMMStep(); break;
+	case SolverType::PM:
+	case SolverType::P3M:       EnqueuePMStep(); break;
+	case SolverType::Exact:     EnqueueExactStep(); break;
+	}
+}
+
+void Simulation::EnqueueBounds() {
+	// PM and P3M keep the configured world: their Green's functions and short-range split are tied to its mesh and
+	// cells. Exact has no grid to fit.
+	const bool fitted = boundsInterval > 0 && solver != SolverType::PM && solver != SolverType::P3M && solver != SolverType::Exact;
+	if (!fitted) {
+		if (gridGeometryFitted) {
+			queue.enqueueWriteBuffer(clGridGeometry, CL_FALSE, 0, sizeof(fixedGridGeometry), fixedGridGeometry);
+			gridGeometryFitted = false;
+		}
+		return;
+	}
+
+	if (gridGeometryFitted && --boundsCountdown > 0)
+		return;
+	boundsCountdown = boundsInterval;
+	gridGeometryFitted = true;
+
+	const cl::NDRange local(config.localSize);
+	EnqueueKernel(kernelReduceBounds, cl::NDRange(boundsGroups * config.localSize), local);
+	EnqueueKernel(kernelFinalizeBounds, local, local);
+}
+
+void Simulation::EnqueueBlockStep() {
+	const cl::NDRange local(config.localSize);
+	const int numSubsteps = 1 << maxRung;
+
+	kernelKickActive.setArg(6, deltaTime);
+	kernelKickActive.setArg(7, maxRung);
+	// Rung criterion of the softening the forces use, until a variant of a new softening has been built
+	kernelKickActive.setArg(9, 1.0f / (2.0f * timestepAccuracy * std::sqrt(programSoftening)));
+	kernelKickActive.setArg(10, integrator == Integrator::Euler ? 0 : 1);
+	kernelDrift.setArg(2, deltaTime / numSubsteps);
+
+	for (int substep = 0; substep < numSubsteps; ++substep) {
+		// Rung r starts a step every 2^(maxRung - r) substeps
+		activeRung = maxRung;
+		while (activeRung > 0 && substep % (1 << (maxRung - activeRung + 1)) == 0)
+			--activeRung;
+		kernelCompactActive.setArg(6, activeRung);
+		kernelKickActive.setArg(8, activeRung);
+
+		// The solver compacts the active particles once its slot order is known (EnqueueActiveParticles)
+		EnqueueSolverStep();
+		EnqueueKernel(kernelKickActive, cl::NDRange(globalParticles), local);
+		EnqueueKernel(kernelDrift, cl::NDRange(globalParticles), local);
+	}
+}
+
+void Simulation::EnqueueActiveParticles(bool sortedSlots) {
+	if (maxRung == 0)
+		return;
+
+	kernelCompactActive.setArg(5, sortedSlots ? 1 : 0);
+	queue.enqueueFillBuffer(clActiveCount, 0, 0, sizeof(int));
+	EnqueueKernel(kernelCompactActive, cl::NDRange(globalParticles), cl::NDRange(config.localSize));
+}
+
+void Simulation::EnqueueBinning() {
+	const cl::NDRange local(config.localSize);
+
+	// Cell binning: histogram (fused into the cell index pass) -> exclusive scan -> scatter
+	queue.enqueueFillBuffer(clCellCounter, 0, 0, totalCells * sizeof(int));
+	EnqueueKernel(kernelCellIndex, cl::NDRange(globalParticles), local);
+	EnqueueKernel(kernelScanCells, local, local);
+	EnqueueKernel(kernelScatter, cl::NDRange(globalParticles), local);
+}
+
+void Simulation::EnqueueGridStep() {
+	const cl::NDRange local(config.localSize);
+
+	EnqueueBinning();
+
+	// Cell sums are accumulated, so they start from zero every step
+	queue.enqueueFillBuffer(clCellMass, 0.0f, 0, totalCells * sizeof(float));
+	queue.enqueueFillBuffer(clCellCOM, 0.0f, 0, totalCells * sizeof(glm::vec2));
+	if (useLocalCellCOM)
+		EnqueueKernel(kernelComputeCOM, cl::NDRange(globalCOM), local);
+	else
+		EnqueueKernel(kernelComputeCOMGlobal, cl::NDRange(globalParticles), local);
+
+	// Coarser pyramid levels from the finer ones
+	for (size_t level = 1; level < pyramidLevels.size(); ++level) {
+		const glm::ivec4& src = pyramidLevels[level - 1];
+		const glm::ivec4& dst = pyramidLevels[level];
+		kernelBuildPyramid.setArg(2, src.x);
+		kernelBuildPyramid.setArg(3, src.y);
+		kernelBuildPyramid.setArg(4, src.z);
+		kernelBuildPyramid.setArg(5, dst.x);
+		kernelBuildPyramid.setArg(6, dst.y);
+		kernelBuildPyramid.setArg(7, dst.z);
+		EnqueueKernel(kernelBuildPyramid, cl::NDRange(RoundUp(dst.y * dst.z, config.localSize)), local);
+	}
+
+	EnqueueActiveParticles(true);
+	EnqueueKernel(kernelUpdate, cl::NDRange(globalParticles), local);
+}
+
+void Simulation::EnqueueReorder() {
+	if (reorderInterval == 0 || ++stepsSinceReorder < reorderInterval)
+		return;
+	stepsSinceReorder = 0;
+	particlesReordered = true;
+
+	// Gather every per-particle array in Morton order, then copy the result back: the particle buffers stay the
+	// ones bound to the kernels and the render side
+	EnqueueMortonSort();
+	EnqueueKernel(kernelReorder, cl::NDRange(globalParticles), cl::NDRange(config.localSize));
+	queue.enqueueCopyBuffer(clReorderPositions, clPositions, 0, 0, numParticles * sizeof(glm::vec2));
+	queue.enqueueCopyBuffer(clReorderVelocities, clVelocities, 0, 0, numParticles * sizeof(glm::vec2));
+	queue.enqueueCopyBuffer(clReorderMasses, clMasses, 0, 0, numParticles * sizeof(float));
+	queue.enqueueCopyBuffer(clReorderRungs, clRungs, 0, 0, numParticles * sizeof(int));
+	queue.enqueueCopyBuffer(clReorderStepTimes, clStepTimes, 0, 0, numParticles * sizeof(float));
+	queue.enqueueCopyBuffer(clReorderIds, clParticleIds, 0, 0, numParticles * sizeof(int));
+}
+
+void Simulation::EnqueueMortonSort() {
+	const cl::NDRange local(config.localSize);
+
+	// Morton codes of the particles (padded to a power of two)
+	EnqueueKernel(kernelMortonCodes, cl::NDRange(sortCount), local);
+
+	// Bitonic sort: blocks of 2 * localSize in local memory, then for every larger stage
+	// the strides >= block size globally and the rest of the stage locally.
+	const cl::NDRange sortPairs(sortCount / 2);
+	kernelBitonicLocal.setArg(2, 2);
+	kernelBitonicLocal.setArg(3, static_cast<int>(sortBlockSize));
+	EnqueueKernel(kernelBitonicLocal, sortPairs, local);
+	for (size_t k = 2 * sortBlockSize; k <= sortCount; k <<= 1) {
+		for (size_t j = k / 2; j >= sortBlockSize; j >>= 1) {
+			kernelBitonicGlobal.setArg(2, static_cast<int>(j));
+			kernelBitonicGlobal.setArg(3, static_cast<int>(k));
+			EnqueueKernel(kernelBitonicGlobal, cl::NDRange(sortCount), local);
+		}
+		kernelBitonicLocal.setArg(2, static_cast<int>(k));
+		kernelBitonicLocal.setArg(3, static_cast<int>(k));
+		EnqueueKernel(kernelBitonicLocal, sortPairs, local);
+	}
+}
+
+void Simulation::EnqueueBarnesHutStep() {
+	const cl::NDRange local(config.localSize);
+	const int numInternal = numParticles - 1;
+
+	EnqueueMortonSort();
+	EnqueueKernel(kernelGatherSorted, cl::NDRange(globalParticles), local);
+
+	// Radix tree over the sorted codes. With a single particle the root is the only leaf.
+	queue.enqueueFillBuffer(clNodeParent, -1, 0, sizeof(int));
+	if (numInternal > 0) {
+		queue.enqueueFillBuffer(clNodeVisits, 0, 0, numInternal * sizeof(int));
+		EnqueueKernel(kernelBuildTree, cl::NDRange(RoundUp(numInternal, config.localSize)), local);
+	}
+	EnqueueKernel(kernelTreeNodes, cl::NDRange(globalParticles), local);
+
+	EnqueueActiveParticles(true);
+	EnqueueKernel(kernelUpdateBarnesHut, cl::NDRange(globalParticles), local);
+}
+
+void Simulation::EnqueueFMMStep() {
+	const cl::NDRange local(config.localSize);
+	const int numLevels = static_cast<int>(pyramidLevels.size());
+
+	EnqueueBinning();
+
+	// Upward pass: leaf moments from the binned particles, then every coarser level from its children
+	EnqueueKernel(kernelFMMP2M, cl::NDRange(RoundUp(totalCells, config.localSize)), local);
+	for (int level = 1; level < numLevels; ++level) {
+		const glm::ivec4& info = pyramidLevels[level];
+		kernelFMMM2M.setArg(2, level);
+		EnqueueKernel(kernelFMMM2M, cl::NDRange(RoundUp(info.y * info.z, config.localSize)), local);
+	}
+
+	// Downward pass: local expansions from the top (single cell) to the grid
+	for (int level = numLevels - 1; level >= 0; --level) {
+		const glm::ivec4& info = pyramidLevels[level];
+		kernelFMMDownward.setArg(4, level);
+		EnqueueKernel(kernelFMMDownward, cl::NDRange(RoundUp(info.y * info.z, config.localSize)), local);
+	}
+
+	EnqueueActiveParticles(true);
+	EnqueueKernel(kernelFMMUpdate, cl::NDRange(globalParticles), local);
+}
+
+void Simulation::EnqueuePMStep() {
+	const cl::NDRange local(config.localSize);
+	const size_t paddedNodes = static_cast<size_t>(meshPaddedNx) * meshPaddedNy;
+	const size_t meshNodes = static_cast<size_t>(config.pmMeshNx) * config.pmMeshNy;
+
+	// Binning: cell-ordered deposit (fewer atomic collisions) and the P3M near field
+	EnqueueBinning();
+
+	// Mass assignment on the zero-padded mesh
+	queue.enqueueFillBuffer(clMeshDensity, glm::vec2(0.0f), 0, paddedNodes * sizeof(glm::vec2));
+	EnqueueKernel(kernelPMDeposit, cl::NDRange(globalParticles), local);
+
+	// Potential = IFFT(FFT(density) * FFT(green))
+	EnqueueFFT2D(clMeshDensity, -1.0f);
+	EnqueueKernel(kernelPMConvolve, cl::NDRange(RoundUp(paddedNodes, config.localSize)), local);
+	EnqueueFFT2D(clMeshDensity, 1.0f);
+
+	EnqueueKernel(kernelPMGradient, cl::NDRange(RoundUp(meshNodes, config.localSize)), local);
+	EnqueueActiveParticles(true);
+	EnqueueKernel(kernelPMUpdate, cl::NDRange(globalParticles), local);
+}
+
+void Simulation::EnqueueExactStep() {
+	const cl::NDRange local(config.localSize);
+
+	EnqueueKernel(kernelPackPosMass, cl::NDRange(globalParticles), local);
+	EnqueueActiveParticles(false);
+	EnqueueKernel(kernelUpdateExact, cl::NDRange(globalParticles), local);
+}
+
+void Simulation::EnqueueFFT2D(cl::Buffer& data, float direction) {
+	const cl::NDRange local(config.localSize);
+	cl::Buffer* src = &data;
+	cl::Buffer* dst = &clMeshScratch;
+
+	// Rows (elements contiguous), then columns (lines contiguous), ping-ponging between data and scratch
+	const struct { int n, elementStride, lineStride, numLines; } passes[] = {
+		{ meshPaddedNx, 1, meshPaddedNx, meshPaddedNy },
+		{ meshPaddedNy, meshPaddedNx, 1, meshPaddedNx },
+	};
+	kernelFFT.setArg(7, direction);
+	for (const auto& pass : passes) {
+		kernelFFT.setArg(2, pass.n);
+		kernelFFT.setArg(4, pass.elementStride);
+		kernelFFT.setArg(5, pass.lineStride);
+		kernelFFT.setArg(6, pass.numLines);
+		const cl::NDRange global(RoundUp(static_cast<size_t>(pass.n / 2) * pass.numLines, config.localSize));
+		for (int p = 1; p < pass.n; p <<= 1) {
+			kernelFFT.setArg(0, *src);
+			kernelFFT.setArg(1, *dst);
+			kernelFFT.setArg(3, p);
+			EnqueueKernel(kernelFFT, global, local);
+			std::swap(src, dst);
+		}
+	}
+
+	if (src != &data)
+		queue.enqueueCopyBuffer(*src, data, 0, 0, static_cast<size_t>(meshPaddedNx) * meshPaddedNy * sizeof(glm::vec2));
+}
+
+void Simulation::EnqueueKernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local) {
+	if (!config.profiling) {
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+		return;
+	}
+
+	cl::Event event;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, &event);
+	profiler.Record(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), event);
+}
+
+void Simulation::Finish() {
+	queue.finish();
+	if (config.profiling)
+		profiler.Collect();
+}
+
+void Simulation::ReadState(ParticleState& state) {
+	state.resize(numParticles);
+	if (numParticles == 0)
+		return;
+
+	queue.enqueueReadBuffer(clPositions, CL_FALSE, 0, state.positions.size() * sizeof(glm::vec2), state.positions.data());
+	queue.enqueueReadBuffer(clVelocities, CL_FALSE, 0, state.velocities.size() * sizeof(glm::vec2), state.velocities.data());
+	queue.enqueueReadBuffer(clMasses, CL_TRUE, 0, state.masses.size() * sizeof(float), state.masses.data());
+	if (!particlesReordered)
+		return;
+
+	// Back to the Init order
+	std::vector<int> ids(numParticles);
+	queue.enqueueReadBuffer(clParticleIds, CL_TRUE, 0, ids.size() * sizeof(int), ids.data());
+	ParticleState sorted = state;
+	for (int slot = 0; slot < numParticles; ++slot) {
+		state.positions[ids[slot]] = sorted.positions[slot];
+		state.velocities[ids[slot]] = sorted.velocities[slot];
+		state.masses[ids[slot]] = sorted.masses[slot];
+	}
+}
+
+cl::Event Simulation::EnqueueReadParticleArrays(ParticleArrays& arrays) {
+	arrays.positions.resize(numParticles);
+	arrays.velocities.resize(numParticles);
+	arrays.masses.resize(numParticles);
+	arrays.rungs.resize(numParticles);
+	arrays.stepTimes.resize(numParticles);
+	arrays.particleIds.resize(numParticles);
+
+	cl::Event done;
+	if (numParticles == 0) {
+		queue.enqueueMarkerWithWaitList(nullptr, &done);
+		return done;
+	}
+
+	// In-order queue: the last read completes after the others
+	queue.enqueueReadBuffer(clPositions, CL_FALSE, 0, numParticles * sizeof(glm::vec2), arrays.positions.data());
+	queue.enqueueReadBuffer(clVelocities, CL_FALSE, 0, numParticles * sizeof(glm::vec2), arrays.velocities.data());
+	queue.enqueueReadBuffer(clMasses, CL_FALSE, 0, numParticles * sizeof(float), arrays.masses.data());
+	queue.enqueueReadBuffer(clRungs, CL_FALSE, 0, numParticles * sizeof(int), arrays.rungs.data());
+	queue.enqueueReadBuffer(clStepTimes, CL_FALSE, 0, numParticles * sizeof(float), arrays.stepTimes.data());
+	queue.enqueueReadBuffer(clParticleIds, CL_FALSE, 0, numParticles * sizeof(int), arrays.particleIds.data());
+	queue.enqueueReadBuffer(clGridGeometry, CL_FALSE, 0, sizeof(arrays.gridGeometry), arrays.gridGeometry, nullptr, &done);
+	queue.flush();
+	return done;
+}
+
+void Simulation::EnqueuePackRenderVertices(const cl::Buffer& vertices, float maxSpeed) {
+	if (numParticles == 0)
+		return;
+
+	kernelPackRender.setArg(2, vertices);
+	kernelPackRender.setArg(3, maxSpeed);
+	kernelPackRender.setArg(4, numParticles);
+	EnqueueKernel(kernelPackRender, cl::NDRange(globalParticles), cl::NDRange(config.localSize));
+}
+
+void Simulation::EnqueueQuantizePositions(const cl::Buffer& quantized, const glm::vec2& origin, const glm::vec2& scale) {
+	if (numParticles == 0)
+		return;
+
+	kernelQuantize.setArg(2, quantized);
+	kernelQuantize.setArg(3, origin);
+	kernelQuantize.setArg(4, scale);
+	kernelQuantize.setArg(5, numParticles);
+	EnqueueKernel(kernelQuantize, cl::NDRange(globalParticles), cl::NDRange(config.localSize));
+}
+
+} // namespace nbody
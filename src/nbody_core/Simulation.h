@@ -0,0 +1,443 @@
+#pragma once
+
+// GLM
+#include <glm/glm.hpp>
+
+// OpenCL
+#include <CL/opencl.hpp>
+#include <oclutils.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "DeviceProfiler.h"
+#include "InitialConditions.h"
+
+// Default expansion order of the FMM solver (overridable by the NBODY_FMM_ORDER CMake cache variable)
+#ifndef NBODY_FMM_ORDER
+#define NBODY_FMM_ORDER 4
+#endif
+
+namespace nbody {
+
+// Force evaluation method
+enum class SolverType : int {
+	Grid = 0,      // Uniform grid: exact 3x3 cell neighbourhood + cell COM far field
+	BarnesHut = 1, // Linear quadtree over Morton-ordered particles with opening angle theta
+	FMM = 2,       // Fast Multipole Method on the cell pyramid: exact 3x3 cell neighbourhood + multipole/local expansions
+	PM = 3,        // Particle-mesh: CIC deposit + FFT convolution on the PM mesh, no near field
+	P3M = 4,       // PM long-range force + exact short-range force over the 3x3 cell neighbourhood
+	Exact = 5,     // All pairs, tiled through local memory (reference for the approximations)
+};
+
+constexpr int SolverCount = 6;
+
+// Time integration scheme. The update kernels apply 'kick' (v += a * kick) and 'drift' (x += v * drift) once per
+// force evaluation; the schemes differ only in those times and in the number of force evaluations per step.
+enum class Integrator : int {
+	Euler = 0,    // Semi-implicit Euler: 1 force evaluation, kick = drift = dt
+	Leapfrog = 1, // Kick-drift-kick leapfrog (2nd order): 1 force evaluation, consecutive half kicks merged
+	Yoshida4 = 2, // Forest-Ruth / Yoshida (4th order): 3 leapfrog substeps of w1, w0, w1 times dt
+};
+
+constexpr int IntegratorCount = 3;
+
+const char* IntegratorName(Integrator integrator);
+
+// Kick and drift times of one force evaluation
+struct IntegrationStage {
+	float kick;
+	float drift;
+};
+
+constexpr int MaxIntegrationStages = 3;
+
+// Fills the stages of one step of 'dt' and returns their count. 'lastDrift' carries the drift of the last stage
+// across steps: the leapfrog schemes merge its closing half kick into the opening half kick of the next stage
+// (so their stored velocities lag half a stage behind the positions). Reset it to 0 at initialization.
+int IntegrationStages(Integrator integrator, float dt, float& lastDrift, IntegrationStage stages[MaxIntegrationStages]);
+
+// Finest rung of the block timesteps (steps of dt / 2^MaxRung)
+constexpr int MaxRung = 10;
+
+// Plummer softening (squared length) of the force kernels unless changed with Simulation::SetSoftening
+constexpr float DefaultSoftening = 0.001f;
+
+// Bytes per particle of the render buffer written by Simulation::EnqueuePackRenderVertices
+constexpr size_t RenderVertexSize = 8;
+
+const char* SolverName(SolverType solver);
+
+// Fixed (allocation-time) parameters of a simulation.
+struct SimulationConfig {
+	int maxParticles = 50000; // buffer capacity
+
+	// Grids (2D)
+	int gridNx = 64;
+	int gridNy = 64;
+
+	// World size
+	float worldMinX = -1.0f;
+	float worldMaxX = 1.0f;
+	float worldMinY = -1.0f;
+	float worldMaxY = 1.0f;
+
+	// Work-group size of the kernels
+	size_t localSize = 128;
+
+	// Expansion order of the FMM solver (1..8), compiled into the kernels
+	int fmmOrder = NBODY_FMM_ORDER;
+
+	// PM mesh (powers of two >= 2). The FFT runs on twice this size for isolated boundaries.
+	// P3M splits the force at a = 1.25 mesh cells (the finest scale the CIC mesh resolves) and sums the short-range
+	// part over the 3x3 grid cells around a particle, which covers its tail only if the grid cells are at least
+	// 2.5a = 3.125 mesh cells: e.g. up to a 64x64 grid for the 256x256 mesh (see SupportsP3M).
+	int pmMeshNx = 256;
+	int pmMeshNy = 256;
+
+	// Directory of the .cl sources. Empty = the kernels directory of the nbody_core sources.
+	std::string kernelDirectory;
+
+	// Directory of cached program binaries (see ProgramCache). Empty = build from source every time.
+	std::string programCacheDirectory;
+
+	// Compile the grid size, the work-group size and (after Init with equal masses) the particle mass into the
+	// kernels as constants. Off = one generic program reading them from kernel arguments and buffers.
+	bool specializeKernels = true;
+
+	// Create the queue with CL_QUEUE_PROFILING_ENABLE and record the device time of every kernel (see GetProfiler)
+	bool profiling = false;
+};
+
+// Complete per-particle state of a Simulation in slot order (see Simulation::EnqueueReadParticleArrays)
+struct ParticleArrays {
+	std::vector<glm::vec2> positions;
+	std::vector<glm::vec2> velocities;
+	std::vector<float>     masses;
+	std::vector<int>       rungs;       // block timestep rung
+	std::vector<float>     stepTimes;   // block timestep state (see timestep.cl)
+	std::vector<int>       particleIds; // Init index of every slot
+	glm::vec4              gridGeometry[2] = {}; // world of the grid, configured or fitted (see bounds.cl)
+};
+
+// Non-owning view of the same arrays, 'count' entries each (e.g. into a memory-mapped checkpoint)
+struct ParticleArraysView {
+	int              count = 0;
+	const glm::vec2* positions = nullptr;
+	const glm::vec2* velocities = nullptr;
+	const float*     masses = nullptr;
+	const int*       rungs = nullptr;
+	const float*     stepTimes = nullptr;
+	const int*       particleIds = nullptr;
+	const glm::vec4* gridGeometry = nullptr; // fitted world of the grid (2 entries), null = the configured world
+};
+
+// Hash of the kernel sources and build options of a Simulation with this configuration (keys of the on-disk caches)
+std::uint64_t KernelSourceHash(const SimulationConfig& config);
+
+// Whether the grid of 'config' is coarse enough for the P3M split of its PM mesh (see SimulationConfig::pmMeshNx)
+bool SupportsP3M(const SimulationConfig& config);
+
+/**
+ * Headless N-body solver (uniform grid, Barnes-Hut, Fast Multipole or particle-mesh approximation,
+ * or the exact all-pairs sum).
+ *
+ * All simulation state lives in plain cl::Buffer objects owned by this class, so it runs on any
+ * OpenCL device (GPU or CPU drivers such as PoCL). Rendering front-ends let the simulation pack a
+ * compact copy into their own buffers (see GLInteropAdapter in the OpenGL viewer).
+ */
+class Simulation {
+public:
+	Simulation(const cl::Context& context, const cl::Device& device, const SimulationConfig& config = {});
+
+	// Uploads the host arrays. The number of particles must not exceed config.maxParticles. The first Init (or
+	// Restore) builds the kernels, with the particle mass compiled in if every particle has the same one.
+	void Init(const ParticleState& state);
+
+	// Enqueues 'steps' simulation steps. Does not wait for completion.
+	void Step(int steps = 1);
+
+	// Blocks until every enqueued command has finished (and collects their timings when profiling).
+	void Finish();
+
+	// Blocking read of the current particle state into host arrays.
+	void ReadState(ParticleState& state);
+
+	// Non-blocking read of the complete per-particle state (for checkpoints). 'arrays' must stay alive until the
+	// returned event - the last of the reads - has completed.
+	cl::Event EnqueueReadParticleArrays(ParticleArrays& arrays);
+
+	// Replaces the particles with a saved state (blocking upload from 'arrays'), keeping their slot order and block
+	// timesteps; 'lastDrift', 'steps' and 'time' continue the integrator and the step counters, and the fitted grid
+	// world of 'arrays', 'boundsCountdown' and 'stepsSinceReorder' the refit and reordering cycles (see Checkpoint.h).
+	void Restore(const ParticleArraysView& arrays, float lastDrift, std::uint64_t steps, double time,
+	             int boundsCountdown = 0, int stepsSinceReorder = 0);
+
+	// Enqueues the packing of the particles into a render buffer of RenderVertexSize bytes per particle
+	// (half2 position + speed / maxSpeed as a normalized byte, see packRenderVertices). Does not wait for completion.
+	void EnqueuePackRenderVertices(const cl::Buffer& vertices, float maxSpeed = 4.0f);
+
+	// Enqueues the quantization of the positions to round((position - origin) * scale) into a buffer of one int2 per
+	// particle, stored at the Init index of the particle (see quantizePositions). Does not wait for completion.
+	void EnqueueQuantizePositions(const cl::Buffer& quantized, const glm::vec2& origin, const glm::vec2& scale);
+
+	void SetGravityConstant(float G) { gravityConstant = G; }
+	void SetTimeStep(float dt) { deltaTime = dt; }
+	void SetSolver(SolverType type); // throws std::invalid_argument for P3M if !SupportsP3M(config)
+	void SetIntegrator(Integrator value) { integrator = value; }
+	void SetTheta(float value) { theta = value; } // Barnes-Hut opening angle
+	void SetFarFieldRadius(int cells) { farFieldRadius = std::max(cells, 1); } // Grid: pyramid level-selection distance
+
+	// Block timesteps: every step is split into 2^rungs substeps and each particle steps with dt / 2^r, r <= rungs,
+	// picked from its acceleration (see timestep.cl); 0 = one global step. Uses the leapfrog kicks unless the
+	// integrator is Euler (the Yoshida composition has a negative substep and is not combined with them).
+	void SetMaxRung(int rungs) { maxRung = std::clamp(rungs, 0, MaxRung); }
+	void SetTimestepAccuracy(float eta) { timestepAccuracy = eta; } // eta of dt = sqrt(2 eta epsilon / |a|)
+
+	// Dynamic world bounds: the grid (Grid, FMM) and the Morton codes (Barnes-Hut) are refitted to the bounding box of
+	// the particles every 'steps' force evaluations by a device reduction (see bounds.cl), with square cells;
+	// 0 = the configured world. PM, P3M and Exact always use the configured world.
+	void SetBoundsInterval(int steps) { boundsInterval = std::max(steps, 0); }
+
+	// Sorts the particle arrays by their Morton code every 'steps' steps (0 = never), so the particles that are close
+	// in space are close in memory too. The particle buffers and the render buffer then hold the particles in that
+	// order; GetParticleIdBuffer maps every slot to its Init index and ReadState returns the Init order.
+	void SetReorderInterval(int steps) { reorderInterval = std::max(steps, 0); }
+
+	// The softening is a compile-time constant of the kernels: a new value builds that program variant in the
+	// background while Step keeps using the current one (Init waits for it), forces and block timestep criterion
+	// alike. Built variants are kept.
+	void SetSoftening(float value) { softening = value; }
+	bool IsBuildingProgram() const { return pendingProgram.valid(); }
+
+	float GetGravityConstant() const { return gravityConstant; }
+	float GetTimeStep() const { return deltaTime; }
+	SolverType GetSolver() const { return solver; }
+	Integrator GetIntegrator() const { return integrator; }
+	float GetTheta() const { return theta; }
+	int   GetFarFieldRadius() const { return farFieldRadius; }
+	int   GetMaxRung() const { return maxRung; }
+	float GetTimestepAccuracy() const { return timestepAccuracy; }
+	float GetSoftening() const { return softening; }
+	int   GetBoundsInterval() const { return boundsInterval; }
+	int   GetReorderInterval() const { return reorderInterval; }
+	bool  IsGridGeometryFitted() const { return gridGeometryFitted; }
+	int   GetBoundsCountdown() const { return boundsCountdown; }     // force evaluations until the next refit
+	int   GetStepsSinceReorder() const { return stepsSinceReorder; }
+	int   GetNumParticles() const { return numParticles; }
+	float GetLastDrift() const { return lastDrift; }
+	std::uint64_t GetStepCount() const { return stepCount; } // steps since Init
+	double GetSimulatedTime() const { return simulatedTime; } // sum of the time steps since Init
+	const SimulationConfig& GetConfig() const { return config; }
+
+	const cl::Context&      GetContext() const { return context; }
+	const cl::Device&       GetDevice() const { return device; }
+	cl::CommandQueue&       GetQueue() { return queue; }
+	DeviceProfiler&         GetProfiler() { return profiler; } // kernel timings under their function names (config.profiling)
+	bool                    IsProfiling() const { return config.profiling; }
+	const cl::Buffer&       GetPositionBuffer() const { return clPositions; }
+	const cl::Buffer&       GetVelocityBuffer() const { return clVelocities; }
+	const cl::Buffer&       GetParticleIdBuffer() const { return clParticleIds; } // Init index of every slot
+
+private:
+	std::string VariantDefines() const;
+	void UpdateProgramVariant(bool wait);
+	void CreateKernels();
+	void SetParticleCountArgs();
+	void SetUniformMass(const float* masses, int count);
+	void EnqueueKernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local);
+	void SetIntegrationArgs(const IntegrationStage& stage);
+	void EnqueueSolverStep();
+	void EnqueueBounds();
+	void EnqueueBlockStep();
+	void EnqueueActiveParticles(bool sortedSlots);
+	void EnqueueBinning();
+	void EnqueueGridStep();
+	void EnqueueReorder();
+	void EnqueueMortonSort();
+	void EnqueueBarnesHutStep();
+	void EnqueueFMMStep();
+	void EnqueuePMStep();
+	void EnqueueExactStep();
+	void EnqueueFFT2D(cl::Buffer& data, float direction);
+
+	SimulationConfig config;
+
+	// Derived grid parameters
+	int   totalCells = 0;
+	int   pyramidCells = 0;
+	std::vector<glm::ivec4> pyramidLevels; // x = offset, y = width, z = height
+	float cellSizeInvX = 0.0f;
+	float cellSizeInvY = 0.0f;
+
+	// Derived PM mesh parameters
+	int   meshPaddedNx = 0;
+	int   meshPaddedNy = 0;
+	float meshInvX = 0.0f;
+	float meshInvY = 0.0f;
+	float pmInvSplit = 0.0f; // 1 / a of the P3M long/short range split
+
+	// OpenCL
+	cl::Context       context;
+	cl::Device        device;
+	cl::CommandQueue  queue;
+	cl::Program       program;
+	DeviceProfiler    profiler;
+
+	// Program variants by their defines (see VariantDefines) and the one being built in the background
+	std::string                        programDefines;
+	float                              programSoftening = DefaultSoftening; // softening compiled into 'program'
+	std::map<std::string, cl::Program> programVariants;
+	std::string                        pendingDefines;
+	std::future<cl::Program>           pendingProgram;
+
+	cl::Kernel        kernelCellIndex;
+	cl::Kernel        kernelComputeCOM;
+	cl::Kernel        kernelComputeCOMGlobal;
+	cl::Kernel        kernelScanCells;
+	cl::Kernel        kernelScatter;
+	cl::Kernel        kernelBuildPyramid;
+	cl::Kernel        kernelUpdate;
+	cl::Kernel        kernelPackRender;
+
+	// Barnes-Hut kernels
+	cl::Kernel        kernelMortonCodes;
+	cl::Kernel        kernelBitonicLocal;
+	cl::Kernel        kernelBitonicGlobal;
+	cl::Kernel        kernelGatherSorted;
+	cl::Kernel        kernelBuildTree;
+	cl::Kernel        kernelTreeNodes;
+	cl::Kernel        kernelUpdateBarnesHut;
+
+	// FMM kernels
+	cl::Kernel        kernelFMMP2M;
+	cl::Kernel        kernelFMMM2M;
+	cl::Kernel        kernelFMMDownward;
+	cl::Kernel        kernelFMMUpdate;
+
+	// PM kernels
+	cl::Kernel        kernelPMDeposit;
+	cl::Kernel        kernelFFT;
+	cl::Kernel        kernelPMConvolve;
+	cl::Kernel        kernelPMGradient;
+	cl::Kernel        kernelPMUpdate;
+
+	// Exact kernels
+	cl::Kernel        kernelPackPosMass;
+	cl::Kernel        kernelUpdateExact;
+
+	// Block timestep kernels
+	cl::Kernel        kernelCompactActive;
+	cl::Kernel        kernelKickActive;
+	cl::Kernel        kernelDrift;
+
+	// World bounds kernels
+	cl::Kernel        kernelReduceBounds;
+	cl::Kernel        kernelFinalizeBounds;
+
+	// Reordering kernel
+	cl::Kernel        kernelReorder;
+
+	// Trajectory kernel
+	cl::Kernel        kernelQuantize;
+
+	// Particle state (structure of arrays, float2 each)
+	cl::Buffer        clPositions;
+	cl::Buffer        clVelocities;
+	cl::Buffer        clMasses;
+
+	// Grid buffer
+	cl::Buffer        clParticleCellIndex;
+
+	// COM buffers (all pyramid levels back to back, level 0 first)
+	cl::Buffer        clCellMass;
+	cl::Buffer        clCellCOM;
+	cl::Buffer        clPyramidLevels;
+
+	// World of the grid: configured (fixedGridGeometry) or fitted to the particles, see bounds.cl
+	cl::Buffer        clGridGeometry;
+	cl::Buffer        clPartialBounds;
+	glm::vec4         fixedGridGeometry[2];
+
+	// Cell binning: histogram/insertion cursor, per-cell [start, end) ranges and the cell-sorted particles
+	cl::Buffer        clCellCounter;
+	cl::Buffer        clCellStart;
+	cl::Buffer        clCellEnd;
+	cl::Buffer        clSortedIndex;
+	cl::Buffer        clSortedPosMass;
+
+	// Barnes-Hut: Morton sort (key, particle id) and tree nodes (internal 0..N-2, leaves N-1..2N-2)
+	cl::Buffer        clMortonKeys;
+	cl::Buffer        clMortonValues;
+	cl::Buffer        clNodeChildren;
+	cl::Buffer        clNodeParent;
+	cl::Buffer        clNodeVisits;
+	cl::Buffer        clNodeMassCOM;
+	cl::Buffer        clNodeBounds;
+
+	// FMM: multipole and local expansion coefficients of every pyramid cell
+	cl::Buffer        clMultipoles;
+	cl::Buffer        clLocals;
+
+	// PM: padded complex mesh + FFT scratch, transformed Green's functions (full / P3M long range), node accelerations
+	cl::Buffer        clMeshDensity;
+	cl::Buffer        clMeshScratch;
+	cl::Buffer        clGreenPM;
+	cl::Buffer        clGreenP3M;
+	cl::Buffer        clMeshAccel;
+
+	// Block timesteps: rung and leapfrog step of every particle, active particle list, accelerations of the active particles
+	cl::Buffer        clRungs;
+	cl::Buffer        clStepTimes;
+	cl::Buffer        clActiveParticles;
+	cl::Buffer        clActiveCount;
+	cl::Buffer        clAccelerations;
+
+	// Reordering: Init index of every slot, gather targets of reorderParticles
+	cl::Buffer        clParticleIds;
+	cl::Buffer        clReorderPositions;
+	cl::Buffer        clReorderVelocities;
+	cl::Buffer        clReorderMasses;
+	cl::Buffer        clReorderRungs;
+	cl::Buffer        clReorderStepTimes;
+	cl::Buffer        clReorderIds;
+
+	// Launch sizes
+	size_t globalParticles = 0;
+	size_t globalCOM = 0;
+	size_t boundsGroups = 0;       // work-groups of the bounding box reduction
+	bool   useLocalCellCOM = true; // work-group private grid fits into local memory
+	size_t sortBlockSize = 0;      // elements sorted per work-group by bitonicSortLocal
+	size_t sortCapacity = 0;       // allocated (power of two) sort size
+	size_t sortCount = 0;          // current (power of two) sort size
+
+	// Step parameters
+	int   numParticles = 0;
+	float gravityConstant = 0.0001f;
+	float deltaTime = 0.001f;
+	SolverType solver = SolverType::Grid;
+	Integrator integrator = Integrator::Euler;
+	float lastDrift = 0.0f; // see IntegrationStages
+	std::uint64_t stepCount = 0;
+	double simulatedTime = 0.0;
+	float theta = 0.5f;
+	int   farFieldRadius = 1;
+	int   maxRung = 0;
+	float timestepAccuracy = 0.025f;
+	int   activeRung = 0; // coarsest active rung of the current substep
+	float softening = DefaultSoftening;
+	bool  uniformMass = false; // every particle has 'particleMass' (set by Init)
+	float particleMass = 0.0f;
+	int   boundsInterval = 0;       // force evaluations between refits of the world, 0 = configured world
+	int   boundsCountdown = 0;
+	bool  gridGeometryFitted = false; // clGridGeometry holds a fitted world
+	int   reorderInterval = 0;      // steps between Morton reorderings, 0 = never
+	int   stepsSinceReorder = 0;
+	bool  particlesReordered = false; // the slots no longer follow the Init order
+};
+
+} // namespace nbody
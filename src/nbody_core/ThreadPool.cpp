@@ -0,0 +1,82 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace nbody {
+
+ThreadPool::ThreadPool(int numThreads) {
+	if (numThreads <= 0)
+		numThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+	for (int i = 1; i < numThreads; ++i)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeWorkers.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& body) {
+	if (count == 0)
+		return;
+
+	grain = std::max<size_t>(grain, 1);
+	if (workers.empty() || count <= grain) {
+		body(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobBody = &body;
+		jobCount = count;
+		jobGrain = grain;
+		jobNext = 0;
+		activeWorkers = static_cast<int>(workers.size());
+		++generation;
+	}
+	wakeWorkers.notify_all();
+
+	RunChunks();
+
+	// Every worker has to leave the job before 'body' goes out of scope
+	std::unique_lock<std::mutex> lock(mutex);
+	jobDone.wait(lock, [this] { return activeWorkers == 0; });
+	jobBody = nullptr;
+}
+
+void ThreadPool::WorkerLoop() {
+	size_t seenGeneration = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeWorkers.wait(lock, [&] { return stopping || generation != seenGeneration; });
+			if (stopping)
+				return;
+			seenGeneration = generation;
+		}
+
+		RunChunks();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--activeWorkers == 0)
+			jobDone.notify_one();
+	}
+}
+
+void ThreadPool::RunChunks() {
+	for (;;) {
+		const size_t begin = jobNext.fetch_add(jobGrain);
+		if (begin >= jobCount)
+			return;
+		(*jobBody)(begin, std::min(begin + jobGrain, jobCount));
+	}
+}
+
+} // namespace nbody
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nbody {
+
+/**
+ * Fixed set of worker threads running data-parallel loops.
+ *
+ * ParallelFor hands out chunks of 'grain' iterations from a shared counter, so threads that
+ * finish early (e.g. on a less loaded socket) keep taking work. The calling thread takes part
+ * in the loop and the call returns when every chunk is done.
+ */
+class ThreadPool {
+public:
+	// numThreads = 0: one thread per hardware thread. The calling thread counts as one of them.
+	explicit ThreadPool(int numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls body(begin, end) on disjoint chunks of [0, count).
+	void ParallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& body);
+
+	int GetNumThreads() const { return static_cast<int>(workers.size()) + 1; }
+
+private:
+	void WorkerLoop();
+	void RunChunks();
+
+	std::vector<std::thread> workers;
+
+	std::mutex              mutex;
+	std::condition_variable wakeWorkers;
+	std::condition_variable jobDone;
+	size_t                  generation = 0; // incremented for every job
+	int                     activeWorkers = 0;
+	bool                    stopping = false;
+
+	// Current job
+	const std::function<void(size_t, size_t)>* jobBody = nullptr;
+	size_t                  jobCount = 0;
+	size_t                  jobGrain = 1;
+	std::atomic<size_t>     jobNext{ 0 };
+};
+
+} // namespace nbody
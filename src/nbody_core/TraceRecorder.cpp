@@ -0,0 +1,132 @@
+#include "TraceRecorder.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+namespace nbody {
+
+namespace {
+	// Trace-event ids: one process, one track per thread id
+	constexpr int HostThread = 1;
+	constexpr int DeviceThread = 2;
+
+	void WriteString(std::ostream& out, const std::string& text) {
+		out << '"';
+		for (const char c : text) {
+			if (c == '"' || c == '\\')
+				out << '\\';
+			out << (static_cast<unsigned char>(c) < 0x20 ? ' ' : c);
+		}
+		out << '"';
+	}
+
+	// Trace timestamps are microseconds
+	double Microseconds(std::int64_t ns) {
+		return ns / 1000.0;
+	}
+}
+
+TraceRecorder::Scope::Scope(TraceRecorder& tracer_, const char* name_)
+	: tracer(tracer_.IsRecording() ? &tracer_ : nullptr), name(name_)
+{
+	if (tracer)
+		begin = Clock::now();
+}
+
+TraceRecorder::Scope::~Scope() {
+	if (tracer)
+		tracer->AddHostEvent(name, begin, Clock::now());
+}
+
+void TraceRecorder::Start(int frames) {
+	events.clear();
+	recording = true;
+	framesLeft = std::max(frames, 0);
+	frameCount = 0;
+	start = Clock::now();
+	hasDeviceOffset = false;
+}
+
+void TraceRecorder::Stop() {
+	if (!recording)
+		return;
+	recording = false;
+	stop = Clock::now();
+}
+
+bool TraceRecorder::EndFrame() {
+	if (!recording)
+		return false;
+
+	const std::int64_t now = SinceStart(Clock::now());
+	events.push_back({ "Frame " + std::to_string(frameCount++), Track::Frame, now, 0 });
+
+	if (framesLeft > 0 && --framesLeft == 0) {
+		Stop();
+		return true;
+	}
+	return false;
+}
+
+void TraceRecorder::AddHostEvent(const std::string& name, Clock::time_point begin, Clock::time_point end) {
+	if (!recording)
+		return;
+	events.push_back({ name, Track::Host, SinceStart(begin), std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() });
+}
+
+void TraceRecorder::AddDeviceEvent(const std::string& name, const cl::Event& event, Clock::time_point enqueued) {
+	if (enqueued < start || (!recording && enqueued > stop))
+		return;
+
+	const auto queued = static_cast<std::int64_t>(event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>());
+	const auto began = static_cast<std::int64_t>(event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+	const auto ended = static_cast<std::int64_t>(event.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+
+	// The command was queued before the enqueue call returned, so every sample overestimates the offset
+	const std::int64_t offset = SinceStart(enqueued) - queued;
+	if (!hasDeviceOffset || offset < deviceOffset) {
+		deviceOffset = offset;
+		hasDeviceOffset = true;
+	}
+
+	events.push_back({ name, Track::Device, began, ended - began });
+}
+
+void TraceRecorder::Write(std::ostream& out) const {
+	out << std::fixed << std::setprecision(3);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"nbody\"}},\n";
+	out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << HostThread << ",\"name\":\"thread_name\",\"args\":{\"name\":\"Host\"}},\n";
+	out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << DeviceThread << ",\"name\":\"thread_name\",\"args\":{\"name\":\"Device queue\"}}";
+
+	for (const Event& event : events) {
+		const bool device = event.track == Track::Device;
+		const std::int64_t begin = device ? event.begin + deviceOffset : event.begin;
+
+		out << ",\n{\"name\":";
+		WriteString(out, event.name);
+		if (event.track == Track::Frame)
+			out << ",\"ph\":\"i\",\"s\":\"p\"";
+		else
+			out << ",\"ph\":\"X\",\"dur\":" << Microseconds(event.duration);
+		out << ",\"ts\":" << Microseconds(begin) << ",\"pid\":1,\"tid\":" << (device ? DeviceThread : HostThread) << '}';
+	}
+
+	out << "\n]}\n";
+}
+
+void TraceRecorder::Save(const std::string& fileName) const {
+	std::ofstream out(fileName);
+	if (!out)
+		throw std::runtime_error("Failed to open trace file: " + fileName);
+	Write(out);
+}
+
+std::int64_t TraceRecorder::SinceStart(Clock::time_point time) const {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time - start).count();
+}
+
+} // namespace nbody
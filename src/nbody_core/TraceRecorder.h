@@ -0,0 +1,87 @@
+#pragma once
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace nbody {
+
+/**
+ * Timeline of host scopes and device commands, written as Chrome trace-event JSON
+ * (chrome://tracing, https://ui.perfetto.dev).
+ *
+ * Host scopes are timed with steady_clock. Device commands come from completed events of a
+ * profiling queue (DeviceProfiler forwards them) and are moved onto the host clock with the
+ * smallest observed difference between the host time of the enqueue call and the device's
+ * CL_PROFILING_COMMAND_QUEUED, which is accurate to the enqueue overhead. Not thread safe:
+ * record from the thread that drives the simulation.
+ */
+class TraceRecorder {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Records a host scope from construction to destruction (nothing when not recording)
+	class Scope {
+	public:
+		Scope(TraceRecorder& tracer, const char* name);
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		TraceRecorder* tracer;
+		const char*    name;
+		Clock::time_point begin;
+	};
+
+	// Drops the previous capture and starts a new one. frames > 0: the capture ends after that many EndFrame calls.
+	void Start(int frames = 0);
+	void Stop();
+
+	// Marks the end of a frame on the host track. Returns true if this ends a capture started with a frame count.
+	bool EndFrame();
+
+	bool   IsRecording() const { return recording; }
+	size_t GetEventCount() const { return events.size(); }
+
+	void AddHostEvent(const std::string& name, Clock::time_point begin, Clock::time_point end);
+
+	// Command of a completed event of a profiling queue; 'enqueued' is the host time right after the enqueue call.
+	// Commands enqueued after Stop are ignored, the ones still in flight at Stop are kept.
+	void AddDeviceEvent(const std::string& name, const cl::Event& event, Clock::time_point enqueued);
+
+	void Write(std::ostream& out) const;
+
+	// Writes the JSON file; throws std::runtime_error if it cannot be opened.
+	void Save(const std::string& fileName) const;
+
+private:
+	enum class Track { Host, Device, Frame };
+
+	struct Event {
+		std::string  name;
+		Track        track;
+		std::int64_t begin;    // ns: since the start of the capture (host), device clock (device)
+		std::int64_t duration; // ns
+	};
+
+	std::int64_t SinceStart(Clock::time_point time) const;
+
+	std::vector<Event> events;
+	bool recording = false;
+	int  framesLeft = 0;
+	int  frameCount = 0;
+	Clock::time_point start;
+	Clock::time_point stop;
+
+	// Host time since the start minus device time, minimized over the recorded commands
+	bool         hasDeviceOffset = false;
+	std::int64_t deviceOffset = 0;
+};
+
+} // namespace nbody
@@ -0,0 +1,517 @@
+#include "Trajectory.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <glm/gtc/packing.hpp>
+
+namespace nbody {
+
+namespace {
+	constexpr char Magic[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+	constexpr std::uint32_t ByteOrderMark = 0x01020304u; // reads back differently on a machine of the other byte order
+
+	// On-disk header (version 1). frameCount and indexOffset are 0 until the writer is closed.
+	struct Header {
+		char          magic[8];
+		std::uint32_t version;
+		std::uint32_t byteOrder;
+		std::uint64_t numParticles;
+		std::int32_t  quantizationBits, keyframeInterval;
+		std::int32_t  gridNx, gridNy;
+		float         originX, originY; // position = origin + quantized / scale
+		float         scaleX, scaleY;
+		std::uint64_t frameCount;
+		std::uint64_t indexOffset;
+	};
+	static_assert(sizeof(Header) == 72, "The trajectory header layout must not depend on the compiler");
+
+	// Precedes the payload of every frame
+	struct FrameHeader {
+		std::uint64_t step;
+		double        time;
+		std::uint64_t payloadBytes;
+		std::uint32_t predictor; // Predictor
+		std::uint32_t numParticles;
+	};
+	static_assert(sizeof(FrameHeader) == 32, "The trajectory frame layout must not depend on the compiler");
+	static_assert(sizeof(TrajectoryIndexEntry) == 24, "The trajectory index layout must not depend on the compiler");
+
+	// Prediction of every quantized coordinate, the payload codes the differences to it
+	enum Predictor : std::uint32_t {
+		PreviousParticle = 0,    // keyframes: the same coordinate of the previous particle (0 for the first)
+		PreviousFrame = 1,       // the position in the previous frame
+		LinearExtrapolation = 2, // 2 * previous - the one before (constant velocity)
+	};
+
+	// Rice coding: blocks of RiceBlockSize values share the parameter k (RiceParameterBits bits); every value v is
+	// coded as v >> k in unary (ones closed by a zero) and the low k bits of v. Quotients of EscapeQuotient and more
+	// are coded as EscapeQuotient ones followed by the 32 bits of v.
+	constexpr int RiceBlockSize = 64;
+	constexpr int RiceParameterBits = 5;
+	constexpr int MaxRiceParameter = 30;
+	constexpr std::uint32_t EscapeQuotient = 32;
+
+	constexpr std::uint32_t LowMask(std::uint32_t bits) {
+		return bits >= 32 ? 0xFFFFFFFFu : (1u << bits) - 1;
+	}
+
+	// Maps small signed residuals to small codes: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+	std::uint32_t ZigZag(std::int32_t value) {
+		return (static_cast<std::uint32_t>(value) << 1) ^ static_cast<std::uint32_t>(value >> 31);
+	}
+
+	std::int32_t UnZigZag(std::uint32_t code) {
+		return static_cast<std::int32_t>(code >> 1) ^ -static_cast<std::int32_t>(code & 1);
+	}
+
+	// Appends bits to a byte array, least significant bit first
+	class BitWriter {
+	public:
+		explicit BitWriter(std::vector<std::uint8_t>& bytes) : bytes(bytes) {}
+
+		// Appends the low 'count' (<= 32) bits of 'value'
+		void Put(std::uint32_t value, std::uint32_t count) {
+			buffer |= static_cast<std::uint64_t>(value & LowMask(count)) << bufferBits;
+			bufferBits += count;
+			while (bufferBits >= 8) {
+				bytes.push_back(static_cast<std::uint8_t>(buffer));
+				buffer >>= 8;
+				bufferBits -= 8;
+			}
+		}
+
+		// Pads the last byte with zeros
+		void Flush() {
+			if (bufferBits > 0)
+				bytes.push_back(static_cast<std::uint8_t>(buffer));
+			buffer = 0;
+			bufferBits = 0;
+		}
+
+	private:
+		std::vector<std::uint8_t>& bytes;
+		std::uint64_t buffer = 0;
+		std::uint32_t bufferBits = 0;
+	};
+
+	// Reads the bits of BitWriter
+	class BitReader {
+	public:
+		BitReader(const unsigned char* bytes, std::uint64_t size) : bytes(bytes), size(size) {}
+
+		// Reads 'count' (<= 32) bits
+		std::uint32_t Get(std::uint32_t count) {
+			while (bufferBits < count) {
+				if (position == size)
+					throw std::runtime_error("Truncated trajectory frame");
+				buffer |= static_cast<std::uint64_t>(bytes[position++]) << bufferBits;
+				bufferBits += 8;
+			}
+			const std::uint32_t value = static_cast<std::uint32_t>(buffer) & LowMask(count);
+			buffer >>= count;
+			bufferBits -= count;
+			return value;
+		}
+
+		// Counts the ones up to the next zero (consumed) or up to 'limit' ones
+		std::uint32_t Unary(std::uint32_t limit) {
+			std::uint32_t count = 0;
+			while (count < limit && Get(1))
+				++count;
+			return count;
+		}
+
+	private:
+		const unsigned char* bytes;
+		std::uint64_t size;
+		std::uint64_t position = 0;
+		std::uint64_t buffer = 0;
+		std::uint32_t bufferBits = 0;
+	};
+
+	void RiceEncode(const std::uint32_t* values, size_t count, BitWriter& bits) {
+		for (size_t begin = 0; begin < count; begin += RiceBlockSize) {
+			const size_t end = std::min(begin + RiceBlockSize, count);
+
+			// k ~ log2 of the mean value of the block
+			std::uint64_t sum = 0;
+			for (size_t i = begin; i < end; ++i)
+				sum += values[i];
+			std::uint32_t k = 0;
+			while (k < MaxRiceParameter && (static_cast<std::uint64_t>(end - begin) << (k + 1)) <= sum)
+				++k;
+			bits.Put(k, RiceParameterBits);
+
+			for (size_t i = begin; i < end; ++i) {
+				const std::uint32_t quotient = values[i] >> k;
+				if (quotient < EscapeQuotient) {
+					bits.Put(LowMask(quotient), quotient + 1);
+					bits.Put(values[i], k);
+				}
+				else {
+					bits.Put(LowMask(EscapeQuotient), EscapeQuotient);
+					bits.Put(values[i], 32);
+				}
+			}
+		}
+	}
+
+	void RiceDecode(BitReader& bits, std::uint32_t* values, size_t count) {
+		for (size_t begin = 0; begin < count; begin += RiceBlockSize) {
+			const size_t end = std::min(begin + RiceBlockSize, count);
+			const std::uint32_t k = bits.Get(RiceParameterBits);
+			if (k > MaxRiceParameter)
+				throw std::runtime_error("Corrupt trajectory frame");
+
+			for (size_t i = begin; i < end; ++i) {
+				const std::uint32_t quotient = bits.Unary(EscapeQuotient);
+				values[i] = quotient < EscapeQuotient ? (quotient << k) | bits.Get(k) : bits.Get(32);
+			}
+		}
+	}
+}
+
+TrajectoryWriter::TrajectoryWriter(Simulation& simulation, const std::string& fileName, const TrajectoryOptions& options)
+	: simulation(simulation)
+	, fileName(fileName)
+	, numParticles(simulation.GetNumParticles())
+	, quantizationBits(options.quantizationBits)
+	, keyframeInterval(options.keyframeInterval) {
+	if (numParticles <= 0)
+		throw std::invalid_argument("A trajectory needs particles");
+	if (quantizationBits < 0 || quantizationBits > 20)
+		throw std::invalid_argument("The trajectory quantization must be in [0, 20] bits");
+	if (keyframeInterval < 1 || options.ringFrames < 1)
+		throw std::invalid_argument("The keyframe interval and the ring size of a trajectory must be positive");
+
+	// Fixed-point coordinates relative to the cells of the configured grid (see trajectory.cl)
+	const SimulationConfig& config = simulation.GetConfig();
+	const glm::vec2 cellSize((config.worldMaxX - config.worldMinX) / config.gridNx,
+	                         (config.worldMaxY - config.worldMinY) / config.gridNy);
+	origin = glm::vec2(config.worldMinX, config.worldMinY);
+	scale = glm::vec2(static_cast<float>(1 << quantizationBits)) / cellSize;
+
+	out.open(fileName, std::ios::binary);
+	if (!out)
+		throw std::runtime_error("Failed to open trajectory file: " + fileName);
+	WriteHeader(0, 0);
+	bytesWritten = sizeof(Header);
+
+	// One device buffer is enough: the in-order queue reads it before the next capture overwrites it
+	const size_t bytes = numParticles * sizeof(glm::ivec2);
+	cl::CommandQueue& queue = simulation.GetQueue();
+	clQuantized = cl::Buffer(simulation.GetContext(), CL_MEM_WRITE_ONLY, bytes);
+	ring.resize(options.ringFrames);
+	for (Slot& slot : ring) {
+		slot.pinned = cl::Buffer(simulation.GetContext(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes);
+		slot.quantized = static_cast<glm::ivec2*>(queue.enqueueMapBuffer(slot.pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes));
+	}
+
+	for (auto& frame : previous)
+		frame.resize(numParticles);
+	residuals.resize(numParticles);
+	writer = std::thread(&TrajectoryWriter::WriterLoop, this);
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+	try {
+		Close();
+	}
+	catch (const std::exception&) {
+		// Reported by an explicit Close
+	}
+}
+
+void TrajectoryWriter::Capture() {
+	if (closed)
+		throw std::runtime_error("Trajectory already closed: " + fileName);
+	if (simulation.GetNumParticles() != numParticles)
+		throw std::invalid_argument("The number of particles of a trajectory is fixed");
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (filledSlots == ring.size()) {
+			++stalls;
+			slotFree.wait(lock, [this] { return filledSlots < ring.size(); });
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// The writer thread does not touch the slot until it is counted as filled
+	Slot& slot = ring[writeSlot];
+	slot.step = simulation.GetStepCount();
+	slot.time = simulation.GetSimulatedTime();
+	cl::CommandQueue& queue = simulation.GetQueue();
+	simulation.EnqueueQuantizePositions(clQuantized, origin, scale);
+	queue.enqueueReadBuffer(clQuantized, CL_FALSE, 0, numParticles * sizeof(glm::ivec2), slot.quantized, nullptr, &slot.ready);
+	queue.flush();
+	writeSlot = (writeSlot + 1) % ring.size();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		++filledSlots;
+	}
+	frameReady.notify_one();
+}
+
+void TrajectoryWriter::Close() {
+	if (closed)
+		return;
+	closed = true;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	frameReady.notify_one();
+	writer.join();
+
+	cl::CommandQueue& queue = simulation.GetQueue();
+	for (Slot& slot : ring)
+		queue.enqueueUnmapMemObject(slot.pinned, slot.quantized);
+	queue.finish();
+
+	if (!error) {
+		try {
+			const std::uint64_t indexOffset = bytesWritten;
+			out.write(reinterpret_cast<const char*>(frameIndex.data()), static_cast<std::streamsize>(frameIndex.size() * sizeof(TrajectoryIndexEntry)));
+			bytesWritten += frameIndex.size() * sizeof(TrajectoryIndexEntry);
+			out.seekp(0);
+			WriteHeader(frameIndex.size(), indexOffset);
+			if (!out.flush())
+				throw std::runtime_error("Failed to write trajectory: " + fileName);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+	}
+	out.close();
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void TrajectoryWriter::WriteHeader(std::uint64_t frameCount, std::uint64_t indexOffset) {
+	const SimulationConfig& config = simulation.GetConfig();
+	Header header{};
+	std::memcpy(header.magic, Magic, sizeof(Magic));
+	header.version = TrajectoryVersion;
+	header.byteOrder = ByteOrderMark;
+	header.numParticles = static_cast<std::uint64_t>(numParticles);
+	header.quantizationBits = quantizationBits;
+	header.keyframeInterval = keyframeInterval;
+	header.gridNx = config.gridNx;
+	header.gridNy = config.gridNy;
+	header.originX = origin.x;
+	header.originY = origin.y;
+	header.scaleX = scale.x;
+	header.scaleY = scale.y;
+	header.frameCount = frameCount;
+	header.indexOffset = indexOffset;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+}
+
+void TrajectoryWriter::WriterLoop() {
+	bool failed = false;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frameReady.wait(lock, [this] { return stopping || filledSlots > 0; });
+			if (filledSlots == 0)
+				return;
+		}
+
+		// After an error the frames are still drained (their reads target the ring), but no longer written
+		const Slot& slot = ring[readSlot];
+		try {
+			slot.ready.wait();
+			if (!failed)
+				WriteFrame(slot);
+		}
+		catch (...) {
+			failed = true;
+			std::lock_guard<std::mutex> lock(mutex);
+			error = std::current_exception();
+		}
+		readSlot = (readSlot + 1) % ring.size();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--filledSlots;
+		}
+		slotFree.notify_one();
+	}
+}
+
+void TrajectoryWriter::WriteFrame(const Slot& slot) {
+	const std::uint64_t frame = frameIndex.size();
+	const std::uint64_t sinceKeyframe = frame % static_cast<std::uint64_t>(keyframeInterval);
+	const Predictor predictor = sinceKeyframe == 0 ? PreviousParticle : sinceKeyframe == 1 ? PreviousFrame : LinearExtrapolation;
+
+	// Differences of the quantized coordinates stay within 32 bits (they are clamped to 2^28, see trajectory.cl)
+	payload.clear();
+	BitWriter bits(payload);
+	const glm::ivec2* quantized = slot.quantized;
+	for (int axis = 0; axis < 2; ++axis) {
+		for (int i = 0; i < numParticles; ++i) {
+			std::int32_t prediction = 0;
+			if (predictor == PreviousParticle)
+				prediction = i > 0 ? quantized[i - 1][axis] : 0;
+			else if (predictor == PreviousFrame)
+				prediction = previous[0][i][axis];
+			else
+				prediction = 2 * previous[0][i][axis] - previous[1][i][axis];
+			residuals[i] = ZigZag(quantized[i][axis] - prediction);
+		}
+		RiceEncode(residuals.data(), residuals.size(), bits);
+	}
+	bits.Flush();
+
+	previous[1].swap(previous[0]);
+	std::copy(quantized, quantized + numParticles, previous[0].begin());
+
+	FrameHeader header{};
+	header.step = slot.step;
+	header.time = slot.time;
+	header.payloadBytes = payload.size();
+	header.predictor = predictor;
+	header.numParticles = static_cast<std::uint32_t>(numParticles);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(FrameHeader));
+	out.write(reinterpret_cast<const char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+	if (!out)
+		throw std::runtime_error("Failed to write trajectory: " + fileName);
+
+	frameIndex.push_back({ bytesWritten, slot.step, slot.time });
+	bytesWritten += sizeof(FrameHeader) + payload.size();
+}
+
+TrajectoryFile::TrajectoryFile(const std::string& fileName)
+	: file(fileName, "trajectory", false) {
+	const unsigned char* data = file.GetData();
+	const std::uint64_t size = file.GetSize();
+	try {
+		if (size < sizeof(Header))
+			throw std::runtime_error("Truncated trajectory");
+		Header header;
+		std::memcpy(&header, data, sizeof(Header));
+		if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0)
+			throw std::runtime_error("Not a trajectory file");
+		if (header.byteOrder != ByteOrderMark)
+			throw std::runtime_error("Trajectory written on a machine of the other byte order");
+		if (header.version != TrajectoryVersion)
+			throw std::runtime_error("Unsupported trajectory version " + std::to_string(header.version));
+		if (header.numParticles == 0 || header.numParticles > static_cast<std::uint64_t>(std::numeric_limits<int>::max())
+		    || header.keyframeInterval < 1 || !(header.scaleX > 0.0f) || !(header.scaleY > 0.0f))
+			throw std::runtime_error("Corrupt trajectory header");
+
+		numParticles = static_cast<int>(header.numParticles);
+		keyframeInterval = header.keyframeInterval;
+		origin = glm::vec2(header.originX, header.originY);
+		scale = glm::vec2(header.scaleX, header.scaleY);
+
+		complete = header.indexOffset != 0;
+		if (complete) {
+			if (header.indexOffset > size || (size - header.indexOffset) / sizeof(TrajectoryIndexEntry) < header.frameCount)
+				throw std::runtime_error("Truncated trajectory index");
+			frames.resize(header.frameCount);
+			std::memcpy(frames.data(), data + header.indexOffset, frames.size() * sizeof(TrajectoryIndexEntry));
+		}
+		else {
+			// Not closed: index the frames written completely
+			std::uint64_t offset = sizeof(Header);
+			while (size - offset >= sizeof(FrameHeader)) {
+				FrameHeader frame;
+				std::memcpy(&frame, data + offset, sizeof(FrameHeader));
+				if (frame.numParticles != header.numParticles || frame.payloadBytes > size - offset - sizeof(FrameHeader))
+					break;
+				frames.push_back({ offset, frame.step, frame.time });
+				offset += sizeof(FrameHeader) + frame.payloadBytes;
+			}
+		}
+		if (frames.empty())
+			throw std::runtime_error("Trajectory without frames");
+
+		for (auto& frame : history)
+			frame.resize(numParticles);
+		decoded.resize(numParticles);
+		residuals.resize(numParticles);
+		Seek(0);
+	}
+	catch (const std::runtime_error& e) {
+		throw std::runtime_error(fileName + ": " + e.what());
+	}
+}
+
+void TrajectoryFile::Seek(std::uint64_t frame) {
+	if (frame >= frames.size())
+		throw std::out_of_range("Trajectory frame out of range");
+
+	// From the keyframe of the frame before, which is decoded too (it gives the speeds); forward from the current frame
+	const std::uint64_t interval = static_cast<std::uint64_t>(keyframeInterval);
+	const std::uint64_t first = frame > 0 ? (frame - 1) / interval * interval : 0;
+	std::uint64_t next = first;
+	if (decodedFrames > 0 && currentFrame >= first && currentFrame <= frame)
+		next = currentFrame + 1;
+	else
+		decodedFrames = 0;
+
+	for (; next <= frame; ++next)
+		DecodeFrame(next);
+}
+
+void TrajectoryFile::DecodeFrame(std::uint64_t frame) {
+	const std::uint64_t offset = frames[frame].offset;
+	if (offset > file.GetSize() || file.GetSize() - offset < sizeof(FrameHeader))
+		throw std::runtime_error("Truncated trajectory");
+	FrameHeader header;
+	std::memcpy(&header, file.GetData() + offset, sizeof(FrameHeader));
+	if (header.numParticles != static_cast<std::uint32_t>(numParticles)
+	    || header.payloadBytes > file.GetSize() - offset - sizeof(FrameHeader)
+	    || header.predictor > LinearExtrapolation || decodedFrames < static_cast<int>(header.predictor))
+		throw std::runtime_error("Corrupt trajectory frame");
+
+	// Inverse of TrajectoryWriter::WriteFrame
+	BitReader bits(file.GetData() + offset + sizeof(FrameHeader), header.payloadBytes);
+	for (int axis = 0; axis < 2; ++axis) {
+		RiceDecode(bits, residuals.data(), residuals.size());
+		for (int i = 0; i < numParticles; ++i) {
+			std::int32_t prediction = 0;
+			if (header.predictor == PreviousParticle)
+				prediction = i > 0 ? decoded[i - 1][axis] : 0;
+			else if (header.predictor == PreviousFrame)
+				prediction = history[0][i][axis];
+			else
+				prediction = 2 * history[0][i][axis] - history[1][i][axis];
+			decoded[i][axis] = prediction + UnZigZag(residuals[i]);
+		}
+	}
+
+	// decoded -> history[0] -> history[1] -> decoded (scratch)
+	history[1].swap(history[0]);
+	history[0].swap(decoded);
+	currentFrame = frame;
+	decodedFrames = std::min(decodedFrames + 1, 2);
+}
+
+void TrajectoryFile::PackRenderVertices(void* vertices, float maxSpeed) const {
+	const glm::ivec2* current = history[0].data();
+	const glm::ivec2* previous = decodedFrames >= 2 ? history[1].data() : current;
+	const double dt = decodedFrames >= 2 ? frames[currentFrame].time - frames[currentFrame - 1].time : 0.0;
+
+	// speed / maxSpeed of a displacement of one quantization step per axis
+	const glm::vec2 speedScale = dt > 0.0 ? 1.0f / (scale * static_cast<float>(dt) * maxSpeed) : glm::vec2(0.0f);
+
+	// Written in order (the target may be write-combined memory, e.g. a mapped vertex buffer)
+	unsigned char* vertex = static_cast<unsigned char*>(vertices);
+	for (int i = 0; i < numParticles; ++i, vertex += RenderVertexSize) {
+		const std::uint32_t position = glm::packHalf2x16(origin + glm::vec2(current[i]) / scale);
+		const float speed = std::min(glm::length(glm::vec2(current[i] - previous[i]) * speedScale), 1.0f);
+		std::memcpy(vertex, &position, sizeof(position));
+		vertex[4] = static_cast<unsigned char>(speed * 255.0f + 0.5f);
+	}
+}
+
+} // namespace nbody
@@ -0,0 +1,171 @@
+#pragma once
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MappedFile.h"
+#include "Simulation.h"
+
+namespace nbody {
+
+// Version of the trajectory format written by TrajectoryWriter; TrajectoryFile reads exactly this version
+constexpr std::uint32_t TrajectoryVersion = 1;
+
+// Entry of the frame index at the end of a trajectory file (on-disk layout)
+struct TrajectoryIndexEntry {
+	std::uint64_t offset; // of the frame header
+	std::uint64_t step;
+	double        time;
+};
+
+struct TrajectoryOptions {
+	// Resolution of the positions: cell size / 2^bits (cells of the configured grid and world). Positions farther
+	// than 2^(28 - bits) cells from the world minimum are clamped.
+	int quantizationBits = 12;
+
+	// Frames between keyframes, the frames a reader can start decoding at
+	int keyframeInterval = 64;
+
+	// Frames in flight between the device and the writer thread (pinned host buffers)
+	int ringFrames = 4;
+};
+
+/**
+ * Streams particle positions into a compressed trajectory file.
+ *
+ * Capture enqueues the quantization of the positions (see trajectory.cl) and a non-blocking read into the
+ * next pinned host buffer of a bounded ring; a writer thread waits for the read, codes the frame and
+ * appends it to the file. Capture blocks only when every buffer of the ring is still in flight.
+ *
+ * Coding: every coordinate is predicted from the previous particle (keyframes), the previous frame (the
+ * first frame after a keyframe) or extrapolated from the previous two frames (the others), and the
+ * residuals are Rice coded in blocks with a per-block parameter.
+ *
+ * Layout (little endian): a fixed header (particle count, quantization, frame count, index offset),
+ * the frames (a frame header with step, time, predictor and payload size, followed by the payload)
+ * and an index with the offset, step and time of every frame. Close writes the index and completes
+ * the header; a file without them still holds every frame written so far.
+ */
+class TrajectoryWriter {
+public:
+	// The number of particles of 'simulation' is fixed for the whole file
+	TrajectoryWriter(Simulation& simulation, const std::string& fileName, const TrajectoryOptions& options = {});
+	~TrajectoryWriter();
+
+	TrajectoryWriter(const TrajectoryWriter&) = delete;
+	TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+	// Starts a frame of the current state. Rethrows the error of the writer thread, if any.
+	void Capture();
+
+	// Writes the pending frames and the index. Rethrows the error of the writer thread, if any.
+	void Close();
+
+	// Statistics, complete after Close
+	std::uint64_t GetFrameCount() const { return frameIndex.size(); }
+	std::uint64_t GetBytesWritten() const { return bytesWritten; }
+	int           GetStalls() const { return stalls; } // captures that waited for a free ring buffer
+
+private:
+	// Ring buffer entry: pinned host memory, mapped for the lifetime of the writer
+	struct Slot {
+		cl::Buffer    pinned;
+		glm::ivec2*   quantized = nullptr;
+		cl::Event     ready;
+		std::uint64_t step = 0;
+		double        time = 0.0;
+	};
+
+	void WriteHeader(std::uint64_t frameCount, std::uint64_t indexOffset);
+	void WriterLoop();
+	void WriteFrame(const Slot& slot);
+
+	Simulation& simulation;
+	std::string fileName;
+	int         numParticles = 0;
+	int         quantizationBits = 0;
+	int         keyframeInterval = 0;
+	glm::vec2   origin{ 0.0f };
+	glm::vec2   scale{ 1.0f };
+	bool        closed = false;
+
+	cl::Buffer        clQuantized;
+	std::vector<Slot> ring;
+	size_t            writeSlot = 0; // next slot of Capture
+	size_t            readSlot = 0;  // next slot of the writer thread
+	size_t            filledSlots = 0;
+	int               stalls = 0;
+
+	std::mutex              mutex;
+	std::condition_variable frameReady;
+	std::condition_variable slotFree;
+	bool                    stopping = false;
+	std::exception_ptr      error;
+	std::thread             writer;
+
+	// Writer thread state: file, the quantized positions of the last two frames (predictors) and the index
+	std::ofstream                     out;
+	std::vector<glm::ivec2>           previous[2];
+	std::vector<std::uint32_t>        residuals;
+	std::vector<std::uint8_t>         payload;
+	std::vector<TrajectoryIndexEntry> frameIndex;
+	std::uint64_t                     bytesWritten = 0;
+};
+
+/**
+ * Memory-mapped trajectory file (read only) with random access to its frames.
+ *
+ * The frame index gives the offset of every frame at once; a file that was not closed (e.g. one still
+ * being written) is indexed by walking its frame headers when it is opened. A frame is decoded from
+ * the previous keyframe on, so Seek decodes at most keyframeInterval + 1 frames, and only the next
+ * one when playing forward.
+ *
+ * Throws std::runtime_error if the file cannot be mapped or is not a trajectory of this version.
+ */
+class TrajectoryFile {
+public:
+	explicit TrajectoryFile(const std::string& fileName);
+
+	int           GetNumParticles() const { return numParticles; }
+	std::uint64_t GetFrameCount() const { return frames.size(); }
+	std::uint64_t GetFrameStep(std::uint64_t frame) const { return frames[frame].step; }
+	double        GetFrameTime(std::uint64_t frame) const { return frames[frame].time; }
+	bool          IsComplete() const { return complete; } // closed by its writer
+
+	// Decodes 'frame' (< GetFrameCount) and the frame before it
+	void          Seek(std::uint64_t frame);
+	std::uint64_t GetFrame() const { return currentFrame; }
+
+	// Packs the current frame into a render buffer of RenderVertexSize bytes per particle, the layout of
+	// Simulation::EnqueuePackRenderVertices. The speeds are the displacements since the previous frame over its time.
+	void PackRenderVertices(void* vertices, float maxSpeed = 4.0f) const;
+
+private:
+	void DecodeFrame(std::uint64_t frame);
+
+	MappedFile file;
+	int        numParticles = 0;
+	int        keyframeInterval = 1;
+	glm::vec2  origin{ 0.0f };
+	glm::vec2  scale{ 1.0f };
+	bool       complete = false;
+	std::vector<TrajectoryIndexEntry> frames;
+
+	// Quantized positions of currentFrame (history[0]) and of the frame before it (history[1], if decodedFrames >= 2)
+	std::vector<glm::ivec2>    history[2];
+	std::vector<glm::ivec2>    decoded;
+	std::vector<std::uint32_t> residuals;
+	std::uint64_t              currentFrame = 0;
+	int                        decodedFrames = 0; // consecutive frames decoded up to currentFrame
+};
+
+} // namespace nbody
@@ -0,0 +1,443 @@
+/**
+ * Barnes-Hut solver on a linear quadtree.
+ *
+ * Pipeline (one step):
+ *   1. computeMortonCodes       - 32-bit Morton code (16 bits per axis) of every particle.
+ *   2. bitonicSortLocal/Global  - sort (code, particle id) pairs.
+ *   3. gatherSortedParticles    - Morton-ordered copy of position + mass.
+ *   4. buildRadixTree           - binary radix tree over the sorted codes (Karras 2012, LBVH style):
+ *                                 every internal node is built independently.
+ *   5. computeTreeNodes         - bottom-up mass, center of mass and bounding box of every node.
+ *   6. updateBarnesHut          - per particle tree walk with the opening angle theta + integration.
+ *
+ * Node numbering: internal nodes are 0 .. numLeaves-2 (0 is the root), leaf j is node numLeaves-1+j.
+ * With a single particle node 0 is the only leaf, so the walk always starts at node 0.
+ */
+
+#ifndef BH_STACK_SIZE
+#define BH_STACK_SIZE 64
+#endif
+
+/**
+ * Spreads the lower 16 bits of v so that there is a zero bit between each of them.
+ */
+inline uint expandBits16(uint v)
+{
+    v &= 0x0000FFFFu;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+/**
+ * Computes the Morton code of each particle inside the world rectangle.
+ * Padding entries (numParticles <= id < paddedCount) get the largest code so they sort to the end.
+ *
+ * @param positions         (in)         Global buffer of particle positions.
+ * @param mortonKeys        (out)        Morton code of each (padded) entry.
+ * @param mortonValues      (out)        Particle id of each (padded) entry.
+ * @param numParticles      (in)         Number of particles.
+ * @param paddedCount       (in)         Power of two size of the sort.
+ * @param gridGeometry      (in)         World minimum and inverse world size (see bounds.cl).
+ */
+__kernel void computeMortonCodes(
+    __global const float2* positions,
+    __global uint* mortonKeys,
+    __global int* mortonValues,
+    const int numParticles,
+    const int paddedCount,
+    __global const float4* gridGeometry)
+{
+    int id = get_global_id(0);
+    if (id >= paddedCount) return;
+
+    mortonValues[id] = id;
+    if (id >= numParticles) {
+        mortonKeys[id] = 0xFFFFFFFFu;
+        return;
+    }
+
+    float2 position     = positions[id];
+    float2 worldMin     = gridGeometry[0].xy;
+    float2 worldSizeInv = gridGeometry[1].zw;
+
+    // Normalized position, clamped into the world rectangle
+    float x = clamp((position.x - worldMin.x) * worldSizeInv.x, 0.0f, 1.0f);
+    float y = clamp((position.y - worldMin.y) * worldSizeInv.y, 0.0f, 1.0f);
+
+    uint ix = (uint)(x * 65535.0f);
+    uint iy = (uint)(y * 65535.0f);
+
+    mortonKeys[id] = (expandBits16(iy) << 1) | expandBits16(ix);
+}
+
+/**
+ * Compare-and-swap of two (key, value) pairs in bitonic order.
+ * Ties on the key are broken by the value, so the result is deterministic.
+ */
+inline void bitonicCompareSwap(uint* keyA, int* valueA, uint* keyB, int* valueB, bool ascending)
+{
+    bool greater = (*keyA > *keyB) || (*keyA == *keyB && *valueA > *valueB);
+    if (greater == ascending) {
+        uint key = *keyA;  *keyA = *keyB;  *keyB = key;
+        int value = *valueA; *valueA = *valueB; *valueB = value;
+    }
+}
+
+/**
+ * Bitonic sort steps that fit into a work-group: every group owns 2 * localSize consecutive
+ * entries and performs all (k, j) steps with kFirst <= k <= kLast and j < 2 * localSize.
+ *
+ *   - kFirst = 2, kLast = 2 * localSize: sorts every block (alternating direction as required by bitonic sort).
+ *   - kFirst = kLast = k > 2 * localSize: finishes the merge of stage k after the global steps with large j.
+ *
+ * @param keys              (in/out)     Sort keys.
+ * @param values            (in/out)     Values moved together with the keys.
+ * @param kFirst            (in)         First bitonic stage (power of two).
+ * @param kLast             (in)         Last bitonic stage (power of two).
+ * @param localKeys         (local)      2 * localSize keys.
+ * @param localValues       (local)      2 * localSize values.
+ */
+__kernel void bitonicSortLocal(
+    __global uint* keys,
+    __global int* values,
+    const int kFirst,
+    const int kLast,
+    __local uint* localKeys,
+    __local int* localValues)
+{
+    int lid       = get_local_id(0);
+    int lsize     = get_local_size(0);
+    int blockSize = 2 * lsize;
+    int base      = get_group_id(0) * blockSize;
+
+    localKeys[lid]           = keys[base + lid];
+    localValues[lid]         = values[base + lid];
+    localKeys[lid + lsize]   = keys[base + lid + lsize];
+    localValues[lid + lsize] = values[base + lid + lsize];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = kFirst; k <= kLast; k <<= 1) {
+        for (int j = min(k, blockSize) >> 1; j > 0; j >>= 1) {
+            // Index of the lower element of the pair handled by this work-item
+            int i = 2 * j * (lid / j) + (lid % j);
+            bool ascending = ((base + i) & k) == 0;
+
+            uint keyA = localKeys[i],   keyB = localKeys[i + j];
+            int valueA = localValues[i], valueB = localValues[i + j];
+            bitonicCompareSwap(&keyA, &valueA, &keyB, &valueB, ascending);
+            localKeys[i]       = keyA;
+            localKeys[i + j]   = keyB;
+            localValues[i]     = valueA;
+            localValues[i + j] = valueB;
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+
+    keys[base + lid]           = localKeys[lid];
+    values[base + lid]         = localValues[lid];
+    keys[base + lid + lsize]   = localKeys[lid + lsize];
+    values[base + lid + lsize] = localValues[lid + lsize];
+}
+
+/**
+ * One global bitonic step (k, j) for the strides that do not fit into a work-group.
+ * One work-item per entry; the lower element of each pair does the compare-and-swap.
+ *
+ * @param keys              (in/out)     Sort keys.
+ * @param values            (in/out)     Values moved together with the keys.
+ * @param j                 (in)         Compare distance.
+ * @param k                 (in)         Bitonic stage.
+ */
+__kernel void bitonicSortGlobal(
+    __global uint* keys,
+    __global int* values,
+    const int j,
+    const int k)
+{
+    int i = get_global_id(0);
+    int partner = i ^ j;
+    if (partner <= i) return;
+
+    uint keyA = keys[i],   keyB = keys[partner];
+    int valueA = values[i], valueB = values[partner];
+    bitonicCompareSwap(&keyA, &valueA, &keyB, &valueB, (i & k) == 0);
+    keys[i]         = keyA;
+    keys[partner]   = keyB;
+    values[i]       = valueA;
+    values[partner] = valueB;
+}
+
+/**
+ * Writes the Morton-ordered copy of the particles.
+ *
+ * @param positions         (in)         Global buffer of particle positions.
+ * @param masses            (in)         Global buffer of particle masses.
+ * @param mortonValues      (in)         Sorted particle ids.
+ * @param sortedIndex       (out)        Particle id stored at each sorted slot.
+ * @param sortedPosMass     (out)        Morton-ordered particles: x,y = position; z = mass.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void gatherSortedParticles(
+    __global const float2* positions,
+    __global const float* masses,
+    __global const int* mortonValues,
+    __global int* sortedIndex,
+    __global float4* sortedPosMass,
+    const int numParticles)
+{
+    int slot = get_global_id(0);
+    if (slot >= numParticles) return;
+
+    int pid = mortonValues[slot];
+    float2 position = positions[pid];
+    sortedIndex[slot]   = pid;
+    sortedPosMass[slot] = (float4)(position.x, position.y, PARTICLE_MASS(masses, pid), 0.0f);
+}
+
+/**
+ * Length of the common prefix of the keys of leaves i and j, -1 if j is out of range.
+ * Equal keys are made unique by comparing the leaf indices as well.
+ */
+inline int commonPrefix(__global const uint* keys, int numLeaves, int i, int j)
+{
+    if (j < 0 || j >= numLeaves)
+        return -1;
+
+    uint keyI = keys[i];
+    uint keyJ = keys[j];
+    if (keyI == keyJ)
+        return 32 + (int)clz((uint)(i ^ j));
+
+    return (int)clz(keyI ^ keyJ);
+}
+
+/**
+ * Builds the internal nodes of the binary radix tree, one work-item per internal node.
+ * Node i covers a contiguous range of sorted leaves that starts or ends at leaf i; the
+ * range and its split position are found by binary searches on the common prefix lengths.
+ *
+ * @param keys              (in)         Sorted Morton codes.
+ * @param nodeChildren      (out)        Left/right child of each internal node.
+ * @param nodeParent        (out)        Parent of each node (internal and leaf), -1 for the root.
+ * @param numLeaves         (in)         Number of particles.
+ */
+__kernel void buildRadixTree(
+    __global const uint* keys,
+    __global int2* nodeChildren,
+    __global int* nodeParent,
+    const int numLeaves)
+{
+    int i = get_global_id(0);
+    int numInternal = numLeaves - 1;
+    if (i >= numInternal) return;
+
+    // Direction of the range (+1: leaves i.., -1: leaves ..i)
+    int d = (commonPrefix(keys, numLeaves, i, i + 1) - commonPrefix(keys, numLeaves, i, i - 1)) >= 0 ? 1 : -1;
+
+    // Upper bound of the range length
+    int deltaMin = commonPrefix(keys, numLeaves, i, i - d);
+    int lMax = 2;
+    while (commonPrefix(keys, numLeaves, i, i + lMax * d) > deltaMin)
+        lMax <<= 1;
+
+    // Exact range length
+    int l = 0;
+    for (int t = lMax >> 1; t >= 1; t >>= 1) {
+        if (commonPrefix(keys, numLeaves, i, i + (l + t) * d) > deltaMin)
+            l += t;
+    }
+    int j = i + l * d;
+
+    // Split position: the last leaf sharing more than deltaNode bits with leaf i
+    int deltaNode = commonPrefix(keys, numLeaves, i, j);
+    int split = 0;
+    int step  = l;
+    do {
+        step = (step + 1) >> 1;
+        int newSplit = split + step;
+        if (newSplit < l && commonPrefix(keys, numLeaves, i, i + newSplit * d) > deltaNode)
+            split = newSplit;
+    } while (step > 1);
+    int gamma = i + split * d + min(d, 0);
+
+    int left  = (min(i, j) == gamma)     ? numInternal + gamma     : gamma;
+    int right = (max(i, j) == gamma + 1) ? numInternal + gamma + 1 : gamma + 1;
+
+    nodeChildren[i]   = (int2)(left, right);
+    nodeParent[left]  = i;
+    nodeParent[right] = i;
+    if (i == 0)
+        nodeParent[0] = -1;
+}
+
+/**
+ * Computes mass, center of mass and bounding box of every tree node bottom-up.
+ * Each leaf walks towards the root; the first child arriving at a node stops there,
+ * the second one (which sees both children finished) computes the node and continues.
+ *
+ * @param sortedPosMass     (in)         Morton-ordered particles: x,y = position; z = mass.
+ * @param nodeChildren      (in)         Left/right child of each internal node.
+ * @param nodeParent        (in)         Parent of each node, -1 for the root.
+ * @param nodeVisits        (in/out)     Arrival counter of each internal node (zeroed by the host).
+ * @param nodeMassCOM       (out)        x,y = center of mass; z = total mass.
+ * @param nodeBounds        (out)        Bounding box of each node: (minX, minY, maxX, maxY).
+ * @param numLeaves         (in)         Number of particles.
+ */
+__kernel void computeTreeNodes(
+    __global const float4* sortedPosMass,
+    __global const int2* nodeChildren,
+    __global const int* nodeParent,
+    __global int* nodeVisits,
+    volatile __global float4* nodeMassCOM,
+    volatile __global float4* nodeBounds,
+    const int numLeaves)
+{
+    int leaf = get_global_id(0);
+    if (leaf >= numLeaves) return;
+
+    int numInternal = numLeaves - 1;
+    int node = numInternal + leaf;
+
+    float4 particle = sortedPosMass[leaf];
+    nodeMassCOM[node] = (float4)(particle.x, particle.y, particle.z, 0.0f);
+    nodeBounds[node]  = (float4)(particle.x, particle.y, particle.x, particle.y);
+
+    // Make the node visible before announcing it to the parent
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+    int parent = nodeParent[node];
+    while (parent >= 0) {
+        // The first child to arrive leaves the rest of the path to its sibling.
+        if (atomic_inc(&nodeVisits[parent]) == 0)
+            return;
+
+        int2 children = nodeChildren[parent];
+        float4 a = nodeMassCOM[children.x];
+        float4 b = nodeMassCOM[children.y];
+
+        float mass = a.z + b.z;
+        float2 com = (mass > 0.0f)
+            ? ((float2)(a.x, a.y) * a.z + (float2)(b.x, b.y) * b.z) / mass
+            : 0.5f * ((float2)(a.x, a.y) + (float2)(b.x, b.y));
+        nodeMassCOM[parent] = (float4)(com.x, com.y, mass, 0.0f);
+
+        float4 boundsA = nodeBounds[children.x];
+        float4 boundsB = nodeBounds[children.y];
+        nodeBounds[parent] = (float4)(fmin(boundsA.x, boundsB.x), fmin(boundsA.y, boundsB.y),
+                                      fmax(boundsA.z, boundsB.z), fmax(boundsA.w, boundsB.w));
+
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        parent = nodeParent[parent];
+    }
+}
+
+/**
+ * Updates particle positions and velocities with the Barnes-Hut approximation.
+ *
+ * For each particle (in Morton order, so a work-group walks similar paths):
+ *   - walk the tree from the root with an explicit stack,
+ *   - a node whose size / distance < theta is treated as a single mass at its center of mass,
+ *   - leaves are handled exactly, other nodes are opened,
+ *   - integrate the total acceleration to update velocity and position.
+ *
+ * @param positions         (in/out)     Global buffer of particle positions.
+ * @param velocities        (in/out)     Global buffer of particle velocities.
+ * @param sortedIndex       (in)         Particle id stored at each sorted slot.
+ * @param nodeChildren      (in)         Left/right child of each internal node.
+ * @param nodeMassCOM       (in)         x,y = center of mass; z = total mass.
+ * @param nodeBounds        (in)         Bounding box of each node: (minX, minY, maxX, maxY).
+ * @param numParticles      (in)         Number of particles.
+ * @param thetaSquared      (in)         Square of the opening angle.
+ * @param G                 (in)         A physically-motivated gravitational constant. (float)
+ * @param kickTime          (in)         Time the acceleration is applied to the velocity for.
+ * @param driftTime         (in)         Time the new velocity is applied to the position for.
+ * @param blockSteps        (in)         Non-zero for block timesteps: only the active particles are evaluated and their
+ *                                       acceleration is stored instead of integrated (see timestep.cl).
+ * @param activeParticles   (in)         Block timesteps: ids of the active particles (compactActiveParticles).
+ * @param activeCount       (in)         Block timesteps: number of active particles.
+ * @param accelerations     (out)        Block timesteps: acceleration of each active particle.
+ */
+__kernel void updateBarnesHut(
+    __global float2* positions,
+    __global float2* velocities,
+    __global const int* sortedIndex,
+    __global const int2* nodeChildren,
+    __global const float4* nodeMassCOM,
+    __global const float4* nodeBounds,
+    const int numParticles,
+    const float thetaSquared,
+    const float G,
+    const float kickTime,
+    const float driftTime,
+    const int blockSteps,
+    __global const int* activeParticles,
+    __global const int* activeCount,
+    __global float2* accelerations)
+{
+    // A small factor to prevent forces from becoming infinite during close encounters, improving stability.
+    const float softening = SOFTENING;
+
+    int slot = get_global_id(0);
+    if (slot >= (blockSteps ? activeCount[0] : numParticles)) return;
+    int particleId = blockSteps ? activeParticles[slot] : sortedIndex[slot];
+
+    // Load particle state: position and velocity.
+    float2 position  = positions[particleId];
+    float2 velocity  = velocities[particleId];
+
+    int numInternal = numParticles - 1;
+
+    // Start with zero acceleration.
+    float2 totalAcceleration = (float2)(0.0f, 0.0f);
+
+    int stack[BH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+        int node = stack[--top];
+
+        float4 massCOM  = nodeMassCOM[node];
+        float2 direction = (float2)(massCOM.x, massCOM.y) - position;
+        float distanceSquared = direction.x * direction.x + direction.y * direction.y;
+
+        bool accept = node >= numInternal; // leaves are always exact
+        if (!accept) {
+            float4 bounds = nodeBounds[node];
+            float size = fmax(bounds.z - bounds.x, bounds.w - bounds.y);
+
+            // Opening criterion: size / distance < theta. Nodes that do not fit
+            // on the stack are accepted as well (never happens for depth < BH_STACK_SIZE).
+            accept = (size * size < thetaSquared * distanceSquared) || (top + 2 > BH_STACK_SIZE);
+            if (!accept) {
+                int2 children = nodeChildren[node];
+                stack[top++] = children.x;
+                stack[top++] = children.y;
+                continue;
+            }
+        }
+
+        // The particle's own leaf adds nothing: its direction is zero and the softening keeps the distance non-zero.
+        float invDistance      = 1.0f / sqrt(distanceSquared + softening);
+        float invDistanceCubed = invDistance * invDistance * invDistance;
+        totalAcceleration += direction * (G * massCOM.z * invDistanceCubed);
+    }
+
+    // Block timesteps: kicked per rung and drifted by the kernels of timestep.cl.
+    if (blockSteps) {
+        accelerations[particleId] = totalAcceleration;
+        return;
+    }
+
+    // Integrate motion: kick the velocity, then drift the position (see Simulation::Step for the integrators).
+    float2 newVelocity = velocity + totalAcceleration * kickTime;
+    float2 newPosition = position + newVelocity * driftTime;
+
+    // Store updated state back to global buffer.
+    positions[particleId]  = newPosition;
+    velocities[particleId] = newVelocity;
+}
@@ -0,0 +1,112 @@
+/**
+ * Dynamic world bounds.
+ *
+ * The cell grid, the FMM cell centers and the Morton codes read the world from the gridGeometry
+ * buffer (two float4):
+ *   [0]: x,y = world minimum;     z,w = level 0 cell size,
+ *   [1]: x,y = 1 / cell size;     z,w = 1 / world size (the extent of the grid).
+ * It holds the configured world unless the host refits it to the particles, which takes two
+ * launches and never reads anything back:
+ *   1. reduceBounds    - a few work-groups, each reducing a strided share of the particles
+ *                        to one bounding box (as hybrid_reduce of krn_reduce_local.cl).
+ *   2. finalizeBounds  - one work-group reducing the partial boxes and deriving the geometry.
+ */
+
+/**
+ * Bounding box of the particles, one partial box per work-group.
+ *
+ * @param positions         (in)         Global buffer of particle positions.
+ * @param partialBounds     (out)        Per work-group: x,y = minimum; z,w = maximum.
+ * @param scratch           (local)      One float4 per work-item.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void reduceBounds(
+    __global const float2* positions,
+    __global float4* partialBounds,
+    __local float4* scratch,
+    const int numParticles)
+{
+    int lid   = get_local_id(0);
+    int lsize = WORK_GROUP_SIZE;
+
+    // 1. Each work-item reduces its strided share of the particles
+    float4 box = (float4)(INFINITY, INFINITY, -INFINITY, -INFINITY);
+    for (int pid = get_global_id(0); pid < numParticles; pid += get_global_size(0)) {
+        float2 position = positions[pid];
+        box = (float4)(fmin(box.xy, position), fmax(box.zw, position));
+    }
+
+    // 2. Tree reduction in local memory
+    scratch[lid] = box;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = lsize >> 1; offset; offset >>= 1) {
+        if (lid < offset) {
+            float4 other = scratch[lid + offset];
+            scratch[lid] = (float4)(fmin(scratch[lid].xy, other.xy), fmax(scratch[lid].zw, other.zw));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // 3. One box per work-group
+    if (lid == 0)
+        partialBounds[get_group_id(0)] = scratch[0];
+}
+
+/**
+ * Merges the partial boxes (single work-group launch) and fits the grid to the result.
+ *
+ * The cells stay square, so the near field exclusion in cells is the same distance along both
+ * axes: the cell size is the larger one of the two axes and the grid is centered on the box.
+ * The margin keeps the extreme particles off the clamped border cells.
+ *
+ * @param partialBounds     (in)         Partial boxes of reduceBounds.
+ * @param numPartials       (in)         Number of partial boxes.
+ * @param gridGeometry      (out)        Fitted world (see the top of this file).
+ * @param scratch           (local)      One float4 per work-item.
+ * @param gridNx            (in)         Number of cells in X direction.
+ * @param gridNy            (in)         Number of cells in Y direction.
+ * @param margin            (in)         Padding on every side, relative to the box size.
+ * @param minCellSize       (in)         Lower bound of the cell size (e.g. a single particle).
+ */
+__kernel void finalizeBounds(
+    __global const float4* partialBounds,
+    const int numPartials,
+    __global float4* gridGeometry,
+    __local float4* scratch,
+    const int gridNx,
+    const int gridNy,
+    const float margin,
+    const float minCellSize)
+{
+    int lid   = get_local_id(0);
+    int lsize = WORK_GROUP_SIZE;
+
+    float4 box = (float4)(INFINITY, INFINITY, -INFINITY, -INFINITY);
+    for (int i = lid; i < numPartials; i += lsize) {
+        float4 other = partialBounds[i];
+        box = (float4)(fmin(box.xy, other.xy), fmax(box.zw, other.zw));
+    }
+
+    scratch[lid] = box;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = lsize >> 1; offset; offset >>= 1) {
+        if (lid < offset) {
+            float4 other = scratch[lid + offset];
+            scratch[lid] = (float4)(fmin(scratch[lid].xy, other.xy), fmax(scratch[lid].zw, other.zw));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid != 0)
+        return;
+
+    box = scratch[0];
+    float2 center = 0.5f * (box.xy + box.zw);
+    float2 extent = (box.zw - box.xy) * (1.0f + 2.0f * margin);
+    float2 grid   = (float2)(GRID_X(gridNx), GRID_Y(gridNy));
+    float  cellSize = fmax(fmax(extent.x / grid.x, extent.y / grid.y), minCellSize);
+
+    float2 worldMin = center - 0.5f * cellSize * grid;
+    gridGeometry[0] = (float4)(worldMin, cellSize, cellSize);
+    gridGeometry[1] = (float4)(1.0f / cellSize, 1.0f / cellSize, 1.0f / (cellSize * grid));
+}
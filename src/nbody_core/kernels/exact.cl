@@ -0,0 +1,122 @@
+/**
+ * Exact O(N^2) reference solver.
+ *
+ * packPosMass takes a snapshot of the positions and masses first, so updateExact can
+ * overwrite the positions while other work-groups still read the old positions.
+ */
+
+/**
+ * Packs the particle positions and masses into one float4 per particle (x, y, mass, 0).
+ *
+ * @param positions         (in)         Global buffer of particle positions.
+ * @param masses            (in)         Global buffer of particle masses.
+ * @param posMass           (out)        Packed positions and masses.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void packPosMass(
+    __global const float2* positions,
+    __global const float* masses,
+    __global float4* posMass,
+    const int numParticles)
+{
+    int pid = get_global_id(0);
+    if (pid >= numParticles) return;
+
+    float2 position = positions[pid];
+    posMass[pid] = (float4)(position.x, position.y, PARTICLE_MASS(masses, pid), 0.0f);
+}
+
+/**
+ * Updates particle positions and velocities with the exact sum over all particles.
+ *
+ * Every work-group walks the particles in tiles of its size: each work-item loads one
+ * particle of the tile into local memory, then every work-item sums the whole tile from
+ * there, so each particle is read from global memory once per work-group instead of once
+ * per work-item. Work-items past the end load a massless particle, which adds nothing.
+ * With block timesteps only the active particles are updated; work-groups past the last
+ * active particle return before the tile loop (uniformly for the whole group).
+ *
+ * @param positions         (in/out)     Global buffer of particle positions.
+ * @param velocities        (in/out)     Global buffer of particle velocities.
+ * @param posMass           (in)         Packed positions and masses of the step (packPosMass).
+ * @param tile              (local)      One float4 per work-item.
+ * @param numParticles      (in)         Number of particles.
+ * @param G                 (in)         A physically-motivated gravitational constant. (float)
+ * @param kickTime          (in)         Time the acceleration is applied to the velocity for.
+ * @param driftTime         (in)         Time the new velocity is applied to the position for.
+ * @param blockSteps        (in)         Non-zero for block timesteps: only the active particles are evaluated and their
+ *                                       acceleration is stored instead of integrated (see timestep.cl).
+ * @param activeParticles   (in)         Block timesteps: ids of the active particles (compactActiveParticles).
+ * @param activeCount       (in)         Block timesteps: number of active particles.
+ * @param accelerations     (out)        Block timesteps: acceleration of each active particle.
+ */
+__kernel void updateExact(
+    __global float2* positions,
+    __global float2* velocities,
+    __global const float4* posMass,
+    __local float4* tile,
+    const int numParticles,
+    const float G,
+    const float kickTime,
+    const float driftTime,
+    const int blockSteps,
+    __global const int* activeParticles,
+    __global const int* activeCount,
+    __global float2* accelerations)
+{
+    // A small factor to prevent forces from becoming infinite during close encounters, improving stability.
+    const float softening = SOFTENING;
+
+    int index     = get_global_id(0);
+    int lid       = get_local_id(0);
+    int tileSize  = WORK_GROUP_SIZE;
+    int count     = blockSteps ? activeCount[0] : numParticles;
+
+    // The whole work-group leaves together, so no work-item misses a barrier.
+    if (get_group_id(0) * tileSize >= count) return;
+
+    int pid = -1;
+    if (index < count)
+        pid = blockSteps ? activeParticles[index] : index;
+
+    float2 position = (float2)(0.0f, 0.0f);
+    if (pid >= 0)
+        position = posMass[pid].xy;
+
+    float2 totalAcceleration = (float2)(0.0f, 0.0f);
+
+    for (int tileStart = 0; tileStart < numParticles; tileStart += tileSize) {
+        int loadIndex = tileStart + lid;
+        tile[lid] = loadIndex < numParticles ? posMass[loadIndex] : (float4)(0.0f);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int j = 0; j < tileSize; ++j) {
+            float4 other = tile[j];
+            float2 vectorToOther = other.xy - position;
+
+            float distanceSquared = vectorToOther.x * vectorToOther.x
+                                  + vectorToOther.y * vectorToOther.y
+                                  + softening;
+
+            float invDist = rsqrt(distanceSquared);
+            totalAcceleration += vectorToOther * ((G * other.z) * invDist * invDist * invDist);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (pid < 0) return;
+
+    // Block timesteps: kicked per rung and drifted by the kernels of timestep.cl.
+    if (blockSteps) {
+        accelerations[pid] = totalAcceleration;
+        return;
+    }
+
+    // Integrate motion: kick the velocity, then drift the position (see Simulation::Step for the integrators).
+    float2 newVelocity = velocities[pid] + totalAcceleration * kickTime;
+    float2 newPosition = position + newVelocity * driftTime;
+
+    // Store updated state back to global buffer.
+    positions[pid]  = newPosition;
+    velocities[pid] = newVelocity;
+}
@@ -0,0 +1,417 @@
+/**
+ * Fast Multipole Method on the cell pyramid (see buildPyramidLevel in nbody.cl).
+ *
+ * The grid cells are the leaves; pyramid level l+1 halves level l. The far field uses
+ * Cartesian Taylor expansions of the same softened kernel as the exact near field,
+ *     phi(r) = -1 / sqrt(|r|^2 + softening),    a = -G * grad(sum m * phi),
+ * so the FMM converges to the grid solver's exact 3x3 near field + the true far field.
+ * (The 1/r^2 force of this simulation is not a 2D harmonic kernel, so complex-series
+ * expansions of the log potential would not describe it.)
+ *
+ * Pipeline (one step, after the cell binning of nbody.cl):
+ *   1. fmmP2M       - multipole moments of every leaf cell from its particles.
+ *   2. fmmM2M       - moments of the coarser levels, level by level upwards.
+ *   3. fmmDownward  - local expansion of every cell: L2L from the parent + M2L from the
+ *                     interaction list (children of the parent's neighbours that are not
+ *                     neighbours), level by level downwards.
+ *   4. fmmUpdate    - L2P at the particle's leaf + exact P2P over the 3x3 block + integration.
+ *
+ * Coefficients: multi-index (a, b) with a + b <= FMM_ORDER, stored at fmmIndex(a, b).
+ *   Multipole M(a,b) = sum m * dx^a * dy^b / (a! b!)          (d = particle - cell center)
+ *   Local     L(a,b) = d^(a+b) Phi / dx^a dy^b at the cell center
+ */
+
+#ifndef FMM_ORDER
+#define FMM_ORDER 4
+#endif
+
+#define FMM_TERMS ((FMM_ORDER + 1) * (FMM_ORDER + 2) / 2)
+
+inline int fmmIndex(int a, int b)
+{
+    int n = a + b;
+    return n * (n + 1) / 2 + b;
+}
+
+inline float fmmFactorial(int n)
+{
+    float result = 1.0f;
+    for (int i = 2; i <= n; ++i)
+        result *= (float)i;
+    return result;
+}
+
+/**
+ * Center of cell (x, y) of pyramid level 'level'.
+ * geometry: x,y = world minimum; z,w = level 0 cell size.
+ */
+inline float2 fmmCellCenter(int x, int y, int level, float4 geometry)
+{
+    float scale = (float)(1 << level);
+    return (float2)(geometry.x + (x + 0.5f) * geometry.z * scale,
+                    geometry.y + (y + 0.5f) * geometry.w * scale);
+}
+
+/**
+ * All derivatives D(a,b) = d^(a+b) phi / dx^a dy^b at r, a + b <= FMM_ORDER.
+ *
+ * With u = |r|^2 / 2 and phi = g(u) = -(2u + softening)^(-1/2):
+ *   g^(n)(u) = -(-1)^n (2n-1)!! (2u + softening)^(-(2n+1)/2)
+ *   D(a,b)   = sum_k sum_l C(a,k) C(b,l) x^(a-2k) y^(b-2l) g^(a+b-k-l)(u),  C(a,k) = a! / (2^k k! (a-2k)!)
+ */
+inline void fmmDerivatives(float2 r, float softening, float* D)
+{
+    float s2     = r.x * r.x + r.y * r.y + softening;
+    float invS   = 1.0f / sqrt(s2);
+    float invS2  = invS * invS;
+
+    float g[FMM_ORDER + 1];
+    g[0] = -invS;
+    for (int n = 1; n <= FMM_ORDER; ++n)
+        g[n] = g[n - 1] * (-(float)(2 * n - 1)) * invS2;
+
+    float px[FMM_ORDER + 1], py[FMM_ORDER + 1];
+    px[0] = 1.0f; py[0] = 1.0f;
+    for (int n = 1; n <= FMM_ORDER; ++n) {
+        px[n] = px[n - 1] * r.x;
+        py[n] = py[n - 1] * r.y;
+    }
+
+    for (int n = 0; n <= FMM_ORDER; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            int a = n - b;
+            float sum = 0.0f;
+            for (int k = 0; 2 * k <= a; ++k) {
+                float cA = fmmFactorial(a) / ((float)(1 << k) * fmmFactorial(k) * fmmFactorial(a - 2 * k));
+                for (int l = 0; 2 * l <= b; ++l) {
+                    float cB = fmmFactorial(b) / ((float)(1 << l) * fmmFactorial(l) * fmmFactorial(b - 2 * l));
+                    sum += cA * cB * px[a - 2 * k] * py[b - 2 * l] * g[a + b - k - l];
+                }
+            }
+            D[fmmIndex(a, b)] = sum;
+        }
+    }
+}
+
+/**
+ * P2M: multipole moments of every leaf (level 0) cell about its center.
+ *
+ * @param sortedPosMass     (in)         Cell-sorted particles: x,y = position; z = mass.
+ * @param cellStart         (in)         First sorted slot of each cell.
+ * @param cellEnd           (in)         One past the last sorted slot of each cell.
+ * @param multipoles        (out)        FMM_TERMS moments per pyramid cell.
+ * @param gridNx            (in)         Number of cells in X direction.
+ * @param gridNy            (in)         Number of cells in Y direction.
+ * @param gridGeometry      (in)         World minimum and level 0 cell size (see bounds.cl).
+ */
+__kernel void fmmP2M(
+    __global const float4* sortedPosMass,
+    __global const int* cellStart,
+    __global const int* cellEnd,
+    __global float* multipoles,
+    const int gridNx,
+    const int gridNy,
+    __global const float4* gridGeometry)
+{
+    int cell = get_global_id(0);
+    if (cell >= GRID_X(gridNx) * GRID_Y(gridNy)) return;
+
+    float4 geometry = gridGeometry[0];
+    float2 center = fmmCellCenter(cell % GRID_X(gridNx), cell / GRID_X(gridNx), 0, geometry);
+
+    float M[FMM_TERMS];
+    for (int i = 0; i < FMM_TERMS; ++i)
+        M[i] = 0.0f;
+
+    int end = cellEnd[cell];
+    for (int slot = cellStart[cell]; slot < end; ++slot) {
+        float4 particle = sortedPosMass[slot];
+        float2 d = (float2)(particle.x, particle.y) - center;
+
+        float px[FMM_ORDER + 1], py[FMM_ORDER + 1];
+        px[0] = particle.z; py[0] = 1.0f; // mass folded into the x powers
+        for (int n = 1; n <= FMM_ORDER; ++n) {
+            px[n] = px[n - 1] * d.x;
+            py[n] = py[n - 1] * d.y;
+        }
+
+        for (int n = 0; n <= FMM_ORDER; ++n)
+            for (int b = 0; b <= n; ++b)
+                M[fmmIndex(n - b, b)] += px[n - b] * py[b];
+    }
+
+    __global float* out = multipoles + cell * FMM_TERMS;
+    for (int n = 0; n <= FMM_ORDER; ++n)
+        for (int b = 0; b <= n; ++b)
+            out[fmmIndex(n - b, b)] = M[fmmIndex(n - b, b)] / (fmmFactorial(n - b) * fmmFactorial(b));
+}
+
+/**
+ * M2M: moments of the cells of level 'level' from their (up to) 2x2 children on level - 1.
+ *   M'(a,b) = sum_{k<=a, l<=b} M(k,l) * d.x^(a-k) * d.y^(b-l) / ((a-k)! (b-l)!),   d = child center - parent center
+ *
+ * @param multipoles        (in/out)     FMM_TERMS moments per pyramid cell.
+ * @param pyramidLevels     (in)         Per level: x = offset, y = width, z = height.
+ * @param level             (in)         Level computed by this launch (>= 1).
+ * @param gridGeometry      (in)         World minimum and level 0 cell size (see bounds.cl).
+ */
+__kernel void fmmM2M(
+    __global float* multipoles,
+    __constant int4* pyramidLevels,
+    const int level,
+    __global const float4* gridGeometry)
+{
+    int4 dst = pyramidLevels[level];
+    int4 src = pyramidLevels[level - 1];
+
+    int id = get_global_id(0);
+    if (id >= dst.y * dst.z) return;
+
+    int x = id % dst.y;
+    int y = id / dst.y;
+    float4 geometry = gridGeometry[0];
+    float2 center = fmmCellCenter(x, y, level, geometry);
+
+    float M[FMM_TERMS];
+    for (int i = 0; i < FMM_TERMS; ++i)
+        M[i] = 0.0f;
+
+    for (int childY = 2 * y; childY <= min(2 * y + 1, src.z - 1); ++childY) {
+        for (int childX = 2 * x; childX <= min(2 * x + 1, src.y - 1); ++childX) {
+            __global const float* child = multipoles + (src.x + childX + childY * src.y) * FMM_TERMS;
+            if (child[0] == 0.0f)
+                continue; // empty cell
+
+            float2 d = fmmCellCenter(childX, childY, level - 1, geometry) - center;
+
+            // d^n / n!
+            float px[FMM_ORDER + 1], py[FMM_ORDER + 1];
+            px[0] = 1.0f; py[0] = 1.0f;
+            for (int n = 1; n <= FMM_ORDER; ++n) {
+                px[n] = px[n - 1] * d.x / (float)n;
+                py[n] = py[n - 1] * d.y / (float)n;
+            }
+
+            for (int n = 0; n <= FMM_ORDER; ++n) {
+                for (int b = 0; b <= n; ++b) {
+                    int a = n - b;
+                    float sum = 0.0f;
+                    for (int k = 0; k <= a; ++k)
+                        for (int l = 0; l <= b; ++l)
+                            sum += child[fmmIndex(k, l)] * px[a - k] * py[b - l];
+                    M[fmmIndex(a, b)] += sum;
+                }
+            }
+        }
+    }
+
+    __global float* out = multipoles + (dst.x + id) * FMM_TERMS;
+    for (int i = 0; i < FMM_TERMS; ++i)
+        out[i] = M[i];
+}
+
+/**
+ * Local expansions of the cells of level 'level':
+ *   L2L from the parent:  L(n) = sum_k Lparent(n + k) * d^k / k!,   d = center - parent center
+ *   M2L from the interaction list (children of the parent's 3x3 block that are outside the own 3x3 block):
+ *                         L(n) += sum_k (-1)^|k| M(k) * D(n + k)(center - source center)
+ * The top level (a single cell) has neither a parent nor an interaction list.
+ *
+ * @param multipoles        (in)         FMM_TERMS moments per pyramid cell.
+ * @param locals            (in/out)     FMM_TERMS local coefficients per pyramid cell.
+ * @param pyramidLevels     (in)         Per level: x = offset, y = width, z = height.
+ * @param numLevels         (in)         Number of pyramid levels.
+ * @param level             (in)         Level computed by this launch.
+ * @param gridGeometry      (in)         World minimum and level 0 cell size (see bounds.cl).
+ * @param softening         (in)         Softening of the kernel (added to r^2).
+ */
+__kernel void fmmDownward(
+    __global const float* multipoles,
+    __global float* locals,
+    __constant int4* pyramidLevels,
+    const int numLevels,
+    const int level,
+    __global const float4* gridGeometry,
+    const float softening)
+{
+    int4 info = pyramidLevels[level];
+
+    int id = get_global_id(0);
+    if (id >= info.y * info.z) return;
+
+    int x = id % info.y;
+    int y = id / info.y;
+    float4 geometry = gridGeometry[0];
+    float2 center = fmmCellCenter(x, y, level, geometry);
+
+    float L[FMM_TERMS];
+    for (int i = 0; i < FMM_TERMS; ++i)
+        L[i] = 0.0f;
+
+    if (level < numLevels - 1) {
+        int4 parentInfo = pyramidLevels[level + 1];
+        int parentX = x >> 1;
+        int parentY = y >> 1;
+
+        // L2L
+        __global const float* parent = locals + (parentInfo.x + parentX + parentY * parentInfo.y) * FMM_TERMS;
+        float2 d = center - fmmCellCenter(parentX, parentY, level + 1, geometry);
+
+        float px[FMM_ORDER + 1], py[FMM_ORDER + 1];
+        px[0] = 1.0f; py[0] = 1.0f;
+        for (int n = 1; n <= FMM_ORDER; ++n) {
+            px[n] = px[n - 1] * d.x / (float)n;
+            py[n] = py[n - 1] * d.y / (float)n;
+        }
+
+        for (int n = 0; n <= FMM_ORDER; ++n) {
+            for (int b = 0; b <= n; ++b) {
+                int a = n - b;
+                float sum = 0.0f;
+                for (int m = 0; m <= FMM_ORDER - n; ++m)
+                    for (int l = 0; l <= m; ++l)
+                        sum += parent[fmmIndex(a + m - l, b + l)] * px[m - l] * py[l];
+                L[fmmIndex(a, b)] = sum;
+            }
+        }
+
+        // M2L over the interaction list
+        int minX = max(parentX - 1, 0) * 2;
+        int minY = max(parentY - 1, 0) * 2;
+        int maxX = min((parentX + 1) * 2 + 1, info.y - 1);
+        int maxY = min((parentY + 1) * 2 + 1, info.z - 1);
+
+        float D[FMM_TERMS];
+        for (int sourceY = minY; sourceY <= maxY; ++sourceY) {
+            for (int sourceX = minX; sourceX <= maxX; ++sourceX) {
+                if (abs(sourceX - x) <= 1 && abs(sourceY - y) <= 1)
+                    continue; // neighbour: handled on the next finer level
+
+                __global const float* M = multipoles + (info.x + sourceX + sourceY * info.y) * FMM_TERMS;
+                if (M[0] == 0.0f)
+                    continue; // empty cell
+
+                fmmDerivatives(center - fmmCellCenter(sourceX, sourceY, level, geometry), softening, D);
+
+                for (int n = 0; n <= FMM_ORDER; ++n) {
+                    for (int b = 0; b <= n; ++b) {
+                        int a = n - b;
+                        float sum = 0.0f;
+                        for (int m = 0; m <= FMM_ORDER - n; ++m) {
+                            float sign = (m & 1) ? -1.0f : 1.0f;
+                            for (int l = 0; l <= m; ++l)
+                                sum += sign * M[fmmIndex(m - l, l)] * D[fmmIndex(a + m - l, b + l)];
+                        }
+                        L[fmmIndex(a, b)] += sum;
+                    }
+                }
+            }
+        }
+    }
+
+    __global float* out = locals + (info.x + id) * FMM_TERMS;
+    for (int i = 0; i < FMM_TERMS; ++i)
+        out[i] = L[i];
+}
+
+/**
+ * Updates particle positions and velocities with the FMM far field (L2P at the particle's
+ * leaf cell) and the exact near field over the 3x3 block (P2P), in cell-sorted order.
+ *
+ * @param positions         (in/out)     Global buffer of particle positions.
+ * @param velocities        (in/out)     Global buffer of particle velocities.
+ * @param particleCellIndex (in)         Global buffer of particle's cell index.
+ * @param cellStart         (in)         First sorted slot of each cell.
+ * @param cellEnd           (in)         One past the last sorted slot of each cell.
+ * @param sortedIndex       (in)         Particle id stored at each sorted slot.
+ * @param sortedPosMass     (in)         Cell-sorted particles: x,y = position; z = mass.
+ * @param locals            (in)         FMM_TERMS local coefficients per pyramid cell (leaves first).
+ * @param gridNx            (in)         Number of cells in X direction.
+ * @param gridNy            (in)         Number of cells in Y direction.
+ * @param gridGeometry      (in)         World minimum and level 0 cell size (see bounds.cl).
+ * @param numParticles      (in)         Number of particles.
+ * @param G                 (in)         A physically-motivated gravitational constant. (float)
+ * @param kickTime          (in)         Time the acceleration is applied to the velocity for.
+ * @param driftTime         (in)         Time the new velocity is applied to the position for.
+ * @param blockSteps        (in)         Non-zero for block timesteps: only the active particles are evaluated and their
+ *                                       acceleration is stored instead of integrated (see timestep.cl).
+ * @param activeParticles   (in)         Block timesteps: ids of the active particles (compactActiveParticles).
+ * @param activeCount       (in)         Block timesteps: number of active particles.
+ * @param accelerations     (out)        Block timesteps: acceleration of each active particle.
+ */
+__kernel void fmmUpdate(
+    __global float2* positions,
+    __global float2* velocities,
+    __global const int* particleCellIndex,
+    __global const int* cellStart,
+    __global const int* cellEnd,
+    __global const int* sortedIndex,
+    __global const float4* sortedPosMass,
+    __global const float* locals,
+    const int gridNx,
+    const int gridNy,
+    __global const float4* gridGeometry,
+    const int numParticles,
+    const float G,
+    const float kickTime,
+    const float driftTime,
+    const int blockSteps,
+    __global const int* activeParticles,
+    __global const int* activeCount,
+    __global float2* accelerations)
+{
+    // A small factor to prevent forces from becoming infinite during close encounters, improving stability.
+    const float softening = SOFTENING;
+
+    int slot = get_global_id(0);
+    if (slot >= (blockSteps ? activeCount[0] : numParticles)) return;
+    int particleId = blockSteps ? activeParticles[slot] : sortedIndex[slot];
+
+    // Load particle state: position and velocity.
+    float2 position  = positions[particleId];
+    float2 velocity  = velocities[particleId];
+
+    int myCellIndex = particleCellIndex[particleId];
+    int myCellX     = myCellIndex % GRID_X(gridNx);
+    int myCellY     = myCellIndex / GRID_X(gridNx);
+
+    // Near field: exact P2P over the 3x3 block.
+    float2 totalAcceleration = nearFieldAcceleration(position, myCellX, myCellY, cellStart, cellEnd,
+                                                     sortedPosMass, GRID_X(gridNx), GRID_Y(gridNy), G, softening);
+
+    // Far field: L2P, grad Phi(center + d) = sum_n L(n + e) d^n / n!
+    __global const float* L = locals + myCellIndex * FMM_TERMS;
+    float2 d = position - fmmCellCenter(myCellX, myCellY, 0, gridGeometry[0]);
+
+    float px[FMM_ORDER], py[FMM_ORDER];
+    px[0] = 1.0f; py[0] = 1.0f;
+    for (int n = 1; n < FMM_ORDER; ++n) {
+        px[n] = px[n - 1] * d.x / (float)n;
+        py[n] = py[n - 1] * d.y / (float)n;
+    }
+
+    float2 gradient = (float2)(0.0f, 0.0f);
+    for (int n = 0; n < FMM_ORDER; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            int a = n - b;
+            float weight = px[a] * py[b];
+            gradient.x += L[fmmIndex(a + 1, b)] * weight;
+            gradient.y += L[fmmIndex(a, b + 1)] * weight;
+        }
+    }
+    totalAcceleration -= G * gradient;
+
+    // Block timesteps: kicked per rung and drifted by the kernels of timestep.cl.
+    if (blockSteps) {
+        accelerations[particleId] = totalAcceleration;
+        return;
+    }
+
+    // Integrate motion: kick the velocity, then drift the position (see Simulation::Step for the integrators).
+    float2 newVelocity = velocity + totalAcceleration * kickTime;
+    float2 newPosition = position + newVelocity * driftTime;
+
+    // Store updated state back to global buffer.
+    positions[particleId]  = newPosition;
+    velocities[particleId] = newVelocity;
+}
@@ -0,0 +1,602 @@
+/**
+ * Compile-time specialisation (Simulation::VariantDefines).
+ *
+ * The host always defines SOFTENING. A specialised build also defines GRID_NX / GRID_NY, LOCAL_SIZE and,
+ * when every particle has the same mass, UNIFORM_MASS. The kernels keep their runtime arguments, but
+ * GRID_X(gridNx), GRID_Y(gridNy), WORK_GROUP_SIZE and PARTICLE_MASS(masses, id) replace them with the
+ * constants, so the cell index divisions and the loop bounds fold and the local memory loops unroll.
+ * Kernels using WORK_GROUP_SIZE must be launched with config.localSize work-items per group.
+ */
+#ifndef SOFTENING
+#define SOFTENING 0.001f
+#endif
+
+#ifdef GRID_NX
+#define GRID_X(runtime) GRID_NX
+#define GRID_Y(runtime) GRID_NY
+#else
+#define GRID_X(runtime) (runtime)
+#define GRID_Y(runtime) (runtime)
+#endif
+
+#ifdef LOCAL_SIZE
+#define WORK_GROUP_SIZE LOCAL_SIZE
+#else
+#define WORK_GROUP_SIZE ((int)get_local_size(0))
+#endif
+
+#ifdef UNIFORM_MASS
+#define PARTICLE_MASS(masses, id) (UNIFORM_MASS)
+#else
+#define PARTICLE_MASS(masses, id) ((masses)[id])
+#endif
+
+/**
+ * For each particle, this kernel calculates which grid cell it belongs to.
+ * The world is split into a 2D grid with gridNx * gridNy cells.
+ * It also builds the histogram of the cell indices (first stage of the cell binning).
+ *
+ * @param positions             (in)     Global buffer of particle positions.
+ * @param particalCellIndex     (in/out) Global buffer of particle's cell index
+ * @param cellCounter           (in/out) Number of particles per cell (zeroed by the host before the launch).
+ * @param gridNx                (in)     Number of cells in X direction.
+ * @param gridNy                (in)     Number of cells in Y direction.
+ * @param gridGeometry          (in)     World minimum and inverse cell size (see bounds.cl).
+ * @param numParticles          (in)     Number of particles.
+ */
+
+__kernel void computeParticleCellIndex(
+    __global const float2* positions, 
+    __global int* particleCellIndex,
+    __global int* cellCounter,
+    const int gridNx,
+    const int gridNy,
+    __global const float4* gridGeometry,
+    const int numParticles)
+{
+    // Global thread id is the particle index
+    int pid = get_global_id(0);
+    if (pid >= numParticles) return;
+    
+    float2 pos = positions[pid];
+    float2 worldMin    = gridGeometry[0].xy;
+    float2 cellSizeInv = gridGeometry[1].xy;
+
+    // Compute cell coordinates in floating point, then cast to int
+    int cellX = (int)((pos.x - worldMin.x) * cellSizeInv.x);
+    int cellY = (int)((pos.y - worldMin.y) * cellSizeInv.y);
+    
+    // Clamp cell indexes to the valid grid range
+    cellX = clamp(cellX, 0, GRID_X(gridNx) - 1);
+    cellY = clamp(cellY, 0, GRID_Y(gridNy) - 1);
+
+    // Store which cell this particle belongs to (Converting 2D cell coordinates to a single 1D index)
+    int cell = cellX + cellY * GRID_X(gridNx);
+    particleCellIndex[pid] = cell;
+
+    // Histogram of the cells
+    atomic_inc(&cellCounter[cell]);
+}
+
+/**
+ * Exclusive scan of the per-cell particle counts (second stage of the cell binning).
+ * Must be launched with a single work-group; the group walks the cells in chunks of
+ * its size, scans each chunk in local memory and carries the running total.
+ *
+ * After the kernel:
+ *   - cellStart[c] .. cellEnd[c] is the range of cell c in the cell-sorted arrays,
+ *   - cellCounter[c] == cellStart[c], and it is used as the insertion cursor by scatterParticlesByCell.
+ *
+ * @param cellCounter       (in/out)     In: particles per cell. Out: first slot of each cell.
+ * @param cellStart         (out)        First slot of each cell in the sorted arrays.
+ * @param cellEnd           (out)        One past the last slot of each cell in the sorted arrays.
+ * @param totalCells        (in)         Total number of cells (gridNx * gridNy).
+ * @param scratch           (local)      Scan workspace, one int per work-item.
+ */
+__kernel void scanCellCounts(
+    __global int* cellCounter,
+    __global int* cellStart,
+    __global int* cellEnd,
+    const int totalCells,
+    __local int* scratch)
+{
+    int lid   = get_local_id(0);
+    int lsize = WORK_GROUP_SIZE;
+
+    // Sum of all previous chunks (same value in every work-item)
+    int carry = 0;
+
+    for (int base = 0; base < totalCells; base += lsize) {
+        int cell  = base + lid;
+        int count = (cell < totalCells) ? cellCounter[cell] : 0;
+        scratch[lid] = count;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Inclusive scan of the chunk (Hillis-Steele)
+        for (int offset = 1; offset < lsize; offset <<= 1) {
+            int value = (lid >= offset) ? scratch[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            scratch[lid] += value;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        int inclusive = carry + scratch[lid];
+        if (cell < totalCells) {
+            cellStart[cell]   = inclusive - count;
+            cellEnd[cell]     = inclusive;
+            cellCounter[cell] = inclusive - count;
+        }
+
+        carry += scratch[lsize - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+/**
+ * Scatters the particles into cell order (third stage of the cell binning).
+ * The order of the particles inside one cell is unspecified.
+ *
+ * @param positions         (in)         Global buffer of particle positions.
+ * @param masses            (in)         Global buffer of particle masses.
+ * @param particleCellIndex (in)         Global buffer of particle's cell index.
+ * @param cellCounter       (in/out)     Insertion cursor of each cell (see scanCellCounts).
+ * @param sortedIndex       (out)        Particle id stored at each sorted slot.
+ * @param sortedPosMass     (out)        Cell-sorted copy of the particles: x,y = position; z = mass.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void scatterParticlesByCell(
+    __global const float2* positions,
+    __global const float* masses,
+    __global const int* particleCellIndex,
+    __global int* cellCounter,
+    __global int* sortedIndex,
+    __global float4* sortedPosMass,
+    const int numParticles)
+{
+    int pid = get_global_id(0);
+    if (pid >= numParticles) return;
+
+    int slot = atomic_inc(&cellCounter[particleCellIndex[pid]]);
+
+    float2 position = positions[pid];
+    sortedIndex[slot]   = pid;
+    sortedPosMass[slot] = (float4)(position.x, position.y, PARTICLE_MASS(masses, pid), 0.0f);
+}
+
+/**
+ * Atomically adds 'value' to a float in global memory.
+ * OpenCL 1.2 has no float atomics, so the add is done by a compare-and-swap loop on the bit pattern.
+ */
+inline void atomicAddGlobalFloat(volatile __global float* address, float value)
+{
+    union { unsigned int u; float f; } expected, desired;
+    do {
+        expected.f = *address;
+        desired.f  = expected.f + value;
+    } while (atomic_cmpxchg((volatile __global unsigned int*)address, expected.u, desired.u) != expected.u);
+}
+
+/**
+ * Atomically adds 'value' to a float in local memory (see atomicAddGlobalFloat).
+ */
+inline void atomicAddLocalFloat(volatile __local float* address, float value)
+{
+    union { unsigned int u; float f; } expected, desired;
+    do {
+        expected.f = *address;
+        desired.f  = expected.f + value;
+    } while (atomic_cmpxchg((volatile __local unsigned int*)address, expected.u, desired.u) != expected.u);
+}
+
+/**
+ * For each cell, this kernel computes:
+ *   - the total mass inside the cell
+ *   - the sum of (mass * position) inside the cell.
+ *
+ * NOTE
+ *   - cellMass and cellCOM must be zeroed before the launch (the kernel only accumulates).
+ *   - cellCOM[cell] stores (sum(m * x), sum(m * y)) for all particles in the cell.
+ *   - The actual center of mass (COM) is computed later as:
+ *         COM = cellCOM[cell] / cellMass[cell]
+ *
+ * Work distribution:
+ *   - Every particle is visited exactly once (grid-stride loop over the particles).
+ *   - Each work-group keeps a private copy of the whole grid in local memory and
+ *     accumulates its particles into it with local atomics.
+ *   - At the end every group merges its non-empty cells into the global sums.
+ *   - Cost: O(numParticles + numGroups * totalCells) instead of O(numParticles * totalCells).
+ *
+ * The local arrays must hold totalCells floats each; the host falls back to
+ * computeCellCOMGlobal when the grid does not fit into local memory.
+ *
+ * @param positions          (in)         Global buffer of particle positions.
+ * @param masses             (in)         Global buffer of particle masses.
+ * @param particleCellIndex  (in)         Global buffer of particle's cell index.
+ * @param cellMass           (in/out)     For each cell, the total mass of particles in that cell.
+ * @param cellCOM            (in/out)     For each cell, the sum of mass * position (x, y interleaved).
+ * @param numParticles       (in)         Number of particles.
+ * @param totalCells         (in)         Total number of cells in the world.
+ * @param localMass          (local)      Work-group private per-cell mass sums.
+ * @param localCOMX          (local)      Work-group private per-cell sums of (mass * pos.x).
+ * @param localCOMY          (local)      Work-group private per-cell sums of (mass * pos.y).
+ */
+__kernel void computeCellCOM(
+    __global const float2* positions,
+    __global const float* masses,
+    __global const int* particleCellIndex,
+    __global float* cellMass,
+    __global float* cellCOM,
+    const int numParticles,
+    const int totalCells,
+    __local float* localMass,
+    __local float* localCOMX,
+    __local float* localCOMY
+)
+{
+    // Local thread index and group size.
+    int localId   = get_local_id(0);
+    int localSize = WORK_GROUP_SIZE;
+
+    // Clear the private grid of this work-group.
+    for (int cell = localId; cell < totalCells; cell += localSize) {
+        localMass[cell] = 0.0f;
+        localCOMX[cell] = 0.0f;
+        localCOMY[cell] = 0.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Each particle is accumulated once:
+    // particleId = globalId, globalId + globalSize, ...
+    for (int particleId = get_global_id(0); particleId < numParticles; particleId += get_global_size(0)) {
+        int   cell = particleCellIndex[particleId];
+        float mass = PARTICLE_MASS(masses, particleId);
+        float2 position = positions[particleId];
+
+        atomicAddLocalFloat(&localMass[cell], mass);
+        atomicAddLocalFloat(&localCOMX[cell], position.x * mass);
+        atomicAddLocalFloat(&localCOMY[cell], position.y * mass);
+    }
+
+    // Wait every thread to finish
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Merge the non-empty cells of this group into the global sums.
+    // The actual COM is computed in the update kernel as cellCOM / cellMass.
+    for (int cell = localId; cell < totalCells; cell += localSize) {
+        float mass = localMass[cell];
+        if (mass == 0.0f)
+            continue;
+
+        atomicAddGlobalFloat(&cellMass[cell], mass);
+        atomicAddGlobalFloat(&cellCOM[2 * cell + 0], localCOMX[cell]);
+        atomicAddGlobalFloat(&cellCOM[2 * cell + 1], localCOMY[cell]);
+    }
+}
+
+/**
+ * Same as computeCellCOM, but accumulates straight into global memory.
+ * Used when the grid is too large for a work-group private copy in local memory.
+ *
+ * @param positions          (in)         Global buffer of particle positions.
+ * @param masses             (in)         Global buffer of particle masses.
+ * @param particleCellIndex  (in)         Global buffer of particle's cell index.
+ * @param cellMass           (in/out)     For each cell, the total mass of particles in that cell (zeroed by the host).
+ * @param cellCOM            (in/out)     For each cell, the sum of mass * position (zeroed by the host).
+ * @param numParticles       (in)         Number of particles.
+ */
+__kernel void computeCellCOMGlobal(
+    __global const float2* positions,
+    __global const float* masses,
+    __global const int* particleCellIndex,
+    __global float* cellMass,
+    __global float* cellCOM,
+    const int numParticles)
+{
+    int particleId = get_global_id(0);
+    if (particleId >= numParticles) return;
+
+    int   cell = particleCellIndex[particleId];
+    float mass = PARTICLE_MASS(masses, particleId);
+    float2 position = positions[particleId];
+
+    atomicAddGlobalFloat(&cellMass[cell], mass);
+    atomicAddGlobalFloat(&cellCOM[2 * cell + 0], position.x * mass);
+    atomicAddGlobalFloat(&cellCOM[2 * cell + 1], position.y * mass);
+}
+
+/**
+ * Builds one level of the cell pyramid from the next finer level: every coarse cell
+ * sums the mass and the (mass * position) of its (up to) 2x2 children.
+ * All levels are stored back to back in cellMass/cellCOM, level 0 being the grid itself.
+ *
+ * @param cellMass          (in/out)     Per pyramid cell total mass.
+ * @param cellCOM           (in/out)     Per pyramid cell sum of (mass * position).
+ * @param srcOffset         (in)         Offset of the finer level.
+ * @param srcNx             (in)         Width of the finer level.
+ * @param srcNy             (in)         Height of the finer level.
+ * @param dstOffset         (in)         Offset of the coarser level.
+ * @param dstNx             (in)         Width of the coarser level (ceil(srcNx / 2)).
+ * @param dstNy             (in)         Height of the coarser level (ceil(srcNy / 2)).
+ */
+__kernel void buildPyramidLevel(
+    __global float* cellMass,
+    __global float2* cellCOM,
+    const int srcOffset,
+    const int srcNx,
+    const int srcNy,
+    const int dstOffset,
+    const int dstNx,
+    const int dstNy)
+{
+    int id = get_global_id(0);
+    if (id >= dstNx * dstNy) return;
+
+    int x = id % dstNx;
+    int y = id / dstNx;
+
+    float  mass = 0.0f;
+    float2 com  = (float2)(0.0f, 0.0f);
+    for (int childY = 2 * y; childY <= min(2 * y + 1, srcNy - 1); ++childY) {
+        for (int childX = 2 * x; childX <= min(2 * x + 1, srcNx - 1); ++childX) {
+            int child = srcOffset + childX + childY * srcNx;
+            mass += cellMass[child];
+            com  += cellCOM[child];
+        }
+    }
+
+    cellMass[dstOffset + id] = mass;
+    cellCOM[dstOffset + id]  = com;
+}
+
+/**
+ * Exact acceleration on a particle from all particles of its own cell and of the
+ * 8 neighboring cells (3x3 block), read from the cell-sorted particle ranges.
+ *
+ * The particle itself is not skipped: its vector to itself is zero,
+ * and the softening keeps the distance non-zero, so it adds nothing.
+ */
+inline float2 nearFieldAcceleration(
+    float2 position,
+    int myCellX,
+    int myCellY,
+    __global const int* cellStart,
+    __global const int* cellEnd,
+    __global const float4* sortedPosMass,
+    int gridNx,
+    int gridNy,
+    float G,
+    float softening)
+{
+    float2 acceleration = (float2)(0.0f, 0.0f);
+
+    for (int cellY = max(myCellY - 1, 0); cellY <= min(myCellY + 1, gridNy - 1); ++cellY)
+    {
+        for (int cellX = max(myCellX - 1, 0); cellX <= min(myCellX + 1, gridNx - 1); ++cellX)
+        {
+            int neighborCell = cellX + cellY * gridNx;
+            int end          = cellEnd[neighborCell];
+
+            for (int otherSlot = cellStart[neighborCell]; otherSlot < end; ++otherSlot)
+            {
+                float4 other    = sortedPosMass[otherSlot];
+                float2 otherPos = (float2)(other.x, other.y);
+
+                // Vector from current particle to other particle.
+                float2 vectorToOther = otherPos - position;
+
+                float distanceSquared = vectorToOther.x * vectorToOther.x
+                                      + vectorToOther.y * vectorToOther.y
+                                      + softening;
+
+                float invDist        = 1.0f / sqrt(distanceSquared);
+                float invDistCube    = invDist * invDist * invDist; // 1 / r^3
+
+                // forceMagnitude = G * m_other * invDistCube
+                float otherMass      = other.z;
+                float forceMagnitude = (G * otherMass) * invDistCube;
+
+                // Accumulate acceleration (a = F/m, own mass cancels out here).
+                acceleration += vectorToOther * forceMagnitude;
+            }
+        }
+    }
+
+    return acceleration;
+}
+
+/**
+ * This kernel updates particle positions and velocities using a space-partitioned
+ * model with a grid-based approximation.
+ *
+ * Work-items run over the cell-sorted slots, so neighbouring work-items handle particles
+ * of the same cell and read the same neighbour ranges.
+ *
+ * For each particle:
+ *   - determine its grid cell from particleCellIndex,
+ *   - loop over the particles of its own cell and of the 8 neighboring cells
+ *     (the local 3x3 block, found through cellStart/cellEnd) and compute
+ *     exact particle-to-particle forces,
+ *   - walk the cell pyramid from the coarsest level and:
+ *       * skip empty cells (cellMass[cell] <= 0),
+ *       * refine cells closer than farFieldRadius on the next finer level,
+ *       * skip cells in the local 3x3 neighborhood on level 0 (already handled exactly),
+ *       * for all other (distant) cells, treat the whole cell as a single
+ *         mass located at its center of mass, computed from cellMass and cellCOM,
+ *         and add this approximate contribution to the acceleration,
+ *   - integrate the total acceleration to update velocity and position.
+ *
+ * @param positions         (in/out)     Global buffer of particle positions.
+ * @param velocities        (in/out)     Global buffer of particle velocities.
+ * @param particleCellIndex (in)         Global buffer of particle's cell index.
+ * @param cellStart         (in)         First sorted slot of each cell.
+ * @param cellEnd           (in)         One past the last sorted slot of each cell.
+ * @param sortedIndex       (in)         Particle id stored at each sorted slot.
+ * @param sortedPosMass     (in)         Cell-sorted particles: x,y = position; z = mass.
+ * @param cellMass          (in)         For each pyramid cell, total mass in that cell.
+ * @param cellCOM           (in)         For each pyramid cell, sum of (mass * position) in that cell.
+ * @param pyramidLevels     (in)         Per level: x = offset of the level in cellMass/cellCOM, y = width, z = height.
+ * @param numLevels         (in)         Number of pyramid levels (level 0 is the grid itself).
+ * @param farFieldRadius    (in)         Distance (in cells of the level) from which a pyramid cell is used as a whole.
+ * @param gridNx            (in)         Number of cells in X direction.
+ * @param gridNy            (in)         Number of cells in Y direction.
+ * @param numParticles      (in)         Number of particles.
+ * @param G                 (in)         A physically-motivated gravitational constant. (float)
+ * @param kickTime          (in)         Time the acceleration is applied to the velocity for.
+ * @param driftTime         (in)         Time the new velocity is applied to the position for.
+ * @param blockSteps        (in)         Non-zero for block timesteps: only the active particles are evaluated and their
+ *                                       acceleration is stored instead of integrated (see timestep.cl).
+ * @param activeParticles   (in)         Block timesteps: ids of the active particles (compactActiveParticles).
+ * @param activeCount       (in)         Block timesteps: number of active particles.
+ * @param accelerations     (out)        Block timesteps: acceleration of each active particle.
+ */
+__kernel void update(
+    __global float2* positions,
+    __global float2* velocities,
+    __global const int* particleCellIndex,
+    __global const int* cellStart,
+    __global const int* cellEnd,
+    __global const int* sortedIndex,
+    __global const float4* sortedPosMass,
+    __global const float* cellMass,
+    __global const float2* cellCOM,
+    __constant int4* pyramidLevels,
+    const int numLevels,
+    const int farFieldRadius,
+    const int gridNx,
+    const int gridNy,
+    const int numParticles,
+    const float G,
+    const float kickTime,
+    const float driftTime,
+    const int blockSteps,
+    __global const int* activeParticles,
+    __global const int* activeCount,
+    __global float2* accelerations)
+{
+          
+    // A small factor to prevent forces from becoming infinite during close encounters, improving stability.
+    const float softening = SOFTENING;
+
+    // One thread updates one particle, in cell-sorted order (block timesteps: the active ones, see compactActiveParticles).
+    int slot = get_global_id(0);
+    if (slot >= (blockSteps ? activeCount[0] : numParticles)) return;
+    int particleId = blockSteps ? activeParticles[slot] : sortedIndex[slot];
+
+    // Load particle state: position and velocity.
+    float2 position  = positions[particleId];
+    float2 velocity  = velocities[particleId];
+
+    // Actual particle's cell
+    int myCellIndex = particleCellIndex[particleId];
+    int myCellX     = myCellIndex % GRID_X(gridNx);
+    int myCellY     = myCellIndex / GRID_X(gridNx);
+
+    // Start with zero acceleration.
+    float2 totalAcceleration  = (float2)(0.0f, 0.0f);
+
+    // Exact interaction with the particles of the same cell
+    // and of the 8 neighboring cells (3x3 block).
+    totalAcceleration += nearFieldAcceleration(position, myCellX, myCellY, cellStart, cellEnd,
+                                               sortedPosMass, GRID_X(gridNx), GRID_Y(gridNy), G, softening);
+
+    // Far field from the cell pyramid, coarsest level first.
+    // At level l the candidates are the children of the cells that were too close at level l+1
+    // (all cells at the top level); a candidate is used if it is farther than farFieldRadius cells
+    // from the particle's own level-l cell, otherwise it is refined on the next level. On level 0
+    // only the exact 3x3 block is excluded. Every level-0 cell outside the 3x3 block is therefore
+    // covered exactly once, by one of its ancestors or by itself.
+    for (int level = numLevels - 1; level >= 0; --level) {
+        int4 info      = pyramidLevels[level];
+        int  offset    = info.x;
+        int  levelNx   = info.y;
+        int  levelNy   = info.z;
+        int  myX       = myCellX >> level;
+        int  myY       = myCellY >> level;
+        int  exclusion = (level == 0) ? 1 : farFieldRadius;
+
+        int minX = 0, maxX = levelNx - 1;
+        int minY = 0, maxY = levelNy - 1;
+        if (level < numLevels - 1) {
+            int parentX = myCellX >> (level + 1);
+            int parentY = myCellY >> (level + 1);
+            minX = max(parentX - farFieldRadius, 0) * 2;
+            minY = max(parentY - farFieldRadius, 0) * 2;
+            maxX = min((parentX + farFieldRadius) * 2 + 1, levelNx - 1);
+            maxY = min((parentY + farFieldRadius) * 2 + 1, levelNy - 1);
+        }
+
+        for (int cellY = minY; cellY <= maxY; ++cellY) {
+            for (int cellX = minX; cellX <= maxX; ++cellX) {
+                // Too close on this level: refined on the next one (or handled exactly on level 0).
+                if ((int)abs(cellX - myX) <= exclusion && (int)abs(cellY - myY) <= exclusion)
+                    continue;
+
+                int cellIndex = offset + cellX + cellY * levelNx;
+                float cellMassValue = cellMass[cellIndex];
+                if (cellMassValue <= 0.0f) continue; // skip empty cells
+
+                // Compute center of mass of this cell:
+                float2 cellCOMPosition  = (float2)(cellCOM[cellIndex].x / cellMassValue, cellCOM[cellIndex].y / cellMassValue);
+
+                // Direction vector from particle to cell COM.
+                float2 direction = cellCOMPosition - position;
+
+                // Distance squared + softening.
+                float distanceSquared = direction.x * direction.x
+                                      + direction.y * direction.y
+                                      + softening;
+
+                float invDistance      = 1.0f / sqrt(distanceSquared);
+                float invDistanceCubed = invDistance * invDistance * invDistance;
+
+                // Gravitational acceleration contribution from this cell.
+                // Proportional to G * cellMass / r^2, with direction.
+                totalAcceleration  += direction * (G * cellMassValue * invDistanceCubed);
+            }
+        }
+    }
+
+    // Block timesteps: kicked per rung and drifted by the kernels of timestep.cl.
+    if (blockSteps) {
+        accelerations[particleId] = totalAcceleration;
+        return;
+    }
+
+    // Integrate motion: kick the velocity, then drift the position (see Simulation::Step for the integrators).
+    float2 newVelocity = velocity + totalAcceleration  * kickTime;
+    float2 newPosition = position + newVelocity * driftTime;
+
+    // Store updated state back to global buffer.
+    positions[particleId]  = newPosition;
+    velocities[particleId] = newVelocity;
+}
+
+/**
+ * Packs the particle state into the compact vertex layout of the renderer (8 bytes per particle):
+ *   bytes 0..3: position as two half floats,
+ *   byte  4:    speed / maxSpeed as unsigned normalized byte,
+ *   bytes 5..7: unused.
+ * Only launched when a frame is drawn, so the force kernels never touch the shared buffer.
+ *
+ * @param positions         (in)         Global buffer of particle positions.
+ * @param velocities        (in)         Global buffer of particle velocities.
+ * @param vertices          (out)        Render buffer, 4 halves per particle.
+ * @param maxSpeed          (in)         Speed mapped to 255.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void packRenderVertices(
+    __global const float2* positions,
+    __global const float2* velocities,
+    __global half* vertices,
+    const float maxSpeed,
+    const int numParticles)
+{
+    int pid = get_global_id(0);
+    if (pid >= numParticles) return;
+
+    __global half* vertex = vertices + 4 * pid;
+    vstore_half2(positions[pid], 0, vertex);
+
+    float speed = clamp(length(velocities[pid]) / maxSpeed, 0.0f, 1.0f);
+    ((__global uchar*)(vertex + 2))[0] = convert_uchar_sat_rte(speed * 255.0f);
+}
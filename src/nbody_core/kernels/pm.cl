@@ -0,0 +1,345 @@
+/**
+ * Particle-mesh (PM) and particle-particle/particle-mesh (P3M) gravity.
+ *
+ * The mesh has meshNx * meshNy nodes at the cell centers of a uniform mesh over the world bounds.
+ * The isolated (non-periodic) potential is the convolution of the node masses with the Green's
+ * function of the simulation's softened kernel, evaluated by FFT on a mesh padded to twice the size
+ * in each direction (Hockney's method):
+ *
+ *   1. pmDeposit        - cloud-in-cell (CIC) mass assignment to the nodes.
+ *   2. fftRadix2        - forward 2D FFT (rows, then columns).
+ *   3. pmConvolve       - multiplication with the transformed Green's function (computed once).
+ *   4. fftRadix2        - inverse 2D FFT -> potential.
+ *   5. pmGradient       - central differences of the potential -> acceleration per node.
+ *   6. pmUpdate         - CIC interpolation of the acceleration (+ short-range P3M near field), integration.
+ *
+ * The mesh buffers hold complex numbers as float2 (x = real, y = imaginary), row-major with row length
+ * paddedNx = 2 * meshNx.
+ *
+ * P3M splits the kernel 1/s (s^2 = r^2 + softening) at the scale a:
+ *   long range  (mesh):             erf(s / a) / s
+ *   short range (exact, 3x3 cells): erfc(s / a) / s
+ * so the short-range force of a pair is the exact force times
+ *   erfc(s / a) + 2 / sqrt(pi) * (s / a) * exp(-(s / a)^2).
+ */
+
+/**
+ * Green's function of the mesh potential, in real space on the padded mesh.
+ * Distances wrap around at half of the padded size, so the circular convolution
+ * of the zero-padded density equals the linear one.
+ *
+ * @param green             (out)        paddedNx * paddedNy complex values (imaginary part 0).
+ * @param paddedNx          (in)         Padded mesh size in X direction.
+ * @param paddedNy          (in)         Padded mesh size in Y direction.
+ * @param meshSizeX         (in)         Mesh cell size in X.
+ * @param meshSizeY         (in)         Mesh cell size in Y.
+ * @param invSplit          (in)         1 / a of the P3M split, 0 = full (unsplit) kernel.
+ * @param softening         (in)         Softening of the kernel (added to r^2).
+ */
+__kernel void pmGreenFunction(
+    __global float2* green,
+    const int paddedNx,
+    const int paddedNy,
+    const float meshSizeX,
+    const float meshSizeY,
+    const float invSplit,
+    const float softening)
+{
+    int node = get_global_id(0);
+    if (node >= paddedNx * paddedNy) return;
+
+    int x = node % paddedNx;
+    int y = node / paddedNx;
+    if (x > paddedNx / 2) x -= paddedNx;
+    if (y > paddedNy / 2) y -= paddedNy;
+
+    float dx = x * meshSizeX;
+    float dy = y * meshSizeY;
+    float s  = sqrt(dx * dx + dy * dy + softening);
+
+    float value = -1.0f / s;
+    if (invSplit > 0.0f)
+        value *= erf(s * invSplit);
+
+    green[node] = (float2)(value, 0.0f);
+}
+
+/**
+ * Cloud-in-cell mass assignment. Positions outside the world are clamped to the outermost nodes.
+ *
+ * @param sortedPosMass     (in)         Cell-sorted particles: x,y = position; z = mass.
+ * @param density           (in/out)     Padded complex mesh; the real parts of the meshNx * meshNy
+ *                                       nodes are accumulated (zeroed by the host before the launch).
+ * @param meshNx            (in)         Number of mesh nodes in X direction.
+ * @param meshNy            (in)         Number of mesh nodes in Y direction.
+ * @param meshInvX          (in)         Inverse mesh cell size in X.
+ * @param meshInvY          (in)         Inverse mesh cell size in Y.
+ * @param worldMinX         (in)         World minimum X coordinate.
+ * @param worldMinY         (in)         World minimum Y coordinate.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void pmDeposit(
+    __global const float4* sortedPosMass,
+    __global float* density,
+    const int meshNx,
+    const int meshNy,
+    const float meshInvX,
+    const float meshInvY,
+    const float worldMinX,
+    const float worldMinY,
+    const int numParticles)
+{
+    int slot = get_global_id(0);
+    if (slot >= numParticles) return;
+
+    float4 particle = sortedPosMass[slot];
+
+    // Mesh coordinates relative to the node centers
+    float u = clamp((particle.x - worldMinX) * meshInvX - 0.5f, 0.0f, (float)(meshNx - 1));
+    float v = clamp((particle.y - worldMinY) * meshInvY - 0.5f, 0.0f, (float)(meshNy - 1));
+
+    int x0 = min((int)u, meshNx - 2);
+    int y0 = min((int)v, meshNy - 2);
+    int x1 = min(x0 + 1, meshNx - 1);
+    int y1 = min(y0 + 1, meshNy - 1);
+    float fx = u - x0;
+    float fy = v - y0;
+
+    int paddedNx = 2 * meshNx;
+    float mass = particle.z;
+    atomicAddGlobalFloat(&density[2 * (x0 + y0 * paddedNx)], mass * (1.0f - fx) * (1.0f - fy));
+    atomicAddGlobalFloat(&density[2 * (x1 + y0 * paddedNx)], mass * fx * (1.0f - fy));
+    atomicAddGlobalFloat(&density[2 * (x0 + y1 * paddedNx)], mass * (1.0f - fx) * fy);
+    atomicAddGlobalFloat(&density[2 * (x1 + y1 * paddedNx)], mass * fx * fy);
+}
+
+/**
+ * One radix-2 pass of a batched Stockham FFT (out of place, log2(n) passes with p = 1, 2, ..., n/2).
+ * Element i of line b is stored at b * lineStride + i * elementStride, so the same kernel
+ * transforms the rows (elementStride = 1) and the columns (lineStride = 1) of a mesh.
+ *
+ * @param src               (in)         Input of the pass.
+ * @param dst               (out)        Output of the pass.
+ * @param n                 (in)         Transform length (power of two).
+ * @param p                 (in)         Size of the sub-transforms already combined.
+ * @param elementStride     (in)         Distance of two consecutive elements of a line.
+ * @param lineStride        (in)         Distance of two consecutive lines.
+ * @param numLines          (in)         Number of lines (batch size).
+ * @param direction         (in)         -1 = forward, +1 = inverse (unscaled).
+ */
+__kernel void fftRadix2(
+    __global const float2* src,
+    __global float2* dst,
+    const int n,
+    const int p,
+    const int elementStride,
+    const int lineStride,
+    const int numLines,
+    const float direction)
+{
+    int id = get_global_id(0);
+    int half = n >> 1;
+    if (id >= half * numLines) return;
+
+    int line = id / half;
+    int i    = id % half;
+    int k    = i & (p - 1);
+
+    __global const float2* in  = src + line * lineStride;
+    __global float2*       out = dst + line * lineStride;
+
+    float2 u0 = in[i * elementStride];
+    float2 u1 = in[(i + half) * elementStride];
+
+    // u1 *= exp(direction * 2 pi i k / (2p))
+    float c;
+    float s = sincos(direction * M_PI_F * (float)k / (float)p, &c);
+    u1 = (float2)(u1.x * c - u1.y * s, u1.x * s + u1.y * c);
+
+    int j = (i << 1) - k;
+    out[j * elementStride]       = u0 + u1;
+    out[(j + p) * elementStride] = u0 - u1;
+}
+
+/**
+ * Pointwise complex multiplication of the transformed density with the transformed Green's function.
+ * 'scale' folds in the 1 / (paddedNx * paddedNy) normalisation of the inverse FFT.
+ */
+__kernel void pmConvolve(
+    __global float2* density,
+    __global const float2* green,
+    const float scale,
+    const int count)
+{
+    int node = get_global_id(0);
+    if (node >= count) return;
+
+    float2 a = density[node];
+    float2 b = green[node];
+    density[node] = (float2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x) * scale;
+}
+
+/**
+ * Acceleration -G * grad(potential) at every mesh node, by central differences
+ * (one-sided at the mesh border).
+ *
+ * @param potential         (in)         Padded complex mesh; the real parts hold the potential.
+ * @param meshAccel         (out)        meshNx * meshNy accelerations.
+ * @param meshNx            (in)         Number of mesh nodes in X direction.
+ * @param meshNy            (in)         Number of mesh nodes in Y direction.
+ * @param meshInvX          (in)         Inverse mesh cell size in X.
+ * @param meshInvY          (in)         Inverse mesh cell size in Y.
+ * @param G                 (in)         Gravitational constant.
+ */
+__kernel void pmGradient(
+    __global const float2* potential,
+    __global float2* meshAccel,
+    const int meshNx,
+    const int meshNy,
+    const float meshInvX,
+    const float meshInvY,
+    const float G)
+{
+    int node = get_global_id(0);
+    if (node >= meshNx * meshNy) return;
+
+    int x = node % meshNx;
+    int y = node / meshNx;
+    int paddedNx = 2 * meshNx;
+
+    int xm = max(x - 1, 0), xp = min(x + 1, meshNx - 1);
+    int ym = max(y - 1, 0), yp = min(y + 1, meshNy - 1);
+
+    float gradX = (potential[xp + y * paddedNx].x - potential[xm + y * paddedNx].x) * meshInvX / (float)max(xp - xm, 1);
+    float gradY = (potential[x + yp * paddedNx].x - potential[x + ym * paddedNx].x) * meshInvY / (float)max(yp - ym, 1);
+
+    meshAccel[node] = -G * (float2)(gradX, gradY);
+}
+
+/**
+ * Updates particle positions and velocities with the mesh force (CIC interpolation, the
+ * same weights as pmDeposit) and, for P3M, the short-range force of the 3x3 cell block.
+ *
+ * @param positions         (in/out)     Global buffer of particle positions.
+ * @param velocities        (in/out)     Global buffer of particle velocities.
+ * @param particleCellIndex (in)         Global buffer of particle's cell index.
+ * @param cellStart         (in)         First sorted slot of each cell.
+ * @param cellEnd           (in)         One past the last sorted slot of each cell.
+ * @param sortedIndex       (in)         Particle id stored at each sorted slot.
+ * @param sortedPosMass     (in)         Cell-sorted particles: x,y = position; z = mass.
+ * @param meshAccel         (in)         Mesh accelerations (pmGradient).
+ * @param meshNx            (in)         Number of mesh nodes in X direction.
+ * @param meshNy            (in)         Number of mesh nodes in Y direction.
+ * @param meshInvX          (in)         Inverse mesh cell size in X.
+ * @param meshInvY          (in)         Inverse mesh cell size in Y.
+ * @param worldMinX         (in)         World minimum X coordinate.
+ * @param worldMinY         (in)         World minimum Y coordinate.
+ * @param gridNx            (in)         Number of cells in X direction.
+ * @param gridNy            (in)         Number of cells in Y direction.
+ * @param invSplit          (in)         1 / a of the P3M split, 0 = PM only (no near field).
+ * @param numParticles      (in)         Number of particles.
+ * @param G                 (in)         Gravitational constant.
+ * @param kickTime          (in)         Time the acceleration is applied to the velocity for.
+ * @param driftTime         (in)         Time the new velocity is applied to the position for.
+ * @param blockSteps        (in)         Non-zero for block timesteps: only the active particles are evaluated and their
+ *                                       acceleration is stored instead of integrated (see timestep.cl).
+ * @param activeParticles   (in)         Block timesteps: ids of the active particles (compactActiveParticles).
+ * @param activeCount       (in)         Block timesteps: number of active particles.
+ * @param accelerations     (out)        Block timesteps: acceleration of each active particle.
+ */
+__kernel void pmUpdate(
+    __global float2* positions,
+    __global float2* velocities,
+    __global const int* particleCellIndex,
+    __global const int* cellStart,
+    __global const int* cellEnd,
+    __global const int* sortedIndex,
+    __global const float4* sortedPosMass,
+    __global const float2* meshAccel,
+    const int meshNx,
+    const int meshNy,
+    const float meshInvX,
+    const float meshInvY,
+    const float worldMinX,
+    const float worldMinY,
+    const int gridNx,
+    const int gridNy,
+    const float invSplit,
+    const int numParticles,
+    const float G,
+    const float kickTime,
+    const float driftTime,
+    const int blockSteps,
+    __global const int* activeParticles,
+    __global const int* activeCount,
+    __global float2* accelerations)
+{
+    // A small factor to prevent forces from becoming infinite during close encounters, improving stability.
+    const float softening = SOFTENING;
+
+    int slot = get_global_id(0);
+    if (slot >= (blockSteps ? activeCount[0] : numParticles)) return;
+    int particleId = blockSteps ? activeParticles[slot] : sortedIndex[slot];
+
+    // Load particle state: position and velocity.
+    float2 position  = positions[particleId];
+    float2 velocity  = velocities[particleId];
+
+    // Long range: CIC interpolation of the mesh acceleration
+    float u = clamp((position.x - worldMinX) * meshInvX - 0.5f, 0.0f, (float)(meshNx - 1));
+    float v = clamp((position.y - worldMinY) * meshInvY - 0.5f, 0.0f, (float)(meshNy - 1));
+
+    int x0 = min((int)u, meshNx - 2);
+    int y0 = min((int)v, meshNy - 2);
+    int x1 = min(x0 + 1, meshNx - 1);
+    int y1 = min(y0 + 1, meshNy - 1);
+    float fx = u - x0;
+    float fy = v - y0;
+
+    float2 totalAcceleration = meshAccel[x0 + y0 * meshNx] * ((1.0f - fx) * (1.0f - fy))
+                             + meshAccel[x1 + y0 * meshNx] * (fx * (1.0f - fy))
+                             + meshAccel[x0 + y1 * meshNx] * ((1.0f - fx) * fy)
+                             + meshAccel[x1 + y1 * meshNx] * (fx * fy);
+
+    // Short range (P3M): exact pair force times the erfc split factor over the 3x3 block
+    if (invSplit > 0.0f) {
+        int myCellIndex = particleCellIndex[particleId];
+        int myCellX     = myCellIndex % GRID_X(gridNx);
+        int myCellY     = myCellIndex / GRID_X(gridNx);
+
+        const float twoOverSqrtPi = 1.12837917f;
+
+        for (int cellY = max(myCellY - 1, 0); cellY <= min(myCellY + 1, GRID_Y(gridNy) - 1); ++cellY) {
+            for (int cellX = max(myCellX - 1, 0); cellX <= min(myCellX + 1, GRID_X(gridNx) - 1); ++cellX) {
+                int neighborCell = cellX + cellY * GRID_X(gridNx);
+                int end          = cellEnd[neighborCell];
+
+                for (int otherSlot = cellStart[neighborCell]; otherSlot < end; ++otherSlot) {
+                    float4 other = sortedPosMass[otherSlot];
+                    float2 vectorToOther = (float2)(other.x, other.y) - position;
+
+                    float distanceSquared = dot(vectorToOther, vectorToOther) + softening;
+                    float invDist = 1.0f / sqrt(distanceSquared);
+                    float scaled  = distanceSquared * invDist * invSplit; // s / a
+                    float split   = erfc(scaled) + twoOverSqrtPi * scaled * exp(-scaled * scaled);
+
+                    totalAcceleration += vectorToOther * ((G * other.z) * invDist * invDist * invDist * split);
+                }
+            }
+        }
+    }
+
+    // Block timesteps: kicked per rung and drifted by the kernels of timestep.cl.
+    if (blockSteps) {
+        accelerations[particleId] = totalAcceleration;
+        return;
+    }
+
+    // Integrate motion: kick the velocity, then drift the position (see Simulation::Step for the integrators).
+    float2 newVelocity = velocity + totalAcceleration * kickTime;
+    float2 newPosition = position + newVelocity * driftTime;
+
+    // Store updated state back to global buffer.
+    positions[particleId]  = newPosition;
+    velocities[particleId] = newVelocity;
+}
@@ -0,0 +1,55 @@
+/**
+ * Space-filling curve reordering of the particle arrays.
+ *
+ * Every few steps the particles are sorted by their Morton code (computeMortonCodes + bitonic
+ * sort of barneshut.cl) and every per-particle array is gathered in that order, so particles
+ * that are close in space are also close in memory and neighbouring work-items of every kernel
+ * read neighbouring cache lines. particleIds keeps the Init index of every slot, so the host can
+ * return the particles in their original order.
+ */
+
+/**
+ * Gathers the per-particle arrays in sorted order into the scratch arrays (copied back by the host).
+ *
+ * @param order             (in)         Sorted particle slots (mortonValues), one per new slot.
+ * @param positions         (in)         Particle positions.
+ * @param velocities        (in)         Particle velocities.
+ * @param masses            (in)         Particle masses.
+ * @param rungs             (in)         Block timestep rung of each particle.
+ * @param stepTimes         (in)         Block timestep state of each particle.
+ * @param particleIds       (in)         Init index of each particle.
+ * @param newPositions      (out)        Reordered positions.
+ * @param newVelocities     (out)        Reordered velocities.
+ * @param newMasses         (out)        Reordered masses.
+ * @param newRungs          (out)        Reordered rungs.
+ * @param newStepTimes      (out)        Reordered block timestep state.
+ * @param newParticleIds    (out)        Reordered Init indices.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void reorderParticles(
+    __global const int* order,
+    __global const float2* positions,
+    __global const float2* velocities,
+    __global const float* masses,
+    __global const int* rungs,
+    __global const float* stepTimes,
+    __global const int* particleIds,
+    __global float2* newPositions,
+    __global float2* newVelocities,
+    __global float* newMasses,
+    __global int* newRungs,
+    __global float* newStepTimes,
+    __global int* newParticleIds,
+    const int numParticles)
+{
+    int slot = get_global_id(0);
+    if (slot >= numParticles) return;
+
+    int pid = order[slot];
+    newPositions[slot]   = positions[pid];
+    newVelocities[slot]  = velocities[pid];
+    newMasses[slot]      = masses[pid];
+    newRungs[slot]       = rungs[pid];
+    newStepTimes[slot]   = stepTimes[pid];
+    newParticleIds[slot] = particleIds[pid];
+}
@@ -0,0 +1,140 @@
+/**
+ * Hierarchical (block) timesteps.
+ *
+ * A step of deltaTime is split into 2^maxRung substeps. A particle on rung r steps with
+ * deltaTime / 2^r, i.e. it starts a new step every 2^(maxRung - r) substeps. With minRung
+ * the coarsest rung starting a step on the current substep, the active particles are the
+ * ones with rung >= minRung.
+ *
+ * Pipeline (one substep):
+ *   1. solver setup over all particles (binning, tree, mesh, ...), as for a global step.
+ *   2. compactActiveParticles   - list of the active particles, in the solver's slot order.
+ *   3. update kernel            - with blockSteps set: forces on the active particles only,
+ *                                 the accelerations are stored instead of integrated.
+ *   4. kickActiveParticles      - next rung from the acceleration and velocity kick.
+ *   5. driftParticles           - every particle drifts by one substep.
+ */
+
+/**
+ * Compacts the ids of the active particles (rung >= minRung) into activeParticles.
+ * Every work-group reserves its range with one global atomic, so the list keeps the slot
+ * order of the solver between work-groups up to the group order. activeCount must be zero
+ * before the launch.
+ *
+ * @param sortedIndex       (in)         Particle id stored at each sorted slot (unused if useSortedIndex == 0).
+ * @param rungs             (in)         Rung of each particle.
+ * @param activeParticles   (out)        Ids of the active particles.
+ * @param activeCount       (in/out)     Number of active particles.
+ * @param groupState        (local)      Two ints: active particles of the group, offset of the group.
+ * @param useSortedIndex    (in)         Non-zero: slot i holds particle sortedIndex[i], otherwise particle i.
+ * @param minRung           (in)         Coarsest active rung of the substep.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void compactActiveParticles(
+    __global const int* sortedIndex,
+    __global const int* rungs,
+    __global int* activeParticles,
+    __global int* activeCount,
+    __local int* groupState,
+    const int useSortedIndex,
+    const int minRung,
+    const int numParticles)
+{
+    int slot = get_global_id(0);
+    int lid  = get_local_id(0);
+
+    if (lid == 0)
+        groupState[0] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int particleId = -1;
+    if (slot < numParticles) {
+        particleId = useSortedIndex ? sortedIndex[slot] : slot;
+        if (rungs[particleId] < minRung)
+            particleId = -1;
+    }
+
+    int localOffset = (particleId >= 0) ? atomic_inc(&groupState[0]) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0)
+        groupState[1] = atomic_add(activeCount, groupState[0]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (particleId >= 0)
+        activeParticles[groupState[1] + localOffset] = particleId;
+}
+
+/**
+ * Picks the next rung of every active particle and kicks its velocity.
+ *
+ * The step criterion is dt = sqrt(2 * eta * epsilon / |a|) (epsilon = softening length), so
+ * the rung is ceil(log2(deltaTime / dt)), clamped to [minRung, maxRung]: a particle may move
+ * to a finer rung on any of its steps, but to a coarser one only if that rung starts a step
+ * on this substep, which keeps all rungs synchronized at the end of the step.
+ *
+ * @param velocities        (in/out)     Global buffer of particle velocities.
+ * @param accelerations     (in)         Acceleration of each active particle (update kernels).
+ * @param activeParticles   (in)         Ids of the active particles.
+ * @param activeCount       (in)         Number of active particles.
+ * @param rungs             (in/out)     Rung of each particle.
+ * @param stepTimes         (in/out)     Leapfrog: step of each particle since its last kick (0 = none).
+ * @param deltaTime         (in)         Step of rung 0.
+ * @param maxRung           (in)         Finest rung.
+ * @param minRung           (in)         Coarsest active rung of the substep.
+ * @param invCriterion      (in)         1 / (2 * eta * epsilon).
+ * @param leapfrog          (in)         Non-zero: kick-drift-kick leapfrog with merged half kicks, otherwise Euler.
+ */
+__kernel void kickActiveParticles(
+    __global float2* velocities,
+    __global const float2* accelerations,
+    __global const int* activeParticles,
+    __global const int* activeCount,
+    __global int* rungs,
+    __global float* stepTimes,
+    const float deltaTime,
+    const int maxRung,
+    const int minRung,
+    const float invCriterion,
+    const int leapfrog)
+{
+    int index = get_global_id(0);
+    if (index >= activeCount[0]) return;
+    int particleId = activeParticles[index];
+
+    float2 acceleration = accelerations[particleId];
+
+    // deltaTime / dt, limited to the finest rung (also catches a zero or non-finite acceleration)
+    float ratio = deltaTime * sqrt(length(acceleration) * invCriterion);
+    ratio = fmin(ratio, (float)(1 << maxRung));
+    int rung = (ratio > 1.0f) ? (int)ceil(log2(ratio)) : 0;
+    rung = clamp(rung, minRung, maxRung);
+
+    // Leapfrog: closing half kick of the previous step + opening half kick of the new one (see IntegrationStages)
+    float step = deltaTime / (float)(1 << rung);
+    float kick = leapfrog ? 0.5f * (stepTimes[particleId] + step) : step;
+
+    velocities[particleId] += acceleration * kick;
+    rungs[particleId]      = rung;
+    stepTimes[particleId]  = leapfrog ? step : 0.0f;
+}
+
+/**
+ * Drifts every particle by one substep.
+ *
+ * @param positions         (in/out)     Global buffer of particle positions.
+ * @param velocities        (in)         Global buffer of particle velocities.
+ * @param driftTime         (in)         Length of the substep.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void driftParticles(
+    __global float2* positions,
+    __global const float2* velocities,
+    const float driftTime,
+    const int numParticles)
+{
+    int pid = get_global_id(0);
+    if (pid >= numParticles) return;
+
+    positions[pid] += velocities[pid] * driftTime;
+}
@@ -0,0 +1,36 @@
+/**
+ * Trajectory output (see Trajectory.h).
+ *
+ * The positions are stored as fixed-point coordinates relative to the cell grid of the configured
+ * world: q = (position - world minimum) * 2^bits / cell size, so q >> bits is the cell and the low
+ * bits are the quantized offset inside it. The host codes the frames as differences of these
+ * integers, which needs them in the same (Init) order in every frame whatever the slot order.
+ */
+
+// Clamp of the quantized coordinates (2^28), keeps the differences of the host coder in 32 bits
+#define QUANTIZED_LIMIT 268435456.0f
+
+/**
+ * Quantizes the particle positions and scatters them to their Init index.
+ *
+ * @param positions         (in)         Particle positions.
+ * @param particleIds       (in)         Init index of each particle.
+ * @param quantized         (out)        Quantized position of every Init index.
+ * @param origin            (in)         World minimum (corner of cell 0).
+ * @param scale             (in)         2^bits / cell size.
+ * @param numParticles      (in)         Number of particles.
+ */
+__kernel void quantizePositions(
+    __global const float2* positions,
+    __global const int* particleIds,
+    __global int2* quantized,
+    const float2 origin,
+    const float2 scale,
+    const int numParticles)
+{
+    int slot = get_global_id(0);
+    if (slot >= numParticles) return;
+
+    float2 q = clamp((positions[slot] - origin) * scale, -QUANTIZED_LIMIT, QUANTIZED_LIMIT);
+    quantized[particleIds[slot]] = convert_int2_sat_rte(q);
+}
@@ -0,0 +1,500 @@
+// Headless runner of the N-body solver.
+//
+// Runs nbody::Simulation on any OpenCL device without a window or a GL-sharing context, e.g.:
+//   nbody_headless --device cpu --particles 100000 --steps 1000 --dist spiral --output final.csv
+// or the grid solver natively on the CPU (nbody::CpuSimulation):
+//   nbody_headless --backend cpu --threads 0 --simd auto --particles 100000 --steps 100
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <Autotuner.h>
+#include <Checkpoint.h>
+#include <CpuSimulation.h>
+#include <ProgramCache.h>
+#include <Simulation.h>
+#include <TraceRecorder.h>
+#include <Trajectory.h>
+
+namespace {
+
+enum class Backend { OpenCL, Cpu };
+
+struct Options {
+  Backend backend = Backend::OpenCL;
+  int cpuThreads = 0;                    // 0 = all hardware threads
+  nbody::SimdLevel simd = nbody::SimdLevel::Auto;
+  std::string platform;                  // substring of the platform name, empty = any
+  cl_device_type deviceType = CL_DEVICE_TYPE_ALL;
+  nbody::SimulationConfig config;
+  nbody::InitialConditionParams initial;
+  int steps = 1000;
+  int reportEvery = 0;                   // 0 = only report at the end
+  float gravityConstant = 0.0001f;
+  float deltaTime = 0.001f;
+  nbody::SolverType solver = nbody::SolverType::Grid;
+  nbody::Integrator integrator = nbody::Integrator::Euler;
+  int maxRung = 0;                       // block timesteps, 0 = off
+  float timestepAccuracy = 0.025f;
+  float theta = 0.5f;
+  int farFieldRadius = 1;
+  int boundsInterval = 0;                // refit the world to the particles every n force evaluations, 0 = fixed
+  int reorderInterval = 0;               // Morton reordering of the particle arrays every n steps, 0 = off
+  float softening = nbody::DefaultSoftening;
+  std::string outputFile;
+  std::string traceFile;                 // Chrome trace JSON, empty = off
+  std::string checkpointFile;            // binary checkpoint of the final state (and every checkpointEvery steps)
+  int checkpointEvery = 0;               // 0 = only at the end
+  std::string restartFile;               // checkpoint to resume from instead of generating the initial conditions
+  std::string trajectoryFile;            // compressed positions every trajectoryEvery steps, empty = off
+  int trajectoryEvery = 10;
+  nbody::TrajectoryOptions trajectory;
+  bool autotune = false;                 // work-group size and grid from the autotuning cache, tuned on a miss
+  bool retune = false;                   // tune even if cached
+  std::string tuneCache = nbody::Autotuner::DefaultCacheFile;
+};
+
+void printUsage(const char* exe) {
+  std::cout
+    << "Usage: " << exe << " [options]\n"
+    << "  --backend <opencl|cpu>  Compute backend (default: opencl; cpu runs the grid solver only)\n"
+    << "  --threads <n>           CPU backend threads, 0 = all (default: 0)\n"
+    << "  --simd <level>          CPU backend: auto | scalar | avx2 | avx512 (default: auto)\n"
+    << "  --platform <name>       OpenCL platform name substring (default: any)\n"
+    << "  --device <cpu|gpu|all>  OpenCL device type (default: all)\n"
+    << "  --particles <n>         Number of particles (default: 20000)\n"
+    << "  --steps <n>             Number of simulation steps (default: 1000)\n"
+    << "  --report <n>            Print progress every n steps (default: 0 = off)\n"
+    << "  --dist <name>           uniform | ring | triangle | gaussian | spiral (default: uniform)\n"
+    << "  --arms <n>              Spiral arms for --dist spiral (default: 2)\n"
+    << "  --seed <n>              Random seed, 0 = random; printed and stored in checkpoints (default: 0)\n"
+    << "  --solver <name>         grid | barnes-hut | fmm | pm | p3m | exact (default: grid)\n"
+    << "  --integrator <name>     euler | leapfrog | yoshida4 (default: euler)\n"
+    << "  --max-rung <n>          Block timesteps: 2^n substeps per step, 0 = off (default: 0)\n"
+    << "  --eta <value>           Block timestep accuracy parameter (default: 0.025)\n"
+    << "  --theta <value>         Barnes-Hut opening angle (default: 0.5)\n"
+    << "  --far-radius <n>        Grid far field pyramid level-selection distance in cells (default: 1)\n"
+    << "  --fit-bounds <n>        Refit the grid to the particles every n force evaluations, 0 = fixed\n"
+    << "                          [-1,1]^2 world (OpenCL grid, barnes-hut and fmm; default: 0)\n"
+    << "  --reorder <n>           Sort the particle arrays by Morton code every n steps, 0 = off (OpenCL; default: 0)\n"
+    << "  --softening <value>     Softening (squared length) of the forces (default: 0.001)\n"
+    << "  --fmm-order <n>         FMM expansion order, 1..8 (default: 4)\n"
+    << "  --pm-mesh <nx> <ny>     PM mesh resolution, powers of two; P3M needs grid cells of at least 3.125 mesh\n"
+    << "                          cells (default: 256 256)\n"
+    << "  --grid <nx> <ny>        Grid resolution (default: 64 64)\n"
+    << "  --local-size <n>        Work-group size (default: 128)\n"
+    << "  --G <value>             Gravitational constant (default: 0.0001)\n"
+    << "  --dt <value>            Time step (default: 0.001)\n"
+    << "  --kernels <dir>         Directory of the .cl sources\n"
+    << "  --program-cache <dir>   Cache compiled program binaries in <dir>, \"\" = off (default: nbody_program_cache)\n"
+    << "  --generic-kernels       Pass grid, work-group size and masses as arguments instead of compiling them in\n"
+    << "  --profile               Print per-kernel device times (OpenCL backend)\n"
+    << "  --autotune              Tuned work-group size and grid for the device (cached, tuned on a miss;\n"
+    << "                          overrides --local-size and --grid)\n"
+    << "  --retune                As --autotune, but tune even if a cached result exists\n"
+    << "  --tune-cache <file>     Autotuning cache file (default: nbody_autotune.txt)\n"
+    << "  --trace <file>          Write a Chrome trace of the steps (and device commands on OpenCL)\n"
+    << "  --checkpoint <file>     Write a binary checkpoint of the final state (OpenCL backend)\n"
+    << "  --checkpoint-every <n>  Also checkpoint every n steps, written in the background (default: 0 = off)\n"
+    << "  --restart <file>        Resume from a checkpoint: its particles, grid, world and step parameters replace\n"
+    << "                          the initial conditions and the corresponding options (--steps more steps are run;\n"
+    << "                          not with --autotune)\n"
+    << "  --trajectory <file>     Stream the positions into a compressed trajectory file (OpenCL backend)\n"
+    << "  --trajectory-every <n>  Steps between trajectory frames (default: 10)\n"
+    << "  --trajectory-bits <n>   Trajectory resolution: cell size / 2^n, 0..20 (default: 12)\n"
+    << "  --keyframe-every <n>    Trajectory frames between keyframes (seek points) (default: 64)\n"
+    << "  --output <file>         Write the final state as CSV (x,y,vx,vy,m)\n";
+}
+
+nbody::Distribution parseDistribution(const std::string& name) {
+  for (int i = 0; i < nbody::DistributionCount; ++i) {
+    const auto distribution = static_cast<nbody::Distribution>(i);
+    if (name == nbody::DistributionName(distribution))
+      return distribution;
+  }
+  throw std::invalid_argument("Unknown distribution: " + name);
+}
+
+nbody::SolverType parseSolver(const std::string& name) {
+  for (int i = 0; i < nbody::SolverCount; ++i) {
+    const auto solver = static_cast<nbody::SolverType>(i);
+    if (name == nbody::SolverName(solver))
+      return solver;
+  }
+  throw std::invalid_argument("Unknown solver: " + name);
+}
+
+nbody::Integrator parseIntegrator(const std::string& name) {
+  for (int i = 0; i < nbody::IntegratorCount; ++i) {
+    const auto integrator = static_cast<nbody::Integrator>(i);
+    if (name == nbody::IntegratorName(integrator))
+      return integrator;
+  }
+  throw std::invalid_argument("Unknown integrator: " + name);
+}
+
+nbody::SimdLevel parseSimdLevel(const std::string& name) {
+  for (int i = 0; i < nbody::SimdLevelCount; ++i) {
+    const auto level = static_cast<nbody::SimdLevel>(i);
+    if (name == nbody::SimdLevelName(level))
+      return level;
+  }
+  throw std::invalid_argument("Unknown SIMD level: " + name);
+}
+
+Backend parseBackend(const std::string& name) {
+  if (name == "opencl") return Backend::OpenCL;
+  if (name == "cpu") return Backend::Cpu;
+  throw std::invalid_argument("Unknown backend: " + name);
+}
+
+cl_device_type parseDeviceType(const std::string& name) {
+  if (name == "cpu") return CL_DEVICE_TYPE_CPU;
+  if (name == "gpu") return CL_DEVICE_TYPE_GPU;
+  if (name == "all") return CL_DEVICE_TYPE_ALL;
+  throw std::invalid_argument("Unknown device type: " + name);
+}
+
+Options parseOptions(int argc, char* argv[]) {
+  Options options;
+  options.config.maxParticles = 0; // derived from --particles
+  options.config.programCacheDirectory = nbody::ProgramCache::DefaultDirectory;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::invalid_argument("Missing value for " + arg);
+      return argv[++i];
+    };
+
+    if (arg == "--help" || arg == "-h") {
+      printUsage(argv[0]);
+      std::exit(EXIT_SUCCESS);
+    }
+    else if (arg == "--backend")    options.backend = parseBackend(next());
+    else if (arg == "--threads")    options.cpuThreads = std::stoi(next());
+    else if (arg == "--simd")       options.simd = parseSimdLevel(next());
+    else if (arg == "--platform")   options.platform = next();
+    else if (arg == "--device")     options.deviceType = parseDeviceType(next());
+    else if (arg == "--particles")  options.initial.numParticles = std::stoi(next());
+    else if (arg == "--steps")      options.steps = std::stoi(next());
+    else if (arg == "--report")     options.reportEvery = std::stoi(next());
+    else if (arg == "--dist")       options.initial.distribution = parseDistribution(next());
+    else if (arg == "--arms")       options.initial.spiralArms = std::stoi(next());
+    else if (arg == "--seed")       options.initial.seed = std::stoull(next());
+    else if (arg == "--solver")     options.solver = parseSolver(next());
+    else if (arg == "--integrator") options.integrator = parseIntegrator(next());
+    else if (arg == "--max-rung")   options.maxRung = std::stoi(next());
+    else if (arg == "--eta")        options.timestepAccuracy = std::stof(next());
+    else if (arg == "--theta")      options.theta = std::stof(next());
+    else if (arg == "--far-radius") options.farFieldRadius = std::stoi(next());
+    else if (arg == "--fit-bounds") options.boundsInterval = std::stoi(next());
+    else if (arg == "--reorder")    options.reorderInterval = std::stoi(next());
+    else if (arg == "--softening")  options.softening = std::stof(next());
+    else if (arg == "--fmm-order")  options.config.fmmOrder = std::stoi(next());
+    else if (arg == "--pm-mesh") {
+      options.config.pmMeshNx = std::stoi(next());
+      options.config.pmMeshNy = std::stoi(next());
+    }
+    else if (arg == "--grid") {
+      options.config.gridNx = std::stoi(next());
+      options.config.gridNy = std::stoi(next());
+    }
+    else if (arg == "--local-size") options.config.localSize = std::stoul(next());
+    else if (arg == "--G")          options.gravityConstant = std::stof(next());
+    else if (arg == "--dt")         options.deltaTime = std::stof(next());
+    else if (arg == "--kernels")    options.config.kernelDirectory = next();
+    else if (arg == "--program-cache") options.config.programCacheDirectory = next();
+    else if (arg == "--generic-kernels") options.config.specializeKernels = false;
+    else if (arg == "--profile")    options.config.profiling = true;
+    else if (arg == "--autotune")   options.autotune = true;
+    else if (arg == "--retune")     options.autotune = options.retune = true;
+    else if (arg == "--tune-cache") options.tuneCache = next();
+    else if (arg == "--output")     options.outputFile = next();
+    else if (arg == "--trace")      options.traceFile = next();
+    else if (arg == "--checkpoint") options.checkpointFile = next();
+    else if (arg == "--checkpoint-every") options.checkpointEvery = std::stoi(next());
+    else if (arg == "--restart")    options.restartFile = next();
+    else if (arg == "--trajectory") options.trajectoryFile = next();
+    else if (arg == "--trajectory-every") options.trajectoryEvery = std::stoi(next());
+    else if (arg == "--trajectory-bits") options.trajectory.quantizationBits = std::stoi(next());
+    else if (arg == "--keyframe-every") options.trajectory.keyframeInterval = std::stoi(next());
+    else
+      throw std::invalid_argument("Unknown option: " + arg);
+  }
+
+  if (options.initial.numParticles <= 0)
+    throw std::invalid_argument("--particles must be positive");
+
+  if (options.solver == nbody::SolverType::P3M && !options.autotune && !nbody::SupportsP3M(options.config))
+    throw std::invalid_argument("--solver p3m needs grid cells of at least 3.125 PM mesh cells: use a coarser --grid "
+                                "or a finer --pm-mesh");
+  if (options.backend == Backend::Cpu && options.solver != nbody::SolverType::Grid)
+    throw std::invalid_argument("The CPU backend implements the grid solver only");
+  if (options.backend == Backend::Cpu && options.autotune)
+    throw std::invalid_argument("Autotuning needs the OpenCL backend");
+  if (options.backend == Backend::Cpu && options.maxRung > 0)
+    throw std::invalid_argument("The CPU backend does not implement block timesteps");
+  if (options.backend == Backend::Cpu && (!options.checkpointFile.empty() || !options.restartFile.empty()))
+    throw std::invalid_argument("Checkpoints need the OpenCL backend");
+  if (options.autotune && !options.restartFile.empty())
+    throw std::invalid_argument("--autotune cannot be combined with --restart: the checkpoint sets the solver, particle "
+                                "count and grid, pass --local-size instead");
+  if (options.checkpointEvery > 0 && options.checkpointFile.empty())
+    throw std::invalid_argument("--checkpoint-every needs --checkpoint");
+  if (options.backend == Backend::Cpu && !options.trajectoryFile.empty())
+    throw std::invalid_argument("Trajectories need the OpenCL backend");
+  if (options.trajectoryEvery <= 0)
+    throw std::invalid_argument("--trajectory-every must be positive");
+  if (options.backend == Backend::Cpu && options.reorderInterval > 0)
+    throw std::invalid_argument("The CPU backend does not reorder the particles");
+  if (options.backend == Backend::Cpu && options.boundsInterval > 0)
+    throw std::invalid_argument("The CPU backend uses the fixed world");
+  if (options.backend == Backend::Cpu && options.softening != nbody::DefaultSoftening)
+    throw std::invalid_argument("The CPU backend uses the default softening");
+  if (options.maxRung < 0 || options.maxRung > nbody::MaxRung)
+    throw std::invalid_argument("--max-rung must be in [0, " + std::to_string(nbody::MaxRung) + "]");
+  options.config.maxParticles = options.initial.numParticles;
+  if (!options.traceFile.empty())
+    options.config.profiling = true; // device commands need the profiling queue
+  // The seed of the run, stored in its checkpoints
+  options.initial.seed = nbody::ResolveSeed(options.initial.seed);
+  return options;
+}
+
+void writeCsv(const std::string& fileName, const nbody::ParticleState& state) {
+  std::ofstream out(fileName);
+  if (!out)
+    throw std::runtime_error("Failed to open output file: " + fileName);
+
+  out << "x,y,vx,vy,m\n";
+  for (size_t i = 0; i < state.size(); ++i) {
+    out << state.positions[i].x << ',' << state.positions[i].y << ','
+        << state.velocities[i].x << ',' << state.velocities[i].y << ','
+        << state.masses[i] << '\n';
+  }
+}
+
+void printProfile(const nbody::DeviceProfiler& profiler) {
+  const auto allStats = profiler.GetStats();
+  double totalMs = 0.0;
+  for (const auto& stats : allStats)
+    totalMs += stats.totalMs;
+
+  std::cout << "Device time per kernel (min/avg/p95 of the last calls):\n"
+            << std::left << std::setw(28) << "  kernel" << std::right
+            << std::setw(10) << "calls" << std::setw(12) << "min ms" << std::setw(12) << "avg ms"
+            << std::setw(12) << "p95 ms" << std::setw(12) << "total ms" << std::setw(8) << "share" << '\n';
+  for (const auto& stats : allStats) {
+    std::cout << "  " << std::left << std::setw(26) << stats.name << std::right << std::fixed << std::setprecision(4)
+              << std::setw(10) << stats.calls << std::setw(12) << stats.minMs << std::setw(12) << stats.avgMs
+              << std::setw(12) << stats.p95Ms << std::setw(12) << stats.totalMs
+              << std::setw(7) << std::setprecision(1) << (totalMs > 0.0 ? 100.0 * stats.totalMs / totalMs : 0.0) << "%\n";
+  }
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+// Steps a configured and initialized simulation (nbody::Simulation or nbody::CpuSimulation) and writes the output.
+template <typename SimulationType>
+void run(SimulationType& simulation, const Options& options, nbody::TraceRecorder& tracer) {
+  std::cout << "Particles: " << simulation.GetNumParticles()
+            << ", distribution: " << nbody::DistributionName(options.initial.distribution)
+            << ", solver: " << nbody::SolverName(options.solver)
+            << ", integrator: " << nbody::IntegratorName(options.integrator)
+            << ", seed: " << options.initial.seed
+            << ", steps: " << options.steps << '\n';
+
+  using Clock = std::chrono::steady_clock;
+  const auto start = Clock::now();
+
+  // Batches end on the report, checkpoint and trajectory steps
+  constexpr bool deviceOutput = std::is_same_v<SimulationType, nbody::Simulation>;
+  [[maybe_unused]] nbody::CheckpointWriter checkpointWriter;
+  std::unique_ptr<nbody::TrajectoryWriter> trajectory;
+  if constexpr (deviceOutput) {
+    if (!options.trajectoryFile.empty()) {
+      trajectory = std::make_unique<nbody::TrajectoryWriter>(simulation, options.trajectoryFile, options.trajectory);
+      trajectory->Capture(); // initial state
+    }
+  }
+  const int batch = options.reportEvery > 0 ? options.reportEvery : options.steps;
+  for (int done = 0; done < options.steps; ) {
+    int count = std::min(batch - done % batch, options.steps - done);
+    if (options.checkpointEvery > 0)
+      count = std::min(count, options.checkpointEvery - done % options.checkpointEvery);
+    if (trajectory)
+      count = std::min(count, options.trajectoryEvery - done % options.trajectoryEvery);
+    {
+      nbody::TraceRecorder::Scope scope(tracer, "Step");
+      simulation.Step(count);
+    }
+    done += count;
+
+    const bool report = options.reportEvery > 0 && (done % options.reportEvery == 0 || done == options.steps);
+    const bool checkpoint = options.checkpointEvery > 0 && done % options.checkpointEvery == 0 && done < options.steps;
+    const bool frame = trajectory && done % options.trajectoryEvery == 0;
+
+    // A batch that only ends on a trajectory frame does not wait for the device: the frame is read back asynchronously
+    if (!frame || report || checkpoint || done == options.steps) {
+      nbody::TraceRecorder::Scope scope(tracer, "Finish");
+      simulation.Finish();
+    }
+
+    if (report) {
+      const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+      std::cout << "step " << done << " / " << options.steps << " (" << elapsed << " s)\n";
+    }
+    if constexpr (deviceOutput) {
+      if (frame) {
+        nbody::TraceRecorder::Scope scope(tracer, "Trajectory");
+        trajectory->Capture();
+      }
+      if (checkpoint) {
+        nbody::TraceRecorder::Scope scope(tracer, "Checkpoint");
+        checkpointWriter.Save(simulation, options.checkpointFile, options.initial.seed);
+      }
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  std::cout << "Elapsed: " << seconds << " s, "
+            << (seconds > 0.0 ? options.steps / seconds : 0.0) << " steps/s\n";
+
+  if (tracer.IsRecording()) {
+    tracer.Stop();
+    tracer.Save(options.traceFile);
+    std::cout << "Trace (" << tracer.GetEventCount() << " events) written to " << options.traceFile << '\n';
+  }
+
+  if (trajectory) {
+    trajectory->Close();
+    const double bytesPerParticle = static_cast<double>(trajectory->GetBytesWritten())
+      / (static_cast<double>(trajectory->GetFrameCount()) * simulation.GetNumParticles());
+    std::cout << "Trajectory (" << trajectory->GetFrameCount() << " frames, " << bytesPerParticle
+              << " bytes per particle and frame, " << trajectory->GetStalls() << " stalls) written to "
+              << options.trajectoryFile << '\n';
+  }
+
+  if constexpr (deviceOutput) {
+    if (!options.checkpointFile.empty()) {
+      checkpointWriter.Save(simulation, options.checkpointFile, options.initial.seed);
+      checkpointWriter.Wait();
+      std::cout << "Checkpoint of step " << simulation.GetStepCount() << " written to " << options.checkpointFile << '\n';
+    }
+  }
+
+  if (!options.outputFile.empty()) {
+    nbody::ParticleState state;
+    simulation.ReadState(state);
+    writeCsv(options.outputFile, state);
+    std::cout << "Final state written to " << options.outputFile << '\n';
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    const Options options = parseOptions(argc, argv);
+
+    // The whole run is one capture; Finish collects the device commands of every batch
+    nbody::TraceRecorder tracer;
+    if (!options.traceFile.empty())
+      tracer.Start();
+
+    if (options.backend == Backend::Cpu) {
+      nbody::CpuSimulation simulation(options.config, options.cpuThreads, options.simd);
+      simulation.SetGravityConstant(options.gravityConstant);
+      simulation.SetTimeStep(options.deltaTime);
+      simulation.SetFarFieldRadius(options.farFieldRadius);
+      simulation.SetIntegrator(options.integrator);
+      simulation.Init(nbody::GenerateInitialConditions(options.initial));
+
+      std::cout << "Using CPU backend: " << simulation.GetNumThreads() << " threads, "
+                << nbody::SimdLevelName(simulation.GetSimdLevel()) << '\n';
+      run(simulation, options, tracer);
+      return EXIT_SUCCESS;
+    }
+
+    cl::Context context;
+    if (!oclCreateContextBy(context, options.platform, options.deviceType))
+      throw cl::Error(CL_DEVICE_NOT_FOUND, "Failed to create an OpenCL context for the requested platform/device");
+
+    const auto device = context.getInfo<CL_CONTEXT_DEVICES>().front();
+    std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << '\n';
+
+    // A restart takes the grid and world of the checkpoint; the mapping is released once the particles are uploaded
+    Options runOptions = options;
+    std::unique_ptr<nbody::CheckpointFile> checkpoint;
+    if (!options.restartFile.empty()) {
+      checkpoint = std::make_unique<nbody::CheckpointFile>(options.restartFile);
+      runOptions.solver = checkpoint->GetInfo().solver;
+      runOptions.integrator = checkpoint->GetInfo().integrator;
+      runOptions.initial.seed = checkpoint->GetInfo().seed;
+    }
+
+    nbody::SimulationConfig config = options.config;
+    if (options.autotune) {
+      nbody::Autotuner tuner(context, device, options.tuneCache);
+      nbody::Autotuner::Result tuned;
+      const bool cached = !options.retune && tuner.Lookup(config, options.solver, options.initial.numParticles, tuned);
+      if (!cached) {
+        std::cout << "Autotuning " << nbody::SolverName(options.solver) << " for " << options.initial.numParticles << " particles...\n";
+        tuned = tuner.Tune(config, options.solver, options.initial);
+      }
+      nbody::Autotuner::Apply(tuned, config);
+      std::cout << "Work-group size " << tuned.localSize << ", grid " << tuned.gridNx << "x" << tuned.gridNy
+                << " (" << tuned.stepMs << " ms per step" << (cached ? ", cached" : "") << ")\n";
+    }
+    if (checkpoint)
+      nbody::ApplyCheckpointConfig(checkpoint->GetInfo(), config);
+
+    nbody::Simulation simulation(context, device, config);
+    simulation.GetProfiler().SetTracer(&tracer);
+    simulation.SetGravityConstant(options.gravityConstant);
+    simulation.SetTimeStep(options.deltaTime);
+    simulation.SetSolver(options.solver);
+    simulation.SetIntegrator(options.integrator);
+    simulation.SetMaxRung(options.maxRung);
+    simulation.SetTimestepAccuracy(options.timestepAccuracy);
+    simulation.SetTheta(options.theta);
+    simulation.SetFarFieldRadius(options.farFieldRadius);
+    simulation.SetBoundsInterval(options.boundsInterval);
+    simulation.SetReorderInterval(options.reorderInterval);
+    simulation.SetSoftening(options.softening);
+    if (checkpoint) {
+      const auto loadStart = std::chrono::steady_clock::now();
+      checkpoint->Restore(simulation);
+      const double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+      std::cout << "Resumed step " << simulation.GetStepCount() << " (t = " << simulation.GetSimulatedTime() << ") from "
+                << options.restartFile << " in " << loadMs << " ms\n";
+      checkpoint.reset();
+    }
+    else {
+      simulation.Init(nbody::GenerateInitialConditions(options.initial));
+    }
+    run(simulation, runOptions, tracer);
+
+    if (simulation.IsProfiling())
+      printProfile(simulation.GetProfiler());
+  }
+  catch (const cl::Error& e) {
+    std::cerr << "OpenCL Error (" << e.err() << " - " << oclErrorString(e.err()) << "): " << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+  catch (const std::exception& e) {
+    std::cerr << "A fatal error occurred: " << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#include "GLInteropAdapter.h"
+
+#include <string>
+
+GLInteropAdapter::GLInteropAdapter(nbody::Simulation& simulation_, const std::vector<GLuint>& vbos)
+	: simulation(&simulation_)
+{
+	// Shared GL/CL buffers
+	for (GLuint vbo : vbos)
+		slots.push_back({ cl::BufferGL(simulation->GetContext(), CL_MEM_WRITE_ONLY, vbo), nullptr });
+
+	// GL fences as CL events, if the device can wait for them itself
+	const cl::Device& device = simulation->GetDevice();
+	if (device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_gl_event") != std::string::npos) {
+		const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+		createEventFromGLsync = reinterpret_cast<CreateEventFromGLsyncFn>(
+			clGetExtensionFunctionAddressForPlatform(platform(), "clCreateEventFromGLsyncKHR"));
+	}
+}
+
+cl::Event GLInteropAdapter::Publish(size_t index) {
+	if (!simulation || simulation->GetNumParticles() == 0)
+		return {};
+
+	Slot& slot = slots.at(index);
+	auto& queue = simulation->GetQueue();
+
+	// The GL commands reading the VBO must be complete before CL writes it. The fence stays alive until
+	// the next FenceDraw, by which time the viewer has waited for this release (and so for the acquire).
+	std::vector<cl::Event> drawDone;
+	if (slot.drawFence) {
+		if (createEventFromGLsync) {
+			cl_int error = CL_SUCCESS;
+			const cl_event event = createEventFromGLsync(simulation->GetContext()(), slot.drawFence.get(), &error);
+			if (error != CL_SUCCESS)
+				throw cl::Error(error, "clCreateEventFromGLsyncKHR");
+			drawDone.emplace_back(event);
+		}
+		else {
+			glClientWaitSync(slot.drawFence.get(), GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		}
+	}
+
+	std::vector<cl::Memory> glObjects{ slot.buffer };
+	cl::Event acquired, released;
+	queue.enqueueAcquireGLObjects(&glObjects, drawDone.empty() ? nullptr : &drawDone, &acquired);
+	if (simulation->IsProfiling())
+		simulation->GetProfiler().Record("acquireGLObjects", acquired);
+
+	simulation->EnqueuePackRenderVertices(slot.buffer);
+
+	queue.enqueueReleaseGLObjects(&glObjects, nullptr, &released);
+	if (simulation->IsProfiling())
+		simulation->GetProfiler().Record("releaseGLObjects", released);
+	return released;
+}
+
+void GLInteropAdapter::FenceDraw(size_t index) {
+	slots.at(index).drawFence.reset(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// GLEW
+#include <GL/glew.h>
+
+// OpenCL
+#include <CL/opencl.hpp>
+
+#include <vector>
+
+#include <Simulation.h>
+#include <oglutils.hpp>
+
+/**
+ * Publishes the state of a headless nbody::Simulation into OpenGL vertex buffers.
+ *
+ * The simulation keeps its state in plain cl::Buffer objects; this adapter wraps a ring of VBOs as shared
+ * cl::BufferGL objects and packs the particles into one of them (nbody::RenderVertexSize bytes each) on the
+ * simulation's queue. With more than one VBO the viewer can draw the buffer packed in the previous frame while
+ * the device packs the next one, so no frame has to wait for the queue to drain. It requires the simulation to
+ * run on a CL context created from the current GL context.
+ */
+class GLInteropAdapter {
+public:
+	GLInteropAdapter() = default;
+	GLInteropAdapter(nbody::Simulation& simulation, const std::vector<GLuint>& vbos);
+
+	// Enqueues acquire -> packing of the particle state -> release into VBO 'index' and returns the event of the
+	// release (empty without particles). Does not wait for completion. The acquire waits for the GL commands
+	// fenced by FenceDraw: on the device through cl_khr_gl_event when the device supports it, otherwise on the host.
+	// Call it once per drawn frame, not per simulation step.
+	cl::Event Publish(size_t index = 0);
+
+	// Fences the GL commands issued so far as the last readers of VBO 'index'. The fence is flushed by the
+	// buffer swap at the latest, before the next Publish into the same VBO.
+	void FenceDraw(size_t index);
+
+	size_t GetBufferCount() const { return slots.size(); }
+	bool   HasGLEvents() const { return createEventFromGLsync != nullptr; }
+
+private:
+	struct Slot {
+		cl::BufferGL buffer;
+		UniqueGlSync drawFence;
+	};
+
+	using CreateEventFromGLsyncFn = cl_event (CL_API_CALL*)(cl_context, cl_GLsync, cl_int*);
+
+	nbody::Simulation*      simulation = nullptr;
+	std::vector<Slot>       slots;
+	CreateEventFromGLsyncFn createEventFromGLsync = nullptr; // cl_khr_gl_event
+};
@@ -1,16 +1,16 @@
 #include "MyApp.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <ctime>
 #include <deque>
 #include <filesystem>
 #include <numeric>
-#include <random>
 
 #include <imgui.h>
 
-enum class AssetType { Asset, Kernel, Shader };
+enum class AssetType { Asset, Shader };
 
 namespace {
 	const std::filesystem::path rootPath = "../../../src/opencl_06_opengl_nbody";
@@ -21,8 +21,6 @@ namespace {
 
 		if constexpr (T == AssetType::Asset)
 			result = rootPath / "assets" / filename;
-		else if constexpr (T == AssetType::Kernel)
-			result = rootPath / "kernels" / filename;
 		else if constexpr (T == AssetType::Shader)
 			result = rootPath / "shaders" / filename;
 		else
@@ -49,35 +47,50 @@ namespace {
 		if (buffer.empty()) return 0.0f;
 		return std::accumulate(buffer.begin(), buffer.end(), 0.0f) / buffer.size();
 	}
+
+	// Packed vertices (see nbody::Simulation::EnqueuePackRenderVertices): half2 position, normalized speed byte
+	void SetupParticleVertexArray(GLuint vao, GLuint vbo) {
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo); // Attach VBO to VAO
+		glVertexAttribPointer(0, 2, GL_HALF_FLOAT, GL_FALSE, nbody::RenderVertexSize, (void*)0);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 1, GL_UNSIGNED_BYTE, GL_TRUE, nbody::RenderVertexSize, (void*)4);
+		glEnableVertexAttribArray(1);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
 }
 
 MyApp::MyApp() = default;
-MyApp::~MyApp() = default;
+MyApp::~MyApp() {
+	// Pending frames report their completion into renderFrames
+	if (simulation)
+		simulation->Finish();
+}
 
 void MyApp::InitGL() {
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-	// Create vertex buffer for particles
-	vbo = createBuffer();
-	glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-	glBufferData(GL_ARRAY_BUFFER, maxParticles * sizeof(glm::vec4), nullptr, GL_DYNAMIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create vertex array object to handle vertex properties during rendering
-	vao = createVertexArray();
-	glBindVertexArray(*vao);
-	glBindBuffer(GL_ARRAY_BUFFER, *vbo); // Attach VBO to VAO
-	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)0);
-	glEnableVertexAttribArray(0);
-	glBindVertexArray(0);
+	for (int i = 0; i < RenderBufferCount; ++i) {
+		// Create vertex buffer for particles
+		vbos[i] = createBuffer();
+		glBindBuffer(GL_ARRAY_BUFFER, *vbos[i]);
+		glBufferData(GL_ARRAY_BUFFER, maxParticles * nbody::RenderVertexSize, nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		// Create vertex array object to handle vertex properties during rendering
+		vaos[i] = createVertexArray();
+		SetupParticleVertexArray(*vaos[i], *vbos[i]);
+	}
 
 	// Setup particle shader
 	shaderProgram.AttachShader(GL_VERTEX_SHADER, PathTo<AssetType::Shader>("particle.vert"));
 	shaderProgram.AttachShader(GL_GEOMETRY_SHADER, PathTo<AssetType::Shader>("particle.geom"));
 	shaderProgram.AttachShader(GL_FRAGMENT_SHADER, PathTo<AssetType::Shader>("particle.frag"));
 	shaderProgram.BindAttribLoc(0, "vs_in_pos");
+	shaderProgram.BindAttribLoc(1, "vs_in_speed");
 	if (!shaderProgram.LinkProgram())
 		throw std::runtime_error("Failed to Link shader program.");
 
@@ -99,191 +112,318 @@ void MyApp::InitCL() {
 		throw cl::Error(CL_INVALID_CONTEXT, "Failed to create shared CL/GL context");
 
 	const auto devices = context.getInfo<CL_CONTEXT_DEVICES>();
-	auto device = devices.front();
+	device = devices.front();
 	std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << '\n';
-	queue = cl::CommandQueue(context, device);
 
-	// Build OpenCL program
-	const auto sourceCode = oclReadSourcesFromFile(PathTo<AssetType::Kernel>("GLinterop.cl"));
-	program = cl::Program(context, sourceCode);
-	try {
-		program.build(devices);
-	}
-	catch (const cl::Error&) {
-		for (auto&& [dev, log] : program.getBuildInfo<CL_PROGRAM_BUILD_LOG>())
-			std::cerr << "Build log for " << dev.getInfo<CL_DEVICE_NAME>() << ":\n" << log << "\n";
-		throw;
-	}
-	// Init kernels
-	kernelCellIndex = cl::Kernel(program, "computeParticleCellIndex");
-	kernelComputeCOM = cl::Kernel(program, "computeCellCOM");
-	kernelUpdate = cl::Kernel(program, "update");
-
-	// Shared GL/CL buffer
-	clVboBuffer = cl::BufferGL(context, CL_MEM_WRITE_ONLY, *vbo);
-	clMasses = cl::Buffer(context, CL_MEM_READ_WRITE, maxParticles * sizeof(float));
-
-	// Init Grid + COM buffers
-	clParticleCellIndex = cl::Buffer(context, CL_MEM_READ_WRITE, maxParticles * sizeof(int));
-	clCellCOM = cl::Buffer(context, CL_MEM_READ_WRITE, gridNx * gridNy * sizeof(glm::vec2));
-	clCellMass = cl::Buffer(context, CL_MEM_READ_WRITE, gridNx * gridNy * sizeof(float));
-
-	// Set kernel arguments
-
-	kernelCellIndex.setArg(0, clVboBuffer);
-	kernelCellIndex.setArg(1, clParticleCellIndex);
-	kernelCellIndex.setArg(2, gridNx);
-	kernelCellIndex.setArg(3, gridNy);
-	kernelCellIndex.setArg(4, cellSizeInvX);
-	kernelCellIndex.setArg(5, cellSizeInvY);
-	kernelCellIndex.setArg(6, worldMinX);
-	kernelCellIndex.setArg(7, worldMinY);
-	kernelCellIndex.setArg(8, currentNumParticles);
-
-	kernelComputeCOM.setArg(0, clVboBuffer);
-	kernelComputeCOM.setArg(1, clMasses);
-	kernelComputeCOM.setArg(2, clParticleCellIndex);
-	kernelComputeCOM.setArg(3, clCellMass);
-	kernelComputeCOM.setArg(4, clCellCOM);
-	kernelComputeCOM.setArg(5, currentNumParticles);
-	kernelComputeCOM.setArg(6, totalCells);
-	kernelComputeCOM.setArg(7, cl::Local(localSize * sizeof(float)));
-	kernelComputeCOM.setArg(8, cl::Local(localSize * sizeof(float)));
-	kernelComputeCOM.setArg(9, cl::Local(localSize * sizeof(float)));
-
-	kernelUpdate.setArg(0, clVboBuffer);
-	kernelUpdate.setArg(1, clMasses);
-	kernelUpdate.setArg(2, clParticleCellIndex);
-	kernelUpdate.setArg(3, clCellMass);
-	kernelUpdate.setArg(4, clCellCOM);
-	kernelUpdate.setArg(5, gridNx);
-	kernelUpdate.setArg(6, gridNy);
-	kernelUpdate.setArg(7, totalCells);
-	kernelUpdate.setArg(8, currentNumParticles);
-
-	ResetSimulation();
+	nbody::SimulationConfig config;
+	config.maxParticles = maxParticles;
+	config.profiling = true;
+	config.programCacheDirectory = nbody::ProgramCache::DefaultDirectory;
+
+	// Tuned configuration of this device for the initial solver and particle count, if it has been tuned before
+	const auto solver = static_cast<nbody::SolverType>(solverType);
+	nbody::Autotuner tuner(context, device);
+	nbody::Autotuner::Result tuned;
+	if (tuner.Lookup(config, solver, numParticles, tuned))
+		nbody::Autotuner::Apply(tuned, config);
+
+	CreateSimulation(config);
+	std::cout << "GL/CL sync: " << (interop.HasGLEvents() ? "cl_khr_gl_event" : "host fence wait") << '\n';
+}
+
+void MyApp::CreateSimulation(const nbody::SimulationConfig& config, bool reset) {
+	// The frames in flight and the interop buffers refer to the old simulation
+	if (simulation)
+		ClearRenderFrames();
+	interop = GLInteropAdapter();
+
+	simulation = std::make_unique<nbody::Simulation>(context, device, config);
+	simulation->GetProfiler().SetTracer(&tracer);
+
+	// Shared GL/CL buffers
+	std::vector<GLuint> vboNames;
+	for (const auto& vbo : vbos)
+		vboNames.push_back(*vbo);
+	interop = GLInteropAdapter(*simulation, vboNames);
+
+	tuningStatus = "Work-group size " + std::to_string(config.localSize) + ", grid "
+		+ std::to_string(config.gridNx) + "x" + std::to_string(config.gridNy);
+	if (reset)
+		ResetSimulation();
+}
+
+void MyApp::Autotune() {
+	nbody::SimulationConfig config = simulation->GetConfig();
+	const auto solver = static_cast<nbody::SolverType>(solverType);
+
+	nbody::InitialConditionParams params;
+	params.numParticles = numParticles;
+	params.distribution = static_cast<nbody::Distribution>(initDistribution);
+	params.spiralArms = spiralArms;
+	params.useRandomVelocities = useRandomVelocities;
+
+	// Blocks for a few seconds: every candidate builds its own simulation. The device is drained first so the
+	// frames in flight do not skew the timings.
+	ClearRenderFrames();
+	nbody::Autotuner tuner(context, device);
+	const auto tuned = tuner.Tune(config, solver, params);
+	nbody::Autotuner::Apply(tuned, config);
+	CreateSimulation(config);
+	std::cout << "Autotuned " << nbody::SolverName(solver) << " for " << numParticles << " particles: " << tuningStatus
+		<< " (" << tuned.stepMs << " ms per step)\n";
 }
 
 void MyApp::ResetSimulation() {
+	nbody::TraceRecorder::Scope scope(tracer, "ResetSimulation");
 	currentNumParticles = numParticles;
-	// Initialize particle data
-	std::vector<float> masses(currentNumParticles, 1.f);
-	queue.enqueueWriteBuffer(clMasses, CL_TRUE, 0, masses.size() * sizeof(float), masses.data());
-
-	std::vector<glm::vec2> velocities(currentNumParticles, glm::vec2{});
-	if (useRandomVelocities)
-		for (size_t i = 0; i < velocities.size(); i += 2) {
-			double angle = i / double(velocities.size() / 2) * (2 * M_PI);
-			velocities[i].x = static_cast<float>(-std::cos(angle) * 1.7);
-			velocities[i].y = static_cast<float>(std::sin(angle) * 1.7);
-		}
 
-	// Initialize positions
-	std::vector<glm::vec2> positions(currentNumParticles);
-	std::mt19937 rng(std::random_device{}());
-	switch (initDistribution) {
-	default:
-	case 0: {
-		std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
-		std::generate(positions.begin(), positions.end(), [&] { return glm::vec2{ dist(rng), dist(rng) }; });
-		break;
-	}
-	case 1: {
-		for (int i = 0; i < currentNumParticles; ++i) {
-			float angle = (static_cast<float>(i) / currentNumParticles) * 2.0f * M_PI;
-			float r = 0.25f;
-			positions[i] = glm::vec2(r * std::sin(angle), r * std::cos(angle));
-		}
-		break;
-	}
-	case 2: {
-		glm::vec2 A(-0.6f, -0.5f);
-		glm::vec2 B(0.6f, -0.5f);
-		glm::vec2 C(0.0f, 0.6f);
+	nbody::InitialConditionParams params;
+	params.numParticles = currentNumParticles;
+	params.seed = initialSeed = nbody::ResolveSeed(0); // new conditions every reset, recorded in the checkpoints
+	params.distribution = static_cast<nbody::Distribution>(initDistribution);
+	params.spiralArms = spiralArms;
+	params.useRandomVelocities = useRandomVelocities;
+	simulation->SetSoftening(softening); // Init builds its program variant
+	simulation->Init(nbody::GenerateInitialConditions(params));
+}
 
-		std::uniform_real_distribution<float> dist01(0.0f, 1.0f);
+void MyApp::Update(const UpdateInfo& info) {
+	if (replay) {
+		UpdateReplay(info);
+		addSample(frameTimes, info.deltaTimeSec * 1000);
+		return;
+	}
 
-		for (int i = 0; i < currentNumParticles; ++i) {
-			float u = dist01(rng);
-			float v = dist01(rng);
-			if (u + v > 1.0f) {
-				u = 1.0f - u;
-				v = 1.0f - v;
-			}
-			glm::vec2 P = A + u * (B - A) + v * (C - A);
-			positions[i] = P;
-		}
-		break;
-	}
-	case 3: {
-		std::normal_distribution<float> gauss(0.0f, 0.25f);
-		for (int i = 0; i < currentNumParticles; ++i) {
-			float x = gauss(rng);
-			float y = gauss(rng);
-			positions[i] = glm::vec2(x, y);
-		}
-		break;
-		break;
+	if (!simulation_paused) {
+		// P3M is only offered on a grid coarse enough for its mesh (e.g. not on a finer autotuned grid)
+		if (solverType == static_cast<int>(nbody::SolverType::P3M) && !nbody::SupportsP3M(simulation->GetConfig()))
+			solverType = static_cast<int>(nbody::SolverType::PM);
+		float deltaTime = std::clamp(info.deltaTimeSec, 0.0000001f, maxTimeStep);
+		simulation->SetGravityConstant(gravityConstant);
+		simulation->SetTimeStep(deltaTime);
+		simulation->SetSolver(static_cast<nbody::SolverType>(solverType));
+		simulation->SetTheta(theta);
+		simulation->SetFarFieldRadius(farFieldRadius);
+		simulation->SetBoundsInterval(fitBounds ? boundsInterval : 0);
+		simulation->SetReorderInterval(reorderInterval);
+		simulation->SetIntegrator(static_cast<nbody::Integrator>(integratorType));
+		simulation->SetMaxRung(maxRung);
+		simulation->SetTimestepAccuracy(timestepAccuracy);
+		simulation->SetSoftening(softening);
+
+		// All substeps of the frame are enqueued back to back; the frame's single sync point is in Render
+		frameSubsteps = SubstepsForFrame();
+		frameStepStart = std::chrono::steady_clock::now();
+		simulation->Step(frameSubsteps);
 	}
-	case 4: {
-		std::normal_distribution<float> noise(0.0f, 0.02f);
-		const float arms = static_cast<float>(spiralArms);
-		for (int i = 0; i < currentNumParticles; ++i) {
-			float t = static_cast<float>(i) / currentNumParticles;
-			float angle = t * arms * 6.0f * static_cast<float>(M_PI);
-			float radius = 0.05f + 0.45f * t;
 
-			float x = std::cos(angle) * radius + noise(rng);
-			float y = std::sin(angle) * radius + noise(rng);
+	// Device time of the commands completed since the last frame (the profiler never waits for the running ones)
+	addSample(frameTimes, info.deltaTimeSec * 1000);
+	addSample(kernelTimes, static_cast<float>(simulation->GetProfiler().Collect()));
+}
 
-			positions[i] = glm::vec2(x, y);
-		}
-		break;
+void CL_CALLBACK MyApp::OnFrameReady(cl_event, cl_int, void* frame) {
+	static_cast<RenderFrame*>(frame)->completed = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+void MyApp::MeasureStepTime(RenderFrame& frame) {
+	using Clock = std::chrono::steady_clock;
+
+	// The callback may still be pending right after the wait; then the end of the wait bounds the completion
+	const Clock::rep completedTicks = frame.completed;
+	const Clock::time_point completed = completedTicks != 0 ? Clock::time_point(Clock::duration(completedTicks)) : Clock::now();
+
+	// The queue is in order: the frame's steps started when they were enqueued or when the previous frame was done
+	if (frame.substeps > 0) {
+		const Clock::time_point started = std::max(frame.enqueued, lastFrameCompleted);
+		const float sampleMs = std::chrono::duration<float, std::milli>(completed - started).count() / frame.substeps;
+		if (sampleMs > 0.0f)
+			stepTimeMs = stepTimeMs > 0.0f ? 0.9f * stepTimeMs + 0.1f * sampleMs : sampleMs;
+		frame.substeps = 0;
 	}
+	lastFrameCompleted = std::max(lastFrameCompleted, completed);
+}
+
+void MyApp::ClearRenderFrames() {
+	simulation->Finish();
+	for (auto& frame : renderFrames) {
+		frame.ready = cl::Event();
+		frame.substeps = 0;
 	}
+	frameIndex = 0;
+}
+
+void MyApp::EndFrame() {
+	if (tracer.EndFrame())
+		SaveTrace();
+}
 
-	std::vector<glm::vec4> posVel(currentNumParticles);
-	for (int i = 0; i < currentNumParticles; ++i) {
-		glm::vec2 p = positions[i];
-		glm::vec2 v = velocities[i];
+void MyApp::SaveTrace() {
+	tracer.Stop();
 
-		posVel[i] = glm::vec4(p.x, p.y, v.x, v.y);
+	// Collects the commands still in flight when the capture ended
+	simulation->Finish();
+	try {
+		tracer.Save(traceFile);
+		traceStatus = "Saved " + std::to_string(tracer.GetEventCount()) + " events to " + traceFile;
+	}
+	catch (const std::exception& e) {
+		traceStatus = e.what();
+	}
+	std::cout << traceStatus << '\n';
+}
+
+void MyApp::SaveCheckpoint() {
+	try {
+		checkpointWriter.Save(*simulation, checkpointFile, initialSeed);
+		checkpointStatus = "Saving step " + std::to_string(simulation->GetStepCount()) + " to " + checkpointFile;
+	}
+	catch (const std::exception& e) {
+		checkpointStatus = e.what();
 	}
+	std::cout << checkpointStatus << '\n';
+}
+
+void MyApp::LoadCheckpoint() {
+	nbody::TraceRecorder::Scope scope(tracer, "LoadCheckpoint");
+	try {
+		checkpointWriter.Wait(); // may still be writing this file
+
+		const nbody::CheckpointFile checkpoint(checkpointFile);
+		const nbody::CheckpointInfo& info = checkpoint.GetInfo();
+		if (info.numParticles > static_cast<std::uint64_t>(maxParticles))
+			throw std::runtime_error("The checkpoint has more particles than the viewer buffers");
+
+		// Grid and world are allocation-time parameters of the simulation
+		const nbody::SimulationConfig& current = simulation->GetConfig();
+		nbody::SimulationConfig config = current;
+		nbody::ApplyCheckpointConfig(info, config);
+		if (config.gridNx != current.gridNx || config.gridNy != current.gridNy || config.worldMinX != current.worldMinX
+		    || config.worldMaxX != current.worldMaxX || config.worldMinY != current.worldMinY || config.worldMaxY != current.worldMaxY) {
+			// Restore uploads the particles and builds the kernels; fresh initial conditions only if it fails
+			CreateSimulation(config, false);
+			try {
+				checkpoint.Restore(*simulation);
+			}
+			catch (const std::exception&) {
+				ResetSimulation();
+				throw;
+			}
+		}
+		else {
+			ClearRenderFrames();
+			checkpoint.Restore(*simulation);
+		}
 
-	glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-	if (glm::vec4* ptr = static_cast<glm::vec4*>(glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY))) {
-		std::copy(posVel.begin(), posVel.end(), ptr);
-		glUnmapBuffer(GL_ARRAY_BUFFER);
+		// The controls are applied to the simulation every frame
+		numParticles = currentNumParticles = static_cast<int>(info.numParticles);
+		initialSeed = info.seed;
+		solverType = static_cast<int>(info.solver);
+		integratorType = static_cast<int>(info.integrator);
+		gravityConstant = info.gravityConstant;
+		maxTimeStep = info.deltaTime;
+		softening = info.softening;
+		theta = info.theta;
+		farFieldRadius = info.farFieldRadius;
+		maxRung = info.maxRung;
+		timestepAccuracy = info.timestepAccuracy;
+		fitBounds = info.boundsInterval > 0;
+		if (fitBounds)
+			boundsInterval = info.boundsInterval;
+		reorderInterval = info.reorderInterval;
+
+		checkpointStatus = "Loaded step " + std::to_string(info.step) + " (" + std::to_string(info.numParticles)
+			+ " particles) from " + checkpointFile;
+	}
+	catch (const std::exception& e) {
+		checkpointStatus = e.what();
 	}
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	std::cout << checkpointStatus << '\n';
+}
 
-	kernelCellIndex.setArg(8, currentNumParticles);
-	kernelComputeCOM.setArg(5, currentNumParticles);
-	kernelUpdate.setArg(8, currentNumParticles);
+void MyApp::OpenReplay(const std::string& fileName) {
+	nbody::TraceRecorder::Scope scope(tracer, "OpenReplay");
+	try {
+		if (!GLEW_ARB_buffer_storage)
+			throw std::runtime_error("Replay needs persistent buffer mapping (OpenGL 4.4 or ARB_buffer_storage)");
+		auto file = std::make_unique<nbody::TrajectoryFile>(fileName);
+		CloseReplay();
+		ClearRenderFrames(); // the simulation stays idle during the replay
+
+		// Immutable storage, mapped once for the whole replay; coherent, so the decoded frames need no flush
+		const GLsizeiptr bytes = ReplayBufferCount * static_cast<GLsizeiptr>(file->GetNumParticles()) * nbody::RenderVertexSize;
+		constexpr GLbitfield mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		replayVbo = createBuffer();
+		glBindBuffer(GL_ARRAY_BUFFER, *replayVbo);
+		glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, mapFlags);
+		replayVertices = static_cast<unsigned char*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, mapFlags));
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		if (!replayVertices) {
+			replayVbo.reset();
+			throw std::runtime_error("Failed to map the replay vertex buffer");
+		}
+		replayVao = createVertexArray();
+		SetupParticleVertexArray(*replayVao, *replayVbo);
+
+		replay = std::move(file);
+		replayFile = fileName;
+		replayRegion = 0;
+		replayPackedFrame = -1;
+		replayFrame = 0;
+		replayPlaying = true;
+		replayClock = 0.0f;
+		replayStatus = "Replaying " + fileName + ": " + std::to_string(replay->GetNumParticles()) + " particles, "
+			+ std::to_string(replay->GetFrameCount()) + " frames" + (replay->IsComplete() ? "" : " (not closed)");
+	}
+	catch (const std::exception& e) {
+		replayStatus = e.what();
+	}
+	std::cout << replayStatus << '\n';
 }
 
-void MyApp::Update(const UpdateInfo& info) {
-	if (!simulation_paused) {
-		float deltaTime = std::clamp(info.deltaTimeSec, 0.0000001f, 0.001f);
-		kernelUpdate.setArg(9, gravityConstant);
-		kernelUpdate.setArg(10, deltaTime);
+void MyApp::CloseReplay() {
+	for (auto& fence : replayFences)
+		fence.reset();
+	replayVao.reset();
+	replayVbo.reset(); // unmaps it
+	replayVertices = nullptr;
+	replay.reset();
+}
 
-		std::vector<cl::Memory> glObjects{ clVboBuffer };
-		queue.enqueueAcquireGLObjects(&glObjects);
-		queue.enqueueNDRangeKernel(kernelCellIndex, cl::NullRange, cl::NDRange(globalParticles), cl::NDRange(localSize));
+void MyApp::UpdateReplay(const UpdateInfo& info) {
+	if (!replayPlaying)
+		return;
+
+	const int lastFrame = static_cast<int>(replay->GetFrameCount()) - 1;
+	replayClock += info.deltaTimeSec * replayFramesPerSecond;
+	const int advance = static_cast<int>(replayClock);
+	replayClock -= static_cast<float>(advance);
+	replayFrame = std::min(replayFrame + advance, lastFrame);
+	if (replayFrame == lastFrame)
+		replayPlaying = false;
+}
 
-		queue.enqueueNDRangeKernel(kernelComputeCOM, cl::NullRange, cl::NDRange(globalCOM), cl::NDRange(localSize));
+void MyApp::RenderReplay() {
+	// A new frame goes to the next region, whose last draw is usually complete: GL keeps reading the others
+	const GLint regionVertices = replay->GetNumParticles();
+	if (replayPackedFrame != replayFrame) {
+		replayRegion = (replayRegion + 1) % ReplayBufferCount;
+		if (replayFences[replayRegion]) {
+			nbody::TraceRecorder::Scope scope(tracer, "Wait for replay buffer");
+			glClientWaitSync(replayFences[replayRegion].get(), GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		}
 
-		queue.enqueueNDRangeKernel(kernelUpdate, cl::NullRange, cl::NDRange(globalParticles), cl::NDRange(localSize));
-		queue.enqueueReleaseGLObjects(&glObjects);
-		queue.finish();
+		nbody::TraceRecorder::Scope scope(tracer, "Decode frame");
+		replay->Seek(static_cast<std::uint64_t>(replayFrame));
+		replay->PackRenderVertices(replayVertices + static_cast<size_t>(replayRegion) * regionVertices * nbody::RenderVertexSize);
+		replayPackedFrame = replayFrame;
 	}
 
-	addSample(frameTimes, info.deltaTimeSec * 1000);
-	addSample(kernelTimes, SDL_GetTicks() - info.elapsedTimeSec * 1000);
+	DrawParticles(*replayVao, replayRegion * regionVertices, regionVertices);
+	replayFences[replayRegion].reset(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
 }
 
-void MyApp::Render() {
+void MyApp::DrawParticles(GLuint vao, GLint first, GLsizei count) {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glDisable(GL_DEPTH_TEST);
 	glDepthMask(GL_FALSE);
@@ -292,13 +432,67 @@ void MyApp::Render() {
 	shaderProgram.SetUniform("particle_size", particleSize);
 	shaderProgram.SetTexture("tex0", 0, *particleTexture);
 
-	glBindVertexArray(*vao);
-	glDrawArrays(GL_POINTS, 0, currentNumParticles);
+	glBindVertexArray(vao);
+	glDrawArrays(GL_POINTS, first, count);
 	glBindVertexArray(0);
 
 	shaderProgram.Off();
 }
 
+int MyApp::SubstepsForFrame() const {
+	if (!adaptiveSubsteps)
+		return substepsPerFrame;
+	if (stepTimeMs <= 0.0f)
+		return 1;
+
+	// As many steps as fit into the simulation's share of the frame; the smoothing of stepTimeMs keeps K from oscillating
+	const float budgetMs = simulationFrameShare * targetFrameTimeMs;
+	return std::clamp(static_cast<int>(budgetMs / stepTimeMs), 1, maxSubstepsPerFrame);
+}
+
+void MyApp::Render() {
+	if (replay) {
+		RenderReplay();
+		return;
+	}
+
+	// Pack the current state into a render buffer only for the frames that are drawn. Synchronously that is
+	// buffer 0 and the frame waits for it. Pipelined, the buffers are written round robin and the frame draws
+	// the one packed in the previous frame, so the device keeps stepping while GL draws.
+	const size_t depth = static_cast<size_t>(pipelineDepth);
+	const size_t writeIndex = frameIndex++ % depth;
+	RenderFrame& written = renderFrames[writeIndex];
+	written.ready = interop.Publish(writeIndex);
+	written.numParticles = currentNumParticles;
+	written.substeps = frameSubsteps;
+	written.enqueued = frameStepStart;
+	written.completed = 0;
+	if (written.ready())
+		written.ready.setCallback(CL_COMPLETE, OnFrameReady, &written);
+	frameSubsteps = 0;
+
+	size_t drawIndex = writeIndex;
+	if (depth > 1) {
+		simulation->GetQueue().flush();
+		const size_t previousIndex = (writeIndex + depth - 1) % depth;
+		if (renderFrames[previousIndex].ready())
+			drawIndex = previousIndex;
+	}
+
+	// Usually complete already when pipelined
+	RenderFrame& drawn = renderFrames[drawIndex];
+	if (drawn.ready()) {
+		nbody::TraceRecorder::Scope scope(tracer, "Wait for frame");
+		drawn.ready.wait();
+		MeasureStepTime(drawn);
+	}
+
+	DrawParticles(*vaos[drawIndex], 0, drawn.ready() ? drawn.numParticles : 0);
+
+	// CL may write this buffer again once the draw is done
+	interop.FenceDraw(drawIndex);
+}
+
 void MyApp::RenderGUI()
 {
 	// ImGui rendering logic would go here
@@ -318,12 +512,57 @@ void MyApp::RenderGUI()
 	// === Kernel timing ===
 	ImGui::Separator();
 	float avgKernel = average(kernelTimes);
-	ImGui::Text("Kernel time: %.3f ms (avg over %zu frames)", avgKernel, kernelTimes.size());
+	ImGui::Text("Device time: %.3f ms per frame (avg over %zu frames)", avgKernel, kernelTimes.size());
 	auto vec_kernelTimes = std::vector<float>(kernelTimes.begin(), kernelTimes.end());
 	ImGui::PlotLines("Kernel Time (ms)", vec_kernelTimes.data(),
 		static_cast<int>(kernelTimes.size()), 0, nullptr, 0.0f, avgKernel * 3.0f,
 		ImVec2(0, 60));
 
+	// Per kernel (and GL acquire/release): min/avg/p95 of the recent calls, share of the device time since the reset
+	const auto kernelStats = simulation->GetProfiler().GetStats();
+	double totalDeviceMs = 0.0;
+	for (const auto& stats : kernelStats)
+		totalDeviceMs += stats.totalMs;
+	if (ImGui::BeginTable("Kernels", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit)) {
+		for (const char* header : { "Kernel", "Calls", "Min (ms)", "Avg (ms)", "p95 (ms)", "Share" })
+			ImGui::TableSetupColumn(header);
+		ImGui::TableHeadersRow();
+		for (const auto& stats : kernelStats) {
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn(); ImGui::TextUnformatted(stats.name.c_str());
+			ImGui::TableNextColumn(); ImGui::Text("%zu", stats.calls);
+			ImGui::TableNextColumn(); ImGui::Text("%.4f", stats.minMs);
+			ImGui::TableNextColumn(); ImGui::Text("%.4f", stats.avgMs);
+			ImGui::TableNextColumn(); ImGui::Text("%.4f", stats.p95Ms);
+			ImGui::TableNextColumn(); ImGui::Text("%.1f%%", totalDeviceMs > 0.0 ? 100.0 * stats.totalMs / totalDeviceMs : 0.0);
+		}
+		ImGui::EndTable();
+	}
+	if (ImGui::Button("Reset kernel statistics")) {
+		simulation->GetProfiler().Reset();
+	}
+
+	// === Trace capture ===
+	if (tracer.IsRecording()) {
+		if (ImGui::Button("Stop and save trace")) {
+			SaveTrace();
+		}
+		ImGui::SameLine();
+		ImGui::Text("Recording (%zu events)", tracer.GetEventCount());
+	}
+	else {
+		ImGui::SliderInt("Trace frames", &traceFrames, 1, 600);
+		if (ImGui::Button("Capture trace")) {
+			tracer.Start(traceFrames);
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Start trace")) {
+			tracer.Start();
+		}
+		if (!traceStatus.empty())
+			ImGui::TextUnformatted(traceStatus.c_str());
+	}
+
 	// === Compute–Render Ratio ===
 	ImGui::Separator();
 	if (avgFrame > 0.0f)
@@ -360,12 +599,116 @@ void MyApp::RenderGUI()
 		ImGui::SliderInt("Spiral arms", &spiralArms, 1, 2);
 	}
 
+	ImGui::Separator();
+	ImGui::Text("Solver");
+	ImGui::RadioButton("Uniform grid", &solverType, 0);
+	ImGui::SameLine();
+	ImGui::RadioButton("Barnes-Hut", &solverType, 1);
+	ImGui::SameLine();
+	ImGui::RadioButton("FMM", &solverType, 2);
+	ImGui::RadioButton("PM", &solverType, 3);
+	ImGui::SameLine();
+	ImGui::BeginDisabled(!nbody::SupportsP3M(simulation->GetConfig()));
+	ImGui::RadioButton("P3M", &solverType, 4);
+	ImGui::EndDisabled();
+	ImGui::SameLine();
+	ImGui::RadioButton("Exact", &solverType, 5);
+	if (solverType == 0) {
+		ImGui::SliderInt("Far field radius (cells)", &farFieldRadius, 1, 8);
+	}
+	if (solverType == 1) {
+		ImGui::SliderFloat("Opening angle (theta)", &theta, 0.1f, 1.5f, "%.2f");
+	}
+	if (solverType <= 2) {
+		ImGui::Checkbox("Fit grid to the particles", &fitBounds);
+		if (fitBounds) {
+			ImGui::SameLine();
+			ImGui::SliderInt("every n steps", &boundsInterval, 1, 64);
+		}
+	}
+	ImGui::SliderFloat("Softening", &softening, 0.00001f, 0.01f, "%.5f", ImGuiSliderFlags_Logarithmic);
+	if (simulation->IsBuildingProgram()) {
+		ImGui::TextUnformatted("Building kernel variant...");
+	}
+	ImGui::TextUnformatted(tuningStatus.c_str());
+	if (ImGui::Button("Autotune for this solver and particle count")) {
+		Autotune();
+	}
+
+	ImGui::Separator();
+	ImGui::Text("Integrator");
+	ImGui::RadioButton("Euler", &integratorType, 0);
+	ImGui::SameLine();
+	ImGui::RadioButton("Leapfrog (KDK)", &integratorType, 1);
+	ImGui::SameLine();
+	ImGui::RadioButton("Yoshida 4th", &integratorType, 2);
+	ImGui::SliderFloat("Max time step", &maxTimeStep, 0.0001f, 0.01f, "%.4f");
+	ImGui::SliderInt("Block timestep rungs", &maxRung, 0, 6);
+	ImGui::SliderInt("Morton reorder every n steps (0 = off)", &reorderInterval, 0, 200);
+	if (maxRung > 0) {
+		ImGui::SliderFloat("Timestep accuracy (eta)", &timestepAccuracy, 0.005f, 0.2f, "%.3f");
+	}
+
 	ImGui::Separator();
 	ImGui::Text("Simulation Controls");
 	ImGui::Checkbox("Pause Simulation", &simulation_paused);
+	if (ImGui::Checkbox("VSync", &vsync)) {
+		SDL_GL_SetSwapInterval(vsync ? 1 : 0);
+	}
+	ImGui::Text("CL/GL pipelining (%s)", interop.HasGLEvents() ? "cl_khr_gl_event" : "host fence wait");
+	bool pipelineChanged = ImGui::RadioButton("Off", &pipelineDepth, 1);
+	ImGui::SameLine();
+	pipelineChanged |= ImGui::RadioButton("Double buffered", &pipelineDepth, 2);
+	ImGui::SameLine();
+	pipelineChanged |= ImGui::RadioButton("Triple buffered", &pipelineDepth, 3);
+	if (pipelineChanged) {
+		ClearRenderFrames();
+	}
+	ImGui::Checkbox("Adaptive substeps", &adaptiveSubsteps);
+	if (adaptiveSubsteps) {
+		ImGui::SliderFloat("Target frame time (ms)", &targetFrameTimeMs, 4.0f, 50.0f, "%.1f");
+		ImGui::Text("Substeps per frame: %d (%.3f ms per step)", SubstepsForFrame(), stepTimeMs);
+	}
+	else {
+		ImGui::SliderInt("Substeps per frame", &substepsPerFrame, 1, maxSubstepsPerFrame);
+	}
 	if (ImGui::Button("Reset simulation")) {
 		ResetSimulation();
 	}
+	if (ImGui::Button("Save checkpoint")) {
+		SaveCheckpoint();
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Load checkpoint")) {
+		LoadCheckpoint();
+	}
+	ImGui::SameLine();
+	ImGui::TextUnformatted(checkpointWriter.IsWriting() ? "Writing..." : checkpointStatus.c_str());
+
+	// === Replay ===
+	ImGui::Separator();
+	ImGui::Text("Replay");
+	if (replay) {
+		const int lastFrame = static_cast<int>(replay->GetFrameCount()) - 1;
+		ImGui::SliderInt("Frame", &replayFrame, 0, lastFrame);
+		ImGui::Text("Step %llu, t = %.4f", static_cast<unsigned long long>(replay->GetFrameStep(replayFrame)),
+			replay->GetFrameTime(replayFrame));
+		if (ImGui::Button(replayPlaying ? "Pause" : "Play")) {
+			if (!replayPlaying && replayFrame == lastFrame)
+				replayFrame = 0;
+			replayPlaying = !replayPlaying;
+		}
+		ImGui::SameLine();
+		ImGui::SliderFloat("Frames per second", &replayFramesPerSecond, 1.0f, 240.0f, "%.0f", ImGuiSliderFlags_Logarithmic);
+		if (ImGui::Button("Back to the simulation")) {
+			CloseReplay();
+		}
+	}
+	else if (ImGui::Button("Replay trajectory")) {
+		OpenReplay(replayFile);
+	}
+	if (!replayStatus.empty())
+		ImGui::TextUnformatted(replayStatus.c_str());
 
 	ImGui::End();
 }
@@ -22,8 +22,22 @@
 #include <oclutils.hpp>
 #include <oglutils.hpp>
 
+// Simulation
+#include <Autotuner.h>
+#include <Checkpoint.h>
+#include <ProgramCache.h>
+#include <Simulation.h>
+#include <TraceRecorder.h>
+#include <Trajectory.h>
+#include "GLInteropAdapter.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <sstream>
 #include <vector>
 #include <string>
@@ -57,55 +71,91 @@ public:
 
 	void ResetSimulation();
 
+	// Shows a recorded trajectory (see nbody::TrajectoryWriter) instead of simulating; CloseReplay returns to the simulation
+	void OpenReplay(const std::string& fileName);
+	void CloseReplay();
+
+	// Timeline of the host scopes (mainLoop, Render) and the device commands
+	nbody::TraceRecorder& GetTracer() { return tracer; }
+
+	// Called after the buffer swap: closes the frame of a running trace capture and saves a finished one
+	void EndFrame();
+
 private:
+	// State of the simulation packed into one render buffer
+	struct RenderFrame {
+		cl::Event ready;                                  // release of the packed VBO
+		int numParticles = 0;
+		int substeps = 0;                                 // simulation steps enqueued before the packing
+		std::chrono::steady_clock::time_point enqueued;   // when those steps were enqueued
+		std::atomic<std::chrono::steady_clock::rep> completed{ 0 }; // set by OnFrameReady
+	};
+
+	static void CL_CALLBACK OnFrameReady(cl_event event, cl_int status, void* frame);
+
+	int  SubstepsForFrame() const;
+	void MeasureStepTime(RenderFrame& frame);
+	void ClearRenderFrames();
+	// Replaces the simulation; 'reset' generates its initial conditions (skipped when a checkpoint is restored next)
+	void CreateSimulation(const nbody::SimulationConfig& config, bool reset = true);
+	void Autotune();
+	void SaveTrace();
+	void SaveCheckpoint();
+	void LoadCheckpoint();
+	void UpdateReplay(const UpdateInfo& info);
+	void RenderReplay();
+	void DrawParticles(GLuint vao, GLint first, GLsizei count);
+
 	// Window
 	int windowWidth = 0;
 	int windowHeight = 0;
 
-	// Grids (2D)
-	int gridNx = 64;
-	int gridNy = 64;
-	int totalCells = gridNx * gridNy;
-
-	// World size
-	float worldMinX = -1.0f;
-	float worldMaxX = 1.0f;
-	float worldMinY = -1.0f;
-	float worldMaxY = 1.0f;
-
-	// Grid sizes
-	float cellSizeX = (worldMaxX - worldMinX) / gridNx;
-	float cellSizeY = (worldMaxY - worldMinY) / gridNy;
-	float cellSizeInvX = 1.0f / cellSizeX;
-	float cellSizeInvY = 1.0f / cellSizeY;
-	float cellSize = fmax(cellSizeX, cellSizeY);
-
 	// OpenGL
-	UniqueGlVertexArray vao;
-	UniqueGlBuffer      vbo;
+	// Ring of render buffers for the pipelined mode (only the first one is used synchronously)
+	static constexpr int RenderBufferCount = 3;
+	std::array<UniqueGlVertexArray, RenderBufferCount> vaos;
+	std::array<UniqueGlBuffer, RenderBufferCount>      vbos;
 	UniqueGlTexture     particleTexture;
 	gShaderProgram      shaderProgram;
 
 	// OpenCL
 	cl::Context       context;
-	cl::CommandQueue  queue;
-	cl::Program       program;
-	cl::Kernel        kernelUpdate;
-
-	// New kernels for grid and COM
-	cl::Kernel        kernelCellIndex;
-	cl::Kernel		  kernelComputeCOM;
-
-	cl::BufferGL      clVboBuffer;
-	cl::Buffer        clVelocities;
-	cl::Buffer        clMasses;
-
-	// Grid buffer
-	cl::Buffer clParticleCellIndex;
-
-	// COM buffers
-	cl::Buffer clCellMass;
-	cl::Buffer clCellCOM;
+	cl::Device        device;
+
+	// Chrome trace capture: fixed number of frames or started/stopped by hand
+	nbody::TraceRecorder tracer;
+	int         traceFrames = 120;
+	std::string traceFile = "nbody_trace.json";
+	std::string traceStatus;
+
+	// Checkpoints of the running simulation, written in the background
+	nbody::CheckpointWriter checkpointWriter;
+	std::string checkpointFile = "nbody_checkpoint.bin";
+	std::string checkpointStatus;
+	std::uint64_t initialSeed = 0; // seed of the current initial conditions (stored in the checkpoints)
+
+	// Replay of a trajectory file: every new frame is decoded straight into the next region of a persistently
+	// mapped vertex buffer (one frame per region), once the fence of the last draw from that region has signaled
+	static constexpr int ReplayBufferCount = 3;
+	std::unique_ptr<nbody::TrajectoryFile> replay;
+	std::string         replayFile = "nbody_trajectory.trj";
+	std::string         replayStatus;
+	UniqueGlBuffer      replayVbo;
+	UniqueGlVertexArray replayVao;
+	unsigned char*      replayVertices = nullptr; // mapping of replayVbo
+	std::array<UniqueGlSync, ReplayBufferCount> replayFences;
+	int   replayRegion = 0;        // region holding replayPackedFrame
+	int   replayPackedFrame = -1;
+	int   replayFrame = 0;         // frame to draw
+	bool  replayPlaying = true;
+	float replayFramesPerSecond = 30.0f;
+	float replayClock = 0.0f;      // fraction of the next frame elapsed
+
+	// Headless simulation engine and its GL interop adapter
+	std::unique_ptr<nbody::Simulation> simulation;
+	GLInteropAdapter  interop;
+	std::array<RenderFrame, RenderBufferCount> renderFrames;
+	size_t frameIndex = 0;
 
 	// Simulation parameters
 	static constexpr float particleSize = 0.01f;
@@ -113,10 +163,11 @@ private:
 	static constexpr float massiveObjectMass = 1.0f;
 
 	// ImGui
-	static constexpr int maxParticles = 50000;  // buffer capacity
+	static constexpr int maxParticles = 200000; // buffer capacity
 	int numParticles = 20000;
 	int currentNumParticles = 20000;
 	float gravityConstant = 0.0001f;
+	float maxTimeStep = 0.001f; // upper clamp of the frame time used as the step
 
 	// Initial distribution type (0..4)
 	// 0 = Uniform random
@@ -129,10 +180,61 @@ private:
 	// extra parameter for Spiral galaxy initial distribution (1..4)
 	int spiralArms = 2;
 
-	// GPU Optimization helpers
-	const size_t localSize = 128;
-	const size_t globalParticles = ((size_t)maxParticles + localSize - 1) / localSize * localSize;
-	const size_t globalCOM = ((size_t)totalCells) * localSize;
+	// Force solver (see nbody::SolverType)
+	// 0 = Uniform grid
+	// 1 = Barnes-Hut
+	// 2 = FMM
+	// 3 = PM
+	// 4 = P3M
+	// 5 = Exact (all pairs)
+	int solverType = 0;
+
+	// Barnes-Hut opening angle
+	float theta = 0.5f;
+
+	// Softening of the forces, compiled into the kernels (a change builds a new variant in the background)
+	float softening = nbody::DefaultSoftening;
+
+	// Grid: distance (in cells of a pyramid level) from which a whole pyramid cell is used for the far field
+	int farFieldRadius = 1;
+
+	// Grid, Barnes-Hut and FMM: refit the world to the particle bounding box every boundsInterval force evaluations
+	bool fitBounds = false;
+	int boundsInterval = 4;
+
+	// Sort the particle arrays by Morton code every reorderInterval steps (0 = off) for coherent memory access
+	int reorderInterval = 0;
+
+	// Time integrator (see nbody::Integrator)
+	// 0 = Euler (semi-implicit)
+	// 1 = Leapfrog (KDK)
+	// 2 = Yoshida 4th order
+	int integratorType = 0;
+
+	// Block timesteps: 2^maxRung substeps per step (0 = off) and accuracy parameter eta
+	int maxRung = 0;
+	float timestepAccuracy = 0.025f;
+
+	// Simulation steps per rendered frame: fixed, or adaptive (fitted to the target frame time from the measured step time)
+	static constexpr int   maxSubstepsPerFrame = 64;
+	static constexpr float simulationFrameShare = 0.75f; // part of the target frame time left to the simulation
+	int   substepsPerFrame = 1;
+	bool  adaptiveSubsteps = false;
+	float targetFrameTimeMs = 16.7f;
+	bool  vsync = true;
+
+	// Render buffers in flight: 1 = synchronous (wait for every frame), 2/3 = draw the previous frame's buffer
+	// while the device steps and packs the next one
+	int   pipelineDepth = 1;
+
+	// Substeps enqueued in the current frame and when; smoothed device time of one step and end of the last measured frame
+	int   frameSubsteps = 0;
+	std::chrono::steady_clock::time_point frameStepStart;
+	float stepTimeMs = 0.0f;
+	std::chrono::steady_clock::time_point lastFrameCompleted;
+
+	// Work-group size and grid of the running simulation (from the autotuning cache when tuned)
+	std::string tuningStatus;
 
 	// Application state
 	bool simulation_paused = false;
@@ -120,21 +120,34 @@ void mainLoop(SDL_Window* window, MyApp& app) {
     };
     lastTick = currentTick;
 
-    // Update and render application logic
-    app.Update(updateInfo);
-
-    app.Render();
+    // Update and render application logic (the scopes are recorded while a trace capture runs)
+    nbody::TraceRecorder& tracer = app.GetTracer();
+    {
+      nbody::TraceRecorder::Scope scope(tracer, "Update");
+      app.Update(updateInfo);
+    }
+    {
+      nbody::TraceRecorder::Scope scope(tracer, "Render");
+      app.Render();
+    }
 
     // Render ImGui UI
-    ImGui_ImplOpenGL3_NewFrame();
-    ImGui_ImplSDL3_NewFrame();
-    ImGui::NewFrame();
-    if (showImGui) app.RenderGUI();
-    ImGui::Render();
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-
-    // Swap buffers
-    SDL_GL_SwapWindow(window);
+    {
+      nbody::TraceRecorder::Scope scope(tracer, "RenderGUI");
+      ImGui_ImplOpenGL3_NewFrame();
+      ImGui_ImplSDL3_NewFrame();
+      ImGui::NewFrame();
+      if (showImGui) app.RenderGUI();
+      ImGui::Render();
+      ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    }
+
+    // Swap buffers (includes the vsync wait)
+    {
+      nbody::TraceRecorder::Scope scope(tracer, "SwapWindow");
+      SDL_GL_SwapWindow(window);
+    }
+    app.EndFrame();
   }
 }
 
@@ -180,6 +193,10 @@ int main(int argc, char* args[]) {
       app.InitGL();
       app.InitCL();
 
+      // A trajectory file argument starts in replay mode
+      if (argc > 1)
+        app.OpenReplay(args[1]);
+
       mainLoop(window.get(), app);
     } // app destructor runs here, before OpenGL context is destroyed
 
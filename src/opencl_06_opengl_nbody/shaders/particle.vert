@@ -1,6 +1,7 @@
 #version 150
 
-in vec4 vs_in_pos;
+in vec2 vs_in_pos;
+in float vs_in_speed; // speed / maxSpeed in [0, 1]
  
 out Vertex
 {
@@ -9,14 +10,9 @@ out Vertex
  
 void main()
 {
-	vec2 pos = vs_in_pos.xy;
-    vec2 vel = vs_in_pos.zw;
-	gl_Position = vec4(pos, 0, 1);
+	gl_Position = vec4(vs_in_pos, 0, 1);
     
-	 // compute speed magnitude
-    float speed = length(vel);
-    float maxSpeed = 4.0; 
-    float t = clamp(speed / maxSpeed, 0.0, 1.0);
-    vec3 color = mix(vec3(1.0,1.0,1.0), vec3(1.0,0.0,0.0), t);
+	// white -> red with increasing speed
+    vec3 color = mix(vec3(1.0,1.0,1.0), vec3(1.0,0.0,0.0), vs_in_speed);
     vertex.color = vec4(color, 1.0);
-}
\ No newline at end of file
+}